@@ -27,6 +27,7 @@
 
 #include "hashtable.h"
 #include "murmur3.h"
+#include "wyhash.h"
 
 /******************************************************************************
 
@@ -36,11 +37,18 @@
 	Functions returning bool return true on success and false
 	on failure. After they return false once, the table is unusable.
 
-	There are no functions to support lookup. To look up a value, use
-	the hash function modulo the table size to get the first possible
-	position, then iterate over the items in the table (looping at the
-	end) until you either find the entry or encounter EMPTYHASH (which
-	means the item was not in the table).
+	To look up a value, use hashprobe_start() and hashprobe_next() (see
+	hashtable.h). For plain tables these start at the hash function modulo
+	the table size and iterate over the items in the table (looping at the
+	end) until they encounter EMPTYHASH (which means the item was not in
+	the table).
+
+	Tables created with newgrouphash() are probed a group of 16 slots at
+	a time instead, using a control byte per slot that holds 7 bits of the
+	hash. They don't rehash everything at once when they grow: the entries
+	are moved to the new table a group at a time while more are added, and
+	until then lookups check both tables. Use flattenhash() to turn them
+	into a plain array of entries with EMPTYHASH in the unused slots.
 
 ******************************************************************************/
 
@@ -48,7 +56,11 @@
 #define MIN_FREE(size) ((size) >> 3)
 #define ENTRY_NOT_FOUND __SIZE_MAX__
 
-static const struct hashtable hashtable_0 = {NULL, 0, START_ORDER};
+#ifndef HAVE_QSORT_R
+extern void qsort_r(void *, size_t, size_t, int (*)(const void *, const void *, void *), void *);
+#endif
+
+static const struct hashtable hashtable_0 = {NULL, 0, START_ORDER, NULL, NULL, NULL, 0, 0};
 //static const struct hashentry hashentry_0 = {0, EMPTYHASH};
 
 /* hashing function (Fowler-Noll-Vo 1a) */
@@ -65,6 +77,12 @@ uint32_t calchash_murmur3(const uint8_t *key, size_t len, uint32_t seed) {
 	return hash;
 }
 
+/* folds the 64-bit wyhash into the 32 bits used by the hash tables */
+uint32_t calchash_wyhash(const uint8_t *key, size_t len, uint32_t seed) {
+	uint64_t hash = wyhash(key, len, seed);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
 static inline uint32_t size_to_mask(uint32_t size) {
 	return size - UINT32_C(1);
 }
@@ -151,8 +169,139 @@ static bool rehash(struct hashtable *ht, order_t new_order) {
 	return true;
 }
 
+/* add a value to the first free slot along its probe sequence */
+static void addgrouphash_raw(struct hashtable *ht, uint32_t hash, uint32_t data) {
+	uint8_t *ctrl = ht->ctrl;
+	uint32_t mask = order_to_size(ht->order - GROUPORDER) - 1;
+	uint32_t group = hash_to_group(hash, ht->order);
+
+	for(uint32_t step = 1;; step++) {
+		hashgroup_t v;
+		uint32_t empty;
+		memcpy(&v, ctrl + ((size_t)group << GROUPORDER), sizeof v);
+		empty = hashgroup_mask((hashgroup_t)(v == 0));
+		if(empty) {
+			uint32_t offset = (group << GROUPORDER) | (uint32_t)__builtin_ctz(empty);
+			ctrl[offset] = hash_to_tag(hash);
+			ht->entries[offset].hash = hash;
+			ht->entries[offset].data = data;
+			return;
+		}
+		group = (group + step) & mask;
+	}
+}
+
+/* move a group of the previous table over to the current one */
+static void migrate_group(struct hashtable *ht) {
+	uint32_t base = ht->old_group << GROUPORDER;
+
+	for(uint32_t i = 0; i < GROUPSIZE; i++) {
+		if(ht->old_ctrl[base + i]) {
+			struct hashentry *entry = ht->old_entries + base + i;
+			addgrouphash_raw(ht, entry->hash, entry->data);
+		}
+	}
+
+	if(++ht->old_group == order_to_size(ht->old_order - GROUPORDER)) {
+		free_entries(ht->old_entries);
+		free(ht->old_ctrl);
+		ht->old_entries = NULL;
+		ht->old_ctrl = NULL;
+		ht->old_order = 0;
+		ht->old_group = 0;
+	}
+}
+
+/* Start using a table twice the size. The control bytes are zeroed by
+	calloc(), which gets them from the kernel as untouched pages for large
+	tables, and the entries don't need initializing at all. */
+static bool growgrouphash(struct hashtable *ht) {
+	order_t new_order = ht->order + 1;
+	uint8_t *new_ctrl = calloc(order_to_size(new_order), 1);
+	struct hashentry *new_entries = malloc((size_t)order_to_size(new_order) * sizeof *new_entries);
+	if(!new_ctrl || !new_entries) {
+		free(new_ctrl);
+		free_entries(new_entries);
+		return false;
+	}
+
+	/* normally long done, since a group is moved for each entry added */
+	while(ht->old_ctrl)
+		migrate_group(ht);
+
+	ht->old_entries = ht->entries;
+	ht->old_ctrl = ht->ctrl;
+	ht->old_order = ht->order;
+	ht->old_group = 0;
+	ht->entries = new_entries;
+	ht->ctrl = new_ctrl;
+	ht->order = new_order;
+
+	return true;
+}
+
+/* Add an element to a group-probed table. Before the table fills up
+	again, all groups of the previous table have been moved: it had at
+	most 7/8 of a group's worth of entries per group, and the new one has
+	room for as many more. */
+static bool addgrouphash(struct hashtable *ht, uint32_t hash, uint32_t data) {
+	uint32_t fill = ht->fill + 1;
+	size_t size = order_to_size(ht->order);
+
+	if(ht->old_ctrl)
+		migrate_group(ht);
+	else if(fill > size - MIN_FREE(size) && !growgrouphash(ht))
+		return false;
+
+	addgrouphash_raw(ht, hash, data);
+	ht->fill = fill;
+
+	return true;
+}
+
+/* allocate and initialize a group-probed hash table */
+struct hashtable *newgrouphash(void) {
+	struct hashtable *ht = malloc(sizeof *ht);
+	if(ht) {
+		*ht = hashtable_0;
+		ht->ctrl = calloc(order_to_size(ht->order), 1);
+		ht->entries = malloc((size_t)order_to_size(ht->order) * sizeof *ht->entries);
+		if(!ht->ctrl || !ht->entries) {
+			free(ht->ctrl);
+			free_entries(ht->entries);
+			free(ht);
+			ht = NULL;
+		}
+	}
+	return ht;
+}
+
+/* turn a group-probed table into a plain array of entries, with EMPTYHASH
+	in the unused slots. No more elements can be added afterwards. */
+void flattenhash(struct hashtable *ht) {
+	if(!ht->ctrl)
+		return;
+
+	while(ht->old_ctrl)
+		migrate_group(ht);
+
+	uint32_t size = order_to_size(ht->order);
+	for(uint32_t offset = 0; offset < size; offset++) {
+		if(!ht->ctrl[offset]) {
+			ht->entries[offset].hash = EMPTYHASH;
+			ht->entries[offset].data = EMPTYHASH;
+		}
+	}
+
+	free(ht->ctrl);
+	ht->ctrl = NULL;
+}
+
 /* add an element and check if the hash table hasn't become too large */
 bool addhash(struct hashtable *ht, uint32_t hash, uint32_t data) {
+	if(ht->ctrl)
+		return addgrouphash(ht, hash, data);
+
 	uint32_t fill = ht->fill + 1;
 	order_t order = ht->order;
 
@@ -182,9 +331,73 @@ struct hashtable *newhash(void) {
 	return ht;
 }
 
+/* sort entries on hash value, using an LSD radix sort that skips bytes that
+	are the same for all entries. Entries with the same hash are then put in
+	order using the supplied comparison function. If no scratch memory is
+	available, qsort_r() does all the work instead. */
+void sorthash(struct hashentry *entries, size_t num, int (*compar)(const void *, const void *, void *), void *arg) {
+	struct hashentry *scratch, *src, *dst, *tmp;
+	size_t counts[4][256] = {{0}}, *count, sum, n, i, j;
+	uint32_t hash;
+	unsigned int pass, shift;
+
+	if(num < 2)
+		return;
+
+	scratch = malloc(num * sizeof *scratch);
+	if(!scratch) {
+		qsort_r(entries, num, sizeof *entries, compar, arg);
+		return;
+	}
+
+	for(i = 0; i < num; i++) {
+		hash = entries[i].hash;
+		counts[0][hash & 255]++;
+		counts[1][(hash >> 8) & 255]++;
+		counts[2][(hash >> 16) & 255]++;
+		counts[3][hash >> 24]++;
+	}
+
+	src = entries;
+	dst = scratch;
+	for(pass = 0; pass < 4; pass++) {
+		shift = pass * 8;
+		count = counts[pass];
+		if(count[(src->hash >> shift) & 255] == num)
+			continue;
+
+		for(sum = 0, i = 0; i < 256; i++) {
+			n = count[i];
+			count[i] = sum;
+			sum += n;
+		}
+
+		for(i = 0; i < num; i++)
+			dst[count[(src[i].hash >> shift) & 255]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if(src != entries)
+		memcpy(entries, src, num * sizeof *entries);
+	free(scratch);
+
+	for(i = 0; i < num; i = j) {
+		hash = entries[i].hash;
+		for(j = i + 1; j < num && entries[j].hash == hash; j++);
+		if(j - i > 1)
+			qsort_r(entries + i, j - i, sizeof *entries, compar, arg);
+	}
+}
+
 void freehash(struct hashtable *ht) {
 	if(ht) {
 		free_entries(ht->entries);
+		free(ht->ctrl);
+		free_entries(ht->old_entries);
+		free(ht->old_ctrl);
 		free(ht);
 	}
 }
@@ -21,7 +21,12 @@
 #ifndef HARDHAT_HASHTABLE_H
 #define HARDHAT_HASHTABLE_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 struct hashentry {
 	uint32_t hash;
@@ -34,16 +39,50 @@ struct hashtable {
 	struct hashentry *entries;
 	uint32_t fill;
 	order_t order;
+	/* For group-probed tables (see newgrouphash()): one control byte per
+		slot, 0 for empty slots. NULL for plain tables. */
+	uint8_t *ctrl;
+	/* While a group-probed table grows, the previous table, whose
+		groups below old_group have been moved over already */
+	struct hashentry *old_entries;
+	uint8_t *old_ctrl;
+	order_t old_order;
+	uint32_t old_group;
+};
+
+/* iterates over the entries of a table that may match a hash, see
+	hashprobe_start() */
+struct hashprobe {
+	const struct hashtable *ht;
+	const struct hashentry *entries;
+	/* NULL for plain tables */
+	const uint8_t *ctrl;
+	/* the group being probed (the slot, for plain tables) */
+	uint32_t group;
+	uint32_t mask;
+	/* number of groups probed so far (slots, for plain tables) */
+	uint32_t step;
+	uint32_t matches;
+	uint32_t empty;
+	order_t shift;
+	uint8_t tag;
+	bool old;
 };
 
 #define EMPTYHASH UINT32_MAX
 #define PHI UINT32_C(2654435769)
 #define THEORY 1
+#define GROUPORDER 4
+#define GROUPSIZE (UINT32_C(1) << GROUPORDER)
 
 extern uint32_t calchash_fnv1a(const uint8_t *key, size_t len);
 extern uint32_t calchash_murmur3(const uint8_t *key, size_t len, uint32_t seed);
+extern uint32_t calchash_wyhash(const uint8_t *key, size_t len, uint32_t seed);
 extern struct hashtable *newhash(void);
+extern struct hashtable *newgrouphash(void);
 extern bool addhash(struct hashtable *ht, uint32_t hash, uint32_t data);
+extern void flattenhash(struct hashtable *ht);
+extern void sorthash(struct hashentry *entries, size_t num, int (*compar)(const void *, const void *, void *), void *arg);
 extern void freehash(struct hashtable *ht);
 
 static inline order_t order_to_shift(order_t order) {
@@ -66,4 +105,135 @@ static inline uint32_t difference(uint32_t a, uint32_t b, uint32_t mask) {
 	return (a - b) & mask;
 }
 
+typedef uint8_t hashgroup_t __attribute__((vector_size(GROUPSIZE)));
+
+/* the control byte for full slots: the low 7 bits of the hash, which
+	are independent of the bits that select the group */
+static inline uint8_t hash_to_tag(uint32_t hash) {
+	return (uint8_t)(0x80 | (hash & 0x7F));
+}
+
+static inline uint32_t hash_to_group(uint32_t hash, order_t order) {
+	return hash_to_offset(hash, order_to_shift(order - GROUPORDER));
+}
+
+/* turns the result of comparing a group of control bytes (0 or 0xFF per
+	byte) into a bit mask with a bit per slot */
+static inline uint32_t hashgroup_mask(hashgroup_t v) {
+#ifdef __SSE2__
+	return (uint32_t)_mm_movemask_epi8((__m128i)v);
+#else
+	uint64_t words[2];
+	uint32_t mask = 0;
+	memcpy(words, &v, sizeof words);
+	for(unsigned int i = 0; i < 2; i++) {
+		uint64_t word = words[i];
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		word = __builtin_bswap64(word);
+#endif
+		word = ((word & UINT64_C(0x8080808080808080)) * UINT64_C(0x0002040810204081)) >> 56;
+		mask |= (uint32_t)word << (i * 8);
+	}
+	return mask;
+#endif
+}
+
+/* compare all control bytes of a group at once, using the compiler's
+	generic vectors so it becomes SSE2 or NEON code where available */
+static inline void hashprobe_load(struct hashprobe *p) {
+	hashgroup_t v;
+	memcpy(&v, p->ctrl + ((size_t)p->group << GROUPORDER), sizeof v);
+	p->matches = hashgroup_mask((hashgroup_t)(v == p->tag));
+	p->empty = hashgroup_mask((hashgroup_t)(v == 0));
+}
+
+static inline void hashprobe_table(struct hashprobe *p, uint32_t hash, const struct hashentry *entries, const uint8_t *ctrl, order_t order) {
+	p->entries = entries;
+	p->ctrl = ctrl;
+	p->mask = order_to_size(order - GROUPORDER) - 1;
+	p->group = hash_to_group(hash, order);
+	p->step = 0;
+	hashprobe_load(p);
+}
+
+/* Start looking up a hash in a table. Call hashprobe_next() to get the
+	candidates. */
+static inline void hashprobe_start(struct hashprobe *p, const struct hashtable *ht, uint32_t hash) {
+	p->ht = ht;
+	p->shift = order_to_shift(ht->order);
+	p->tag = hash_to_tag(hash);
+	p->old = false;
+	if(!ht->ctrl) {
+		p->entries = ht->entries;
+		p->ctrl = NULL;
+		p->mask = shift_to_mask(p->shift);
+		p->group = hash_to_offset(hash, p->shift);
+		p->step = 0;
+		p->matches = p->empty = 0;
+		return;
+	}
+	hashprobe_table(p, hash, ht->entries, ht->ctrl, ht->order);
+}
+
+/* hashprobe_next() for plain tables: walk the slots from the one the hash
+	maps to until an empty one */
+static inline const struct hashentry *hashprobe_next_plain(struct hashprobe *p, uint32_t hash) {
+	for(;;) {
+		const struct hashentry *entry = p->entries + p->group;
+		if(entry->data == EMPTYHASH)
+			return NULL;
+#if THEORY
+		// Faster in theory, not necessarily in practice: entries are kept
+		// sorted by their distance from home, so once that distance is less
+		// than ours the hash can't be further along
+		if(__builtin_expect(difference(p->group, hash_to_offset(entry->hash, p->shift), p->mask) < p->step, 1))
+			return NULL;
+#endif
+		p->group = (p->group + 1) & p->mask;
+		p->step++;
+		if(entry->hash == hash)
+			return entry;
+	}
+}
+
+/* Returns the next entry that may hold the hash, or NULL if there are
+	none left. For group-probed tables the caller still needs to compare
+	the hashes. */
+static inline const struct hashentry *hashprobe_next(struct hashprobe *p, uint32_t hash) {
+	if(!p->ctrl)
+		return hashprobe_next_plain(p, hash);
+	for(;;) {
+		if(p->matches) {
+			uint32_t slot = (uint32_t)__builtin_ctz(p->matches);
+			p->matches &= p->matches - 1;
+			/* groups of the previous table that were moved are stale */
+			if(p->old && p->group < p->ht->old_group)
+				continue;
+			return p->entries + ((p->group << GROUPORDER) | slot);
+		}
+		if(p->empty) {
+			/* an empty slot ends the chain; try the previous table */
+			if(p->old || !p->ht->old_ctrl)
+				return NULL;
+			p->old = true;
+			hashprobe_table(p, hash, p->ht->old_entries, p->ht->old_ctrl, p->ht->old_order);
+			continue;
+		}
+		p->step++;
+		p->group = (p->group + p->step) & p->mask;
+		hashprobe_load(p);
+	}
+}
+
+/* for use before a lookup */
+static inline void prefetchhash(const struct hashtable *ht, uint32_t hash) {
+	if(ht->ctrl) {
+		uint32_t group = hash_to_group(hash, ht->order);
+		__builtin_prefetch(ht->ctrl + ((size_t)group << GROUPORDER));
+		__builtin_prefetch(ht->entries + ((size_t)group << GROUPORDER));
+	} else {
+		__builtin_prefetch(ht->entries + hash_to_offset(hash, order_to_shift(ht->order)));
+	}
+}
+
 #endif
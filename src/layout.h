@@ -57,6 +57,32 @@
 
 	All integers are stored in the byte order indicated in the superblock.
 
+	Database version 4 moves the keys out of the data section into a fifth
+	section, stored front-coded in directory order. The superblock is
+	extended (see struct newhardhat) to describe this section and the data
+	section contains only the values, aligned as in version 3. Directory
+	entries are offsets of these values instead of offsets of records.
+
+	The key section is a sequence of blocks of 2^keyblock keys each (the
+	last block may be shorter), followed by an array of 64-bit offsets of
+	the start of each block. Each key in a block is laid out as:
+		length of the prefix shared with the previous key (varint)
+		length of the remaining suffix (varint)
+		data length (varint)
+		suffix (up to 2^16 bytes)
+	The first key in each block is a restart point and always has a shared
+	prefix length of 0. Varints are little-endian base 128 (LEB128). The
+	superblock records the length of the longest key, so that readers know
+	how large a buffer they need to decode them.
+
+	Database version 5 is laid out as version 4, but uses wyhash (folded
+	to 32 bits) instead of murmurhash3 for the hash tables and checksum.
+
+	Database version 6 is laid out as version 5, but counts entries and
+	prefixes in 64 bits (see struct widehardhat) and the hash tables refer
+	to the directory with 64-bit indexes (see struct widehashentry), so
+	that it can hold more than 2^32 entries.
+
 ******************************************************************************/
 
 #define HARDHAT_MAGIC "*HARDHAT"
@@ -97,6 +123,45 @@ struct hardhat {
 	uint32_t checksum;
 };
 
+struct newhardhat {
+	struct hardhat hardhat;
+	/* Start and end of the front-coded keys, including the block index */
+	uint64_t keys_start, keys_end;
+	/* Number of keys in each front-coded block (exponent) */
+	uint8_t keyblock;
+	/* To ensure proper alignment */
+	uint8_t padding;
+	/* Length of the longest key */
+	uint16_t maxkeylen;
+	/* Checksum over the previous bytes of the header, using the
+		hashtable hash algorithm */
+	uint32_t checksum;
+};
+
+struct widehardhat {
+	/* The counts of entries and prefixes in here are 0, and so is the
+		checksum, which the one at the end supersedes */
+	struct newhardhat newhardhat;
+	/* Number of entries stored */
+	uint64_t entries;
+	/* Number of prefixes stored */
+	uint64_t prefixes;
+	/* To ensure proper alignment */
+	uint32_t padding;
+	/* Checksum over the previous bytes of the header, using the
+		hashtable hash algorithm */
+	uint32_t checksum;
+};
+
+/* An entry of the hash tables of version 6 databases */
+struct widehashentry {
+	uint32_t hash;
+	/* To ensure proper alignment */
+	uint32_t padding;
+	/* Index into the directory */
+	uint64_t data;
+};
+
 struct oldhardhat {
 	struct hardhat hardhat;
 	/* Padding */
@@ -0,0 +1,35 @@
+/******************************************************************************
+
+	hardhat - read and write databases optimized for filename-like keys
+	Copyright (c) 2011-2016 Wessel Dankers <wsl@fruit.je>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+******************************************************************************/
+
+#ifndef HARDHAT_LOOKUP_H
+#define HARDHAT_LOOKUP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "layout.h"
+
+/*	Check whether a database has an entry with exactly this (normalized)
+	key. Unlike hardhat_cursor(), this does not allocate: keybuf is used to
+	decode front-coded keys and must be large enough for the longest key.
+	For use by the maker; not installed and not part of the public API. */
+extern bool hardhat_has(const struct hardhat *hardhat, const void *key, uint16_t keylen, uint8_t *keybuf);
+
+#endif
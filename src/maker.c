@@ -29,16 +29,27 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
 
 #include "maker.h"
+#include "reader.h"
 #include "hashtable.h"
+#include "psort.h"
 #include "layout.h"
+#include "lookup.h"
 
 #ifndef O_LARGEFILE
 #define O_LARGEFILE 0
 #endif
 
+#ifndef O_PATH
+#define O_PATH 0
+#endif
+
 /******************************************************************************
 
 	Module to create a hardhat database.
@@ -48,32 +59,216 @@
 #define export __attribute__((visibility("default")))
 
 #define OUTBUFSIZE ((size_t)65536)
+#define GATHERSIZE (OUTBUFSIZE / 2)
+#define AIOBUFSIZE ((size_t)1 << 20)
+#define MAX_WRITERS (64)
+
+/* An output buffer of the background writers */
+struct hhm_aiobuf {
+	/* Buffer contents */
+	uint8_t *data;
+	/* Where to write the contents */
+	off_t off;
+	/* Amount of data to write; 0 if the buffer is available */
+	size_t len;
+	/* Order in which buffers were queued */
+	uint64_t seq;
+	/* A writer is busy with this buffer */
+	bool writing;
+};
 
-struct hardhat_maker {
-	/* Output file handle */
+/* Background threads that write out full output buffers, so that the
+	thread that fills them doesn't have to wait for the disk */
+struct hhm_aio {
+	/* File handle to write to */
 	int fd;
-	/* Database file name */
-	char *filename;
-	/* Buffer used to manipulate key values (normalization, etc) */
-	uint8_t *keybuf;
+	/* Protects everything below */
+	pthread_mutex_t lock;
+	/* Signalled when a buffer is queued or the writers should exit */
+	pthread_cond_t queued;
+	/* Signalled when a buffer has been written */
+	pthread_cond_t written;
+	/* The writer threads */
+	pthread_t *threads;
+	/* Number of writer threads that were started */
+	unsigned int nthreads;
+	/* The output buffers */
+	struct hhm_aiobuf *bufs;
+	/* Number of output buffers */
+	unsigned int nbufs;
+	/* The buffer that is being filled */
+	unsigned int cur;
+	/* Sequence number for the next buffer that is queued */
+	uint64_t seq;
+	/* Everything before this offset is known to be written */
+	uint64_t safe;
+	/* Start writeback as soon as a buffer is written */
+	bool sync;
+	/* Writers should exit once all buffers are written */
+	bool stop;
+	/* Error (errno value) encountered by a writer, or 0 */
+	int error;
+	/* Size of the write that failed */
+	size_t errorlen;
+};
+
+/* A file that is written sequentially and read back through mmap() */
+struct hhm_file {
+	/* File handle */
+	int fd;
+	/* File name, for error messages */
+	const char *name;
 	/* Output buffer */
 	uint8_t *outbuf;
+	/* Output buffer size */
+	size_t outbufsize;
 	/* Output buffer usage */
 	size_t outbuflen;
+	/* Background writers, if enabled */
+	struct hhm_aio *aio;
+	/* Written through the window instead of the output buffer */
+	bool mapped;
+	/* Where the next write goes */
+	off_t pos;
 	/* Window into the already written data, used to detect duplicates */
 	uint8_t *window;
 	/* Size of window */
 	size_t windowsize;
+	/* Offset of first unused space in the file */
+	off_t off;
+	/* End of the ranges reserved by producers, while they are in use */
+	uint64_t reserved;
+};
+
+/* A sorted run of 64-bit items in the spill file */
+struct hhm_run {
+	/* Offset of the first item */
+	uint64_t off;
+	/* Number of items */
+	uint64_t num;
+};
+
+/* A list of runs */
+struct hhm_runs {
+	struct hhm_run *runs;
+	/* Size of container and the number of runs in use */
+	size_t size, num;
+	/* Size of each item */
+	size_t itemsize;
+};
+
+/* A value that was written to the database */
+struct hhm_value {
+	/* Offset in the database */
+	uint64_t off;
+	/* Length of the value */
+	uint32_t len;
+};
+
+/* One of the duplicate tables of the producers, holding the keys whose
+	hashes start with its index */
+struct hhm_shard {
+	/* Taken while the table is searched or updated */
+	pthread_mutex_t lock;
+	/* The keys in the table (the data is their offset in keys / 4) */
+	struct hashtable *hashtable;
+	/* Copies of the keys, each preceded by its length */
+	uint8_t *keys;
+	/* Size of container for the keys and the amount of it in use */
+	size_t keyssize, keyslen;
+};
+
+struct hardhat_maker {
+	/* The database file */
+	struct hhm_file db;
+	/* Scratch file for keys (version 4+ only) */
+	struct hhm_file keys;
+	/* The file that contains the key records (db or keys) */
+	struct hhm_file *records;
+	/* Scratch file for sorted runs, when entries don't fit in memory */
+	struct hhm_file spill;
+	/* Runs of record offsets in directory order in the spill file */
+	struct hhm_runs runs;
+	/* Number of records in those runs */
+	uint64_t spilled;
+	/* Offset of the sorted directory in the spill file, once it exists */
+	uint64_t spilldir;
+	/* Maximum amount of memory to use for the entries (0: no limit) */
+	uint64_t budget;
+	/* Directory the database is created in */
+	int dirfd;
+	/* Database file name */
+	char *filename;
+	/* Database file name, relative to dirfd */
+	const char *basename;
+	/* Permissions the database file is created with */
+	int mode;
+	/* Hidden name the database is built under, until it is published */
+	char tmpname[32];
+	/* Buffer used to manipulate key values (normalization, etc) */
+	uint8_t *keybuf;
+	/* The most recently added key, while entries arrive in order */
+	uint8_t *lastkey;
+	/* Length of the most recently added key */
+	uint16_t lastkeylen;
 	/* Size of container for added records */
 	size_t recbufsize;
-	/* Offset of first unused space in output file */
-	off_t off;
 	/* Offset of added records */
 	uint64_t *recbuf;
 	/* Number of added records */
 	uint32_t recnum;
+	/* In-memory copies of the first arenanum key records */
+	uint8_t *arena;
+	/* Size of the arena and the amount of it in use */
+	size_t arenasize, arenalen;
+	/* Offsets of the records in the arena */
+	uint64_t *arenaoff;
+	/* Size of container for arena offsets */
+	size_t arenaoffsize;
+	/* Number of records in the arena */
+	uint32_t arenanum;
+	/* Maximum amount of memory the arena may use */
+	uint64_t arenabudget;
 	/* Hashtable of added records, used to detect duplicates */
 	struct hashtable *hashtable;
+	/* Hashtable of stored values, used to deduplicate them */
+	struct hashtable *values;
+	/* Location of stored values (index is the data in the values hash) */
+	struct hhm_value *valuebuf;
+	/* Size of container for stored values */
+	size_t valuebufsize;
+	/* Number of stored values */
+	uint32_t valuenum;
+	/* Number of threads to use for sorting */
+	unsigned int threads;
+	/* Number of threads to write output in the background (0: none) */
+	unsigned int writers;
+	/* Taken by producers to start and stop, and to report errors */
+	pthread_mutex_t lock;
+	/* Number of producers in use */
+	unsigned int producers;
+	/* Duplicate tables that producers check their keys against */
+	struct hhm_shard *shards;
+	/* Database that unchanged entries are taken from */
+	hardhat_t *base;
+	/* File handle of the base database, to copy its data from */
+	int basefd;
+	/* Buffer for decoding keys while looking them up in the base database */
+	uint8_t *basekeybuf;
+	/* Keys to leave out of the base database, each preceded by its length */
+	uint8_t *deleted;
+	/* Size of container for deleted keys and the amount of it in use */
+	size_t deletedsize, deletedlen;
+	/* Number of deleted keys */
+	uint32_t deletednum;
+	/* Bytes of the data section used by the entries (with a base only) */
+	uint64_t live;
+	/* Normalized keys of the entries of a batch that is being added */
+	uint8_t *batchbuf;
+	/* Value of the parents that hardhat_maker_finish() adds */
+	uint8_t *parentdata;
+	/* Length of that value */
+	uint32_t parentdatalen;
 	/* Indicates what went wrong in case of failure */
 	char *error;
 	/* If this boolean is set, database creation has failed and
@@ -83,8 +278,22 @@ struct hardhat_maker {
 	bool started;
 	/* Database is completed and cannot be modified anymore */
 	bool finished;
+	/* Store identical values only once */
+	bool dedup;
+	/* Don't check for duplicate keys until the database is finished */
+	bool bulk;
+	/* All entries so far were added in directory order */
+	bool sorted;
+	/* Add missing parents when the database is finished */
+	bool autoparents;
+	/* Write the files through shared mappings */
+	bool mapped;
+	/* Build in a temporary file that replaces the database at the end */
+	bool atomic;
 	/* The superblock, as it will be created at the end */
 	struct hardhat superblock;
+	/* Extension of the superblock (version 4+ only) */
+	struct newhardhat newsuperblock;
 };
 
 /* The only case in which it is impossible to allocate the
@@ -93,12 +302,34 @@ static char enomem[] = "Out of memory";
 
 #define HARDHAT_DEFAULT_ALIGNMENT (3)
 #define HARDHAT_DEFAULT_BLOCKSIZE (12)
+#define HARDHAT_DEFAULT_VERSION (3)
+#define HARDHAT_DEFAULT_KEYBLOCK (4)
+#define HARDHAT_DEFAULT_THREADS (1)
+
+/* Memory used per entry while a run is sorted: its record offset, a hash
+	entry and a sort key (see hhm_sort_directory()) */
+#define HHM_ENTRY_MEMORY (40)
+#define HHM_MIN_BUDGET (65536)
 
 /* struct defaults */
 static const hardhat_maker_t hardhat_maker_0 = {
-	.fd = -1,
+	.db = {.fd = -1, .window = MAP_FAILED, .outbufsize = OUTBUFSIZE},
+	.keys = {.fd = -1, .window = MAP_FAILED, .outbufsize = OUTBUFSIZE, .name = "temporary key file"},
+	.spill = {.fd = -1, .window = MAP_FAILED, .outbufsize = OUTBUFSIZE, .name = "temporary sort file"},
+	.runs = {.itemsize = sizeof(uint64_t)},
+	.dirfd = -1,
+	.basefd = -1,
 	.recbufsize = 65536,
-	.window = MAP_FAILED,
+	.valuebufsize = 4096,
+	.sorted = true,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static const struct hhm_aio hhm_aio_0 = {
+	.fd = -1,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.written = PTHREAD_COND_INITIALIZER,
 };
 
 /* Return the error (if any) or an empty string (but never NULL) */
@@ -116,6 +347,40 @@ export bool hardhat_maker_fatal(hardhat_maker_t *hhm) {
 	return hhm ? hhm->failed : true;
 }
 
+typedef uint8_t hhm_v16 __attribute__((vector_size(16)));
+
+/* check if a path is already normalized, which it nearly always is.
+	This errs on the side of caution: any slash followed by a dot is
+	left for hardhat_normalize() to sort out. The main loop compares 16
+	bytes at a time with the bytes following them, using the compiler's
+	generic vectors so it becomes SSE2 or NEON code where available. */
+__attribute__((optimize(3)))
+static bool hhm_normalized(const uint8_t *src, size_t size) {
+	size_t i;
+
+	if(!size)
+		return true;
+	if(src[0] == '/' || src[0] == '.' || src[size - 1] == '/')
+		return false;
+
+	for(i = 0; i + sizeof(hhm_v16) < size; i += sizeof(hhm_v16)) {
+		hhm_v16 cur, next, bad;
+		uint64_t any[2];
+		memcpy(&cur, src + i, sizeof cur);
+		memcpy(&next, src + i + 1, sizeof next);
+		bad = (hhm_v16)((cur == '/') & ((next == '/') | (next == '.')));
+		memcpy(any, &bad, sizeof any);
+		if(any[0] | any[1])
+			return false;
+	}
+
+	for(; i + 1 < size; i++)
+		if(src[i] == '/' && (src[i + 1] == '/' || src[i + 1] == '.'))
+			return false;
+
+	return true;
+}
+
 /* normalize a path:
 
 	- remove repeated slashes
@@ -132,6 +397,12 @@ export size_t hardhat_normalize(void *to, const void *from, size_t size) {
 	dst = to;
 	src = from;
 
+	if(hhm_normalized(src, size)) {
+		if(dst != src)
+			memcpy(dst, src, size);
+		return size;
+	}
+
 	nul = src + size;
 	cur = dst;
 	do {
@@ -158,6 +429,15 @@ export size_t hardhat_normalize(void *to, const void *from, size_t size) {
 	return (size_t)(cur - dst);
 }
 
+/* index of the first nonzero byte in a word, as laid out in memory */
+static inline size_t hhm_firstbyte(uint64_t word) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return (size_t)__builtin_clzll(word) / 8;
+#else
+	return (size_t)__builtin_ctzll(word) / 8;
+#endif
+}
+
 /* compare two paths:
 
 	- equal path components are skipped
@@ -185,6 +465,28 @@ export int hardhat_cmp(const void *a, size_t al, const void *b, size_t bl) {
 
 	l = al < bl ? al : bl;
 
+	/* skip the common part 16 bytes at a time */
+	while(l >= sizeof(hhm_v16)) {
+		hhm_v16 av, bv, diff;
+		uint64_t words[2];
+		memcpy(&av, as, sizeof av);
+		memcpy(&bv, bs, sizeof bv);
+		diff = av ^ bv;
+		memcpy(words, &diff, sizeof words);
+		if(words[0] | words[1]) {
+			size_t skip = words[0]
+				? hhm_firstbyte(words[0])
+				: sizeof *words + hhm_firstbyte(words[1]);
+			as += skip;
+			bs += skip;
+			l -= skip;
+			break;
+		}
+		as += sizeof av;
+		bs += sizeof bv;
+		l -= sizeof av;
+	}
+
 	while(l) {
 		ac = *as;
 		bc = *bs;
@@ -226,10 +528,26 @@ export int hardhat_cmp(const void *a, size_t al, const void *b, size_t bl) {
 	return ac < bc ? -1 : 1;
 }
 
-/* Convenience macros to fetch aligned n-bit values */
-#define u16read(buf) (*(uint16_t *)(buf))
-#define u32read(buf) (*(uint32_t *)(buf))
-#define u64read(buf) (*(uint64_t *)(buf))
+/* Convenience functions to fetch n-bit values. Records that are still in
+	the output buffer can be at any alignment: the buffer doesn't start at
+	an aligned file offset after values are written out directly. */
+static inline uint16_t u16read(const void *buf) {
+	uint16_t v;
+	memcpy(&v, buf, sizeof v);
+	return v;
+}
+
+static inline uint32_t u32read(const void *buf) {
+	uint32_t v;
+	memcpy(&v, buf, sizeof v);
+	return v;
+}
+
+static inline uint64_t u64read(const void *buf) {
+	uint64_t v;
+	memcpy(&v, buf, sizeof v);
+	return v;
+}
 
 /* Allocate and set an error message, using printf semantics */
 static void hhm_set_error(hardhat_maker_t *hhm, const char *fmt, ...) {
@@ -258,6 +576,15 @@ static void hhm_set_error(hardhat_maker_t *hhm, const char *fmt, ...) {
 	errno = err;
 }
 
+/* Record that we ran out of memory, which is always fatal */
+static void hhm_set_enomem(hardhat_maker_t *hhm) {
+	if(hhm->error != enomem) {
+		free(hhm->error);
+		hhm->error = enomem;
+	}
+	hhm->failed = true;
+}
+
 static uint32_t makeseed(void) {
 	struct timespec ts[8];
 	int clocks = 0;
@@ -292,6 +619,15 @@ static uint32_t makeseed(void) {
 	return calchash_murmur3((const void *)ts, sizeof *ts * clocks, getpid());
 }
 
+/* The hash function used for the hash tables and the checksum,
+	which depends on the database version */
+static inline uint32_t hhm_calchash(hardhat_maker_t *hhm, const void *key, size_t len) {
+	if(hhm->superblock.version >= 5)
+		return calchash_wyhash(key, len, hhm->superblock.hashseed);
+	else
+		return calchash_murmur3(key, len, hhm->superblock.hashseed);
+}
+
 export uint64_t hardhat_maker_alignment(hardhat_maker_t *hhm, uint64_t alignment) {
 	uint64_t prev;
 
@@ -332,495 +668,4381 @@ export uint64_t hardhat_maker_blocksize(hardhat_maker_t *hhm, uint64_t blocksize
 	return prev;
 }
 
-/* Write bytes to the database and handle any errors */
-static bool hhm_db_write(hardhat_maker_t *hhm, const void *buf, size_t len) {
-	ssize_t r;
-
-	if(!len)
-		return true;
+/* The size of the superblock of a given database version */
+static size_t hhm_version_headersize(uint32_t version) {
+	if(version >= 6)
+		return sizeof(struct widehardhat);
+	if(version >= 4)
+		return sizeof(struct newhardhat);
+	return sizeof(struct hardhat);
+}
 
-	while(len) {
-		r = write(hhm->fd, buf, len);
-		switch(r) {
-			case -1:
-				hhm_set_error(hhm, "writing %zu bytes to %s failed: %m", len, hhm->filename);
-				hhm->failed = true;
-				return false;
-			case 0:
-				hhm_set_error(hhm, "writing %zu bytes to %s failed: short write", len, hhm->filename);
-				hhm->failed = true;
-				errno = EAGAIN;
-				return false;
-			default:
-				len -= r;
-				buf = (const uint8_t *)buf + r;
-		}
-	}
+export uint32_t hardhat_maker_version(hardhat_maker_t *hhm, uint32_t version) {
+	uint32_t prev;
 
-	return true;
-}
+	if(!hhm || hhm->failed)
+		return 0;
 
-static bool hhm_db_flush(hardhat_maker_t *hhm) {
-	size_t len = hhm->outbuflen;
-	if(!len)
-		return true;
-	hhm->outbuflen = 0;
-	return hhm_db_write(hhm, hhm->outbuf, len);
-}
+	prev = hhm->superblock.version;
 
-/* Append bytes to the database and update off */
-static bool hhm_db_append(hardhat_maker_t *hhm, const void *buf, size_t len) {
-	size_t remaining;
+	if(version) {
+		if(hhm->started)
+			return hhm_set_error(hhm, "can't change version after output has started"), 0;
 
-	if(!len)
-		return true;
+		if(version < 3 || version > 6)
+			return hhm_set_error(hhm, "unsupported database version %"PRIu32, version), 0;
 
-	if(len >= OUTBUFSIZE) {
-		if(!hhm_db_flush(hhm))
-			return false;
-		if(!hhm_db_write(hhm, buf, len))
-			return false;
-	} else {
-		remaining = OUTBUFSIZE - hhm->outbuflen;
-		if(len > remaining) {
-			memcpy(hhm->outbuf + hhm->outbuflen, buf, remaining);
-			if(!hhm_db_write(hhm, hhm->outbuf, OUTBUFSIZE))
-				return false;
+		/* The data section of the base is copied as is, so it must stay put */
+		if(hhm->base && hhm_version_headersize(version) != hhm_version_headersize(hhm->base->version))
+			return hhm_set_error(hhm, "can't change the version of a version %"PRIu32" base database to %"PRIu32
+				": its data section would have to move", hhm->base->version, version), 0;
 
-			hhm->outbuflen = len - remaining;
-			memcpy(hhm->outbuf, (const uint8_t *)buf + remaining, hhm->outbuflen);
-		} else {
-			memcpy(hhm->outbuf + hhm->outbuflen, buf, len);
-			hhm->outbuflen += len;
-			if(len == remaining && !hhm_db_flush(hhm))
-				return false;
-		}
+		hhm->superblock.version = version;
 	}
 
-	hhm->off += len;
-	return true;
+	return prev;
 }
 
-static bool hhm_db_seek(hardhat_maker_t *hhm, off_t off, int whence) {
-	if(!hhm_db_flush(hhm))
-		return false;
-	if(lseek(hhm->fd, off, whence) == -1) {
-		hhm_set_error(hhm, "seeking %lld bytes into %s failed: %m", (long long)off, hhm->filename);
-		hhm->failed = true;
+export bool hardhat_maker_deduplicate(hardhat_maker_t *hhm, bool dedup) {
+	if(!hhm || hhm->failed)
 		return false;
-	}
-	return true;
-}
 
-static bool hhm_db_pad(hardhat_maker_t *hhm, size_t length, size_t alignment) {
-	size_t blocksize, offset, align, start, end, remaining;
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change deduplication after output has started"), false;
 
-	blocksize = 1 << hhm->superblock.blocksize;
-	offset = hhm->off;
+	hhm->dedup = dedup;
 
-	align = -offset % alignment;
-	offset += align;
+	return true;
+}
 
-	start = offset % blocksize;
-	end = blocksize - -(offset + length) % blocksize;
+export bool hardhat_maker_bulk(hardhat_maker_t *hhm, bool bulk) {
+	if(!hhm || hhm->failed)
+		return false;
 
-	if(start > end)
-		align += -offset % blocksize;
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change bulk mode after output has started"), false;
 
-	if(!align)
-		return true;
+	if(!bulk && hhm->budget)
+		return hhm_set_error(hhm, "a memory budget requires bulk mode"), false;
 
-	if(align >= OUTBUFSIZE) {
-		if(!hhm_db_seek(hhm, align, SEEK_CUR))
-			return false;
-	} else {
-		remaining = OUTBUFSIZE - hhm->outbuflen;
-		if(align > remaining) {
-			memset(hhm->outbuf + hhm->outbuflen, 0, remaining);
-			if(!hhm_db_write(hhm, hhm->outbuf, OUTBUFSIZE))
-				return false;
-			hhm->outbuflen = align - remaining;
-			memset(hhm->outbuf, 0, hhm->outbuflen);
-		} else {
-			memset(hhm->outbuf + hhm->outbuflen, 0, align);
-			hhm->outbuflen += align;
-			if(align == remaining && !hhm_db_flush(hhm))
-				return false;
-		}
-	}
+	hhm->bulk = bulk;
 
-	hhm->off += align;
 	return true;
 }
 
-/* Fetch already written bytes from the database by maintaining a mmap()ed
-	window on it */
-static const uint8_t *hhm_getrec(hardhat_maker_t *hhm, uint64_t off) {
-	if(hhm->windowsize <= off) {
-		if(hhm->window != MAP_FAILED)
-			munmap(hhm->window, hhm->windowsize);
-		if(!hhm_db_flush(hhm))
-			return NULL;
-		hhm->window = mmap(NULL, hhm->off, PROT_READ, MAP_SHARED, hhm->fd, 0);
-		if(hhm->window == MAP_FAILED) {
-			hhm_set_error(hhm, "mmap()ing %s failed: %m", hhm->filename);
-			hhm->failed = true;
-			return NULL;
-		}
-		hhm->windowsize = hhm->off;
-	}
-	return hhm->window + off;
-}
-
-/* Allocate and initialize a hardhat_maker_t structure.
-	Returns NULL on failure, with errno set to the problem. */
-export hardhat_maker_t *hardhat_maker_new(const char *filename) {
-	return hardhat_maker_newat(AT_FDCWD, filename, 0666);
+export bool hardhat_maker_base(hardhat_maker_t *hhm, const char *filename) {
+	return hardhat_maker_baseat(hhm, AT_FDCWD, filename);
 }
 
-export hardhat_maker_t *hardhat_maker_newat(int dirfd, const char *filename, int mode) {
-	hardhat_maker_t *hhm;
-	int err;
+export bool hardhat_maker_baseat(hardhat_maker_t *hhm, int dirfd, const char *filename) {
+	hardhat_t *base;
+	int fd, err;
 
-	if(!filename) {
-		errno = EINVAL;
-		return NULL;
-	}
+	if(!hhm || hhm->failed)
+		return false;
 
-	hhm = malloc(sizeof *hhm);
-	if(!hhm)
-		return NULL;
+	if(!filename)
+		return hhm_set_error(hhm, "filename parameter to hardhat_maker_base is NULL"), false;
 
-	*hhm = hardhat_maker_0;
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't set a base database after output has started"), false;
 
-	hhm->superblock.hashseed = makeseed();
-	hhm->superblock.alignment = HARDHAT_DEFAULT_ALIGNMENT;
-	hhm->superblock.blocksize = HARDHAT_DEFAULT_BLOCKSIZE;
+	if(hhm->base)
+		return hhm_set_error(hhm, "can't set more than one base database"), false;
 
-	hhm->filename = strdup(filename);
-	if(!hhm->filename) {
-		err = errno;
-		hardhat_maker_free(hhm);
-		errno = err;
-		return NULL;
-	}
+	if(hhm->budget)
+		return hhm_set_error(hhm, "can't use a base database with a memory budget"), false;
 
-	hhm->keybuf = malloc(65536);
-	if(!hhm->keybuf) {
-		err = errno;
-		hardhat_maker_free(hhm);
-		errno = err;
-		return NULL;
-	}
+	fd = openat(dirfd, filename, O_RDONLY|O_NOCTTY|O_LARGEFILE|O_CLOEXEC);
+	if(fd == -1)
+		return hhm_set_error(hhm, "opening %s failed: %m", filename), false;
 
-	hhm->outbuf = malloc(OUTBUFSIZE);
-	if(!hhm->outbuf) {
+	base = hardhat_openat(dirfd, filename);
+	if(!base) {
 		err = errno;
-		hardhat_maker_free(hhm);
+		close(fd);
 		errno = err;
-		return NULL;
+		return hhm_set_error(hhm, "opening %s failed: %m", filename), false;
 	}
 
-	hhm->fd = openat(dirfd, filename, O_RDWR|O_CREAT|O_LARGEFILE|O_NOCTTY|O_CLOEXEC, mode);
-	if(hhm->fd == -1) {
-		err = errno;
-		hardhat_maker_free(hhm);
-		errno = err;
-		return NULL;
+	if(base->byteorder != UINT64_C(0x0123456789ABCDEF) || base->version < 3) {
+		hardhat_close(base);
+		close(fd);
+		return hhm_set_error(hhm, "%s: base database must be version 3 or later, in native byte order", filename), false;
 	}
 
-	if(!hhm_db_append(hhm, &hhm->superblock, sizeof hhm->superblock) || !hhm_db_flush(hhm)) {
-		err = errno;
-		hardhat_maker_free(hhm);
-		errno = err;
-		return NULL;
+	hhm->basekeybuf = malloc(65536);
+	if(!hhm->basekeybuf) {
+		hardhat_close(base);
+		close(fd);
+		hhm_set_enomem(hhm);
+		return false;
 	}
-	hhm->superblock.data_start = hhm->off;
 
-	hhm->recbuf = malloc(hhm->recbufsize * sizeof *hhm->recbuf);
-	if(!hhm->recbuf) {
-		err = errno;
-		hardhat_maker_free(hhm);
-		errno = err;
-		return NULL;
-	}
+	hhm->base = base;
+	hhm->basefd = fd;
 
-	hhm->hashtable = newhash();
-	if(!hhm->hashtable) {
-		err = errno;
-		hardhat_maker_free(hhm);
-		errno = err;
-		return NULL;
-	}
+	/* Keep the layout of the data section */
+	hhm->superblock.version = base->version;
+	hhm->superblock.alignment = base->alignment;
+	hhm->superblock.blocksize = base->blocksize;
 
-	return hhm;
+	return true;
 }
 
+export uint64_t hardhat_maker_dead(hardhat_maker_t *hhm) {
+	uint64_t size;
 
-/* Add an entry to the database (if it doesn't exist yet).
-	Returns true on success (or if the entry already existed!)
-	Returns false on error. */
-export bool hardhat_maker_add(hardhat_maker_t *hhm, const void *key, uint16_t keylen, const void *data, uint32_t datalen) {
-	if(!hhm || hhm->failed || hhm->finished) {
-		errno = EINVAL;
-		return false;
-	}
-	if(!key && keylen) {
-		hhm_set_error(hhm, "key parameter to hardhat_maker_add is NULL");
-		return false;
-	}
-	if(!data && datalen) {
-		hhm_set_error(hhm, "data parameter to hardhat_maker_add is NULL");
-		return false;
-	}
-	if(datalen > INT32_MAX) {
-		hhm_set_error(hhm, "datalen parameter to hardhat_maker_add is too large");
-		return false;
-	}
+	if(!hhm || !hhm->finished || !hhm->base)
+		return 0;
 
-	keylen = (uint16_t)hardhat_normalize(hhm->keybuf, key, keylen);
-	key = hhm->keybuf;
+	size = hhm->superblock.data_end - hhm->superblock.data_start;
 
-	/* Check if the entry isn't already in the hash table.
-		If it is, return true. If not, add it and continue. */
-	uint32_t reference_hash = calchash_murmur3(key, (size_t)keylen, hhm->superblock.hashseed);
-	struct hashtable *ht = hhm->hashtable;
-	struct hashentry *entries = ht->entries;
-	order_t shift = order_to_shift(ht->order);
-	uint32_t mask = shift_to_mask(shift);
-	uint32_t offset = hash_to_offset(reference_hash, shift);
-
-	for(uint32_t my_diff = 0;; my_diff++) {
-		struct hashentry *entry = entries + offset;
-		uint32_t candidate_data = entry->data;
-		if(candidate_data == EMPTYHASH)
-			break;
+	return size > hhm->live ? size - hhm->live : 0;
+}
 
-		uint32_t candidate_hash = entry->hash;
-		if(reference_hash == candidate_hash) {
-			const uint8_t *old = hhm_getrec(hhm, hhm->recbuf[candidate_data]);
-			if(!old)
-				return false;
-			if(u16read(old + 4) == keylen && !memcmp(old + 6, key, keylen))
-				return true;
-		}
+export bool hardhat_maker_arena(hardhat_maker_t *hhm, uint64_t budget) {
+	if(!hhm || hhm->failed)
+		return false;
 
-#if THEORY
-		// Faster in theory, not necessarily in practice:
-		uint32_t candidate_diff = difference(offset, hash_to_offset(candidate_hash, shift), mask);
-		if(__builtin_expect(candidate_diff < my_diff, 1))
-			break;
-#endif
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change the arena budget after output has started"), false;
 
-		offset = (offset + 1) & mask;
-	}
+	hhm->arenabudget = budget;
 
-	if(!addhash(ht, reference_hash, hhm->recnum)) {
-		if(hhm->error != enomem) {
-			free(hhm->error);
-			hhm->error = enomem;
-		}
-		hhm->failed = true;
-		return false;
-	}
+	return true;
+}
 
-	hhm->started = true;
+/* Number of entries that are sorted at a time with a memory budget */
+static size_t hhm_runsize(const hardhat_maker_t *hhm) {
+	uint64_t runsize = hhm->budget / HHM_ENTRY_MEMORY;
+	return runsize < UINT32_MAX ? (size_t)runsize : UINT32_MAX;
+}
 
-	/* For padding purposes, only use the size fields in the calculation. */
-	/* Using more would cause the file to increase in size significantly. */
+export bool hardhat_maker_memory(hardhat_maker_t *hhm, uint64_t budget) {
+	size_t runsize;
+	void *buf;
 
-	if(!hhm_db_pad(hhm, (size_t)6 + (size_t)datalen, 4))
+	if(!hhm || hhm->failed)
 		return false;
 
-	uint64_t off = hhm->off;
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change the memory budget after output has started"), false;
 
-	/* Write out the entry to disk */
+	if(budget && budget < HHM_MIN_BUDGET)
+		return hhm_set_error(hhm, "a memory budget of less than %d bytes is too small", HHM_MIN_BUDGET), false;
 
-	if(!hhm_db_append(hhm, &datalen, sizeof datalen))
-		return false;
+	if(budget && hhm->base)
+		return hhm_set_error(hhm, "can't use a memory budget with a base database"), false;
 
-	if(!hhm_db_append(hhm, &keylen, sizeof keylen))
-		return false;
+	hhm->budget = budget;
+	if(!budget)
+		return true;
 
-	if(!hhm_db_append(hhm, key, keylen))
-		return false;
+	hhm->bulk = true;
 
-	if(!hhm_db_pad(hhm, datalen, (size_t)1 << hhm->superblock.alignment))
-		return false;
+	/* Don't start out with more room for records than a run holds */
+	runsize = hhm_runsize(hhm);
+	if(hhm->recbufsize > runsize) {
+		buf = realloc(hhm->recbuf, runsize * sizeof *hhm->recbuf);
+		if(buf) {
+			hhm->recbuf = buf;
+			hhm->recbufsize = runsize;
+		}
+	}
 
-	if(!hhm_db_append(hhm, data, datalen))
+	return true;
+}
+
+export unsigned int hardhat_maker_threads(hardhat_maker_t *hhm, unsigned int threads) {
+	unsigned int prev;
+
+	if(!hhm || hhm->failed)
+		return 0;
+
+	prev = hhm->threads;
+
+	if(threads) {
+		if(hhm->finished)
+			return hhm_set_error(hhm, "can't change the number of threads after finishing"), 0;
+		hhm->threads = threads;
+	}
+
+	return prev;
+}
+
+export bool hardhat_maker_hashseed(hardhat_maker_t *hhm, uint32_t seed) {
+	if(!hhm || hhm->failed)
 		return false;
 
-	/* Add the entry offset to the list (resizing it as necessary) */
-	if(hhm->recnum == hhm->recbufsize) {
-		hhm->recbufsize *= 2;
-		void *buf = realloc(hhm->recbuf, hhm->recbufsize * sizeof *hhm->recbuf);
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change the hash seed after output has started"), false;
+
+	hhm->superblock.hashseed = seed;
+
+	return true;
+}
+
+export bool hardhat_maker_writers(hardhat_maker_t *hhm, unsigned int writers) {
+	if(!hhm || hhm->failed)
+		return false;
+
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change the number of writers after output has started"), false;
+
+	if(writers > MAX_WRITERS)
+		return hhm_set_error(hhm, "at most %d writers are supported", MAX_WRITERS), false;
+
+	hhm->writers = writers;
+
+	return true;
+}
+
+export bool hardhat_maker_mapped(hardhat_maker_t *hhm, bool mapped) {
+	if(!hhm || hhm->failed)
+		return false;
+
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change the output mode after output has started"), false;
+
+	hhm->mapped = mapped;
+
+	return true;
+}
+
+export bool hardhat_maker_atomic(hardhat_maker_t *hhm, bool atomic) {
+	if(!hhm || hhm->failed)
+		return false;
+
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change how the database is published after output has started"), false;
+
+	hhm->atomic = atomic;
+
+	return true;
+}
+
+export bool hardhat_maker_grouphash(hardhat_maker_t *hhm, bool grouphash) {
+	struct hashtable *ht;
+
+	if(!hhm || hhm->failed)
+		return false;
+
+	if(hhm->started)
+		return hhm_set_error(hhm, "can't change the hash table after output has started"), false;
+
+	/* Nothing has been added yet, so the table can simply be replaced */
+	if(grouphash == !!hhm->hashtable->ctrl)
+		return true;
+	ht = grouphash ? newgrouphash() : newhash();
+	if(!ht) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+	freehash(hhm->hashtable);
+	hhm->hashtable = ht;
+
+	return true;
+}
+
+/* Write out queued buffers until told to stop */
+static void *hhm_aio_writer(void *arg) {
+	struct hhm_aio *aio = arg;
+	struct hhm_aiobuf *buf;
+	unsigned int i;
+	size_t done;
+	ssize_t r;
+	int err;
+
+	pthread_mutex_lock(&aio->lock);
+
+	for(;;) {
+		/* Oldest queued buffer first */
+		buf = NULL;
+		for(i = 0; i < aio->nbufs; i++)
+			if(aio->bufs[i].len && !aio->bufs[i].writing && (!buf || aio->bufs[i].seq < buf->seq))
+				buf = aio->bufs + i;
+
 		if(!buf) {
-			if(hhm->error != enomem) {
-				free(hhm->error);
-				hhm->error = enomem;
+			if(aio->stop)
+				break;
+			pthread_cond_wait(&aio->queued, &aio->lock);
+			continue;
+		}
+
+		buf->writing = true;
+		pthread_mutex_unlock(&aio->lock);
+
+		err = 0;
+		for(done = 0; done < buf->len; done += (size_t)r) {
+			r = pwrite(aio->fd, buf->data + done, buf->len - done, buf->off + (off_t)done);
+			if(r <= 0) {
+				err = r ? errno : EAGAIN;
+				break;
 			}
+		}
+
+#ifdef HAVE_SYNC_FILE_RANGE
+		/* Get the data on its way to the disk now, rather than all
+			at once when the database is synced */
+		if(!err && aio->sync)
+			sync_file_range(aio->fd, buf->off, (off_t)buf->len, SYNC_FILE_RANGE_WRITE);
+#endif
+
+		pthread_mutex_lock(&aio->lock);
+		if(err && !aio->error) {
+			aio->error = err;
+			aio->errorlen = buf->len;
+		}
+		buf->len = 0;
+		buf->writing = false;
+		pthread_cond_broadcast(&aio->written);
+	}
+
+	pthread_mutex_unlock(&aio->lock);
+
+	return NULL;
+}
+
+/* Let the writers finish what is queued and release everything */
+static void hhm_aio_free(struct hhm_aio *aio) {
+	unsigned int i;
+
+	if(!aio)
+		return;
+
+	pthread_mutex_lock(&aio->lock);
+	aio->stop = true;
+	pthread_cond_broadcast(&aio->queued);
+	pthread_mutex_unlock(&aio->lock);
+
+	for(i = 0; i < aio->nthreads; i++)
+		pthread_join(aio->threads[i], NULL);
+
+	if(aio->bufs)
+		for(i = 0; i < aio->nbufs; i++)
+			free(aio->bufs[i].data);
+
+	pthread_cond_destroy(&aio->written);
+	pthread_cond_destroy(&aio->queued);
+	pthread_mutex_destroy(&aio->lock);
+	free(aio->bufs);
+	free(aio->threads);
+	free(aio);
+}
+
+/* Start background writers for a file. The contents of the output buffer
+	are carried over. */
+static bool hhm_aio_start(hardhat_maker_t *hhm, struct hhm_file *f, bool sync) {
+	struct hhm_aio *aio;
+	unsigned int i;
+	int err;
+
+	aio = malloc(sizeof *aio);
+	if(!aio) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	*aio = hhm_aio_0;
+	aio->fd = f->fd;
+	aio->sync = sync;
+	aio->safe = (uint64_t)f->pos;
+	/* One buffer to fill, one per writer and a spare */
+	aio->nbufs = hhm->writers + 2;
+
+	aio->bufs = calloc(aio->nbufs, sizeof *aio->bufs);
+	aio->threads = malloc(hhm->writers * sizeof *aio->threads);
+	if(!aio->bufs || !aio->threads) {
+		hhm_aio_free(aio);
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	for(i = 0; i < aio->nbufs; i++) {
+		aio->bufs[i].data = malloc(AIOBUFSIZE);
+		if(!aio->bufs[i].data) {
+			hhm_aio_free(aio);
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	for(i = 0; i < hhm->writers; i++) {
+		err = pthread_create(aio->threads + i, NULL, hhm_aio_writer, aio);
+		if(err) {
+			hhm_aio_free(aio);
+			errno = err;
+			hhm_set_error(hhm, "starting a writer for %s failed: %m", f->name);
 			hhm->failed = true;
 			return false;
-		}
-		hhm->recbuf = buf;
+		}
+		aio->nthreads++;
+	}
+
+	memcpy(aio->bufs[0].data, f->outbuf, f->outbuflen);
+	free(f->outbuf);
+	f->outbuf = aio->bufs[0].data;
+	f->outbufsize = AIOBUFSIZE;
+	f->aio = aio;
+
+	return true;
+}
+
+/* Stop the background writers of a file, if any. The output buffer goes
+	with them. */
+static void hhm_aio_stop(struct hhm_file *f) {
+	if(!f->aio)
+		return;
+	hhm_aio_free(f->aio);
+	f->aio = NULL;
+	f->outbuf = NULL;
+	f->outbuflen = 0;
+}
+
+/* Report an error that a writer ran into. Call with the lock held. */
+static bool hhm_aio_check(hardhat_maker_t *hhm, struct hhm_file *f) {
+	struct hhm_aio *aio = f->aio;
+
+	if(!aio->error)
+		return true;
+
+	errno = aio->error;
+	hhm_set_error(hhm, "writing %zu bytes to %s failed: %m", aio->errorlen, f->name);
+	hhm->failed = true;
+	return false;
+}
+
+/* Queue the output buffer and continue with an available one, waiting
+	for the writers if necessary */
+static bool hhm_aio_submit(hardhat_maker_t *hhm, struct hhm_file *f, size_t len) {
+	struct hhm_aio *aio = f->aio;
+	struct hhm_aiobuf *buf = aio->bufs + aio->cur;
+	unsigned int i;
+	bool ok;
+
+	pthread_mutex_lock(&aio->lock);
+
+	buf->off = f->pos;
+	buf->len = len;
+	buf->seq = aio->seq++;
+	pthread_cond_signal(&aio->queued);
+
+	for(;;) {
+		for(i = 0; i < aio->nbufs && aio->bufs[i].len; i++);
+		if(i < aio->nbufs || aio->error)
+			break;
+		pthread_cond_wait(&aio->written, &aio->lock);
+	}
+
+	ok = hhm_aio_check(hhm, f);
+
+	pthread_mutex_unlock(&aio->lock);
+
+	if(!ok)
+		return false;
+
+	aio->cur = i;
+	f->outbuf = aio->bufs[i].data;
+	f->pos += (off_t)len;
+
+	return true;
+}
+
+/* Wait until no writes are in flight for the given range of the file */
+static bool hhm_aio_wait(hardhat_maker_t *hhm, struct hhm_file *f, uint64_t start, uint64_t end) {
+	struct hhm_aio *aio = f->aio;
+	struct hhm_aiobuf *buf;
+	uint64_t safe;
+	unsigned int i;
+	bool busy, ok;
+
+	if(end <= aio->safe)
+		return true;
+
+	pthread_mutex_lock(&aio->lock);
+
+	for(;;) {
+		safe = (uint64_t)f->pos;
+		busy = false;
+		for(i = 0; i < aio->nbufs; i++) {
+			buf = aio->bufs + i;
+			if(!buf->len)
+				continue;
+			if((uint64_t)buf->off < safe)
+				safe = (uint64_t)buf->off;
+			if((uint64_t)buf->off < end && (uint64_t)buf->off + buf->len > start)
+				busy = true;
+		}
+		if(!busy || aio->error)
+			break;
+		pthread_cond_wait(&aio->written, &aio->lock);
+	}
+
+	/* Buffers are queued in file order, so this only goes up */
+	aio->safe = safe;
+
+	ok = hhm_aio_check(hhm, f);
+
+	pthread_mutex_unlock(&aio->lock);
+
+	return ok;
+}
+
+/* Reserve space for a file that is written through its window. Blocks
+	are allocated right away where possible, so that running out of disk
+	space is reported here rather than as a SIGBUS later on. */
+static bool hhm_db_grow(hardhat_maker_t *hhm, struct hhm_file *f, size_t size) {
+	int err;
+
+	err = posix_fallocate(f->fd, (off_t)f->windowsize, (off_t)(size - f->windowsize));
+	if(err == EINVAL || err == EOPNOTSUPP)
+		err = ftruncate(f->fd, (off_t)size) == -1 ? errno : 0;
+
+	if(err) {
+		errno = err;
+		hhm_set_error(hhm, "growing %s to %zu bytes failed: %m", f->name, size);
+		hhm->failed = true;
+		return false;
+	}
+
+	return true;
+}
+
+/* Make sure the mmap()ed window on a file covers at least size bytes. The
+	window grows geometrically and may extend past the end of the file;
+	pages there become readable as the file grows. If the file is written
+	through the window, the file is grown along with it. */
+static bool hhm_db_window(hardhat_maker_t *hhm, struct hhm_file *f, size_t size) {
+	size_t windowsize;
+	void *window;
+	int prot;
+
+	if(size <= f->windowsize)
+		return true;
+
+	windowsize = f->windowsize ? f->windowsize * 2 : (size_t)1 << 20;
+	while(windowsize < size)
+		windowsize *= 2;
+
+	prot = PROT_READ;
+	if(f->mapped) {
+		if(!hhm_db_grow(hhm, f, windowsize))
+			return false;
+		prot |= PROT_WRITE;
+	}
+
+#ifdef MREMAP_MAYMOVE
+	if(f->window != MAP_FAILED)
+		window = mremap(f->window, f->windowsize, windowsize, MREMAP_MAYMOVE);
+	else
+#endif
+	{
+		if(f->window != MAP_FAILED)
+			munmap(f->window, f->windowsize);
+		window = mmap(NULL, windowsize, prot, MAP_SHARED, f->fd, 0);
+	}
+
+	if(window == MAP_FAILED) {
+		f->window = MAP_FAILED;
+		f->windowsize = 0;
+		hhm_set_error(hhm, "mmap()ing %s failed: %m", f->name);
+		hhm->failed = true;
+		return false;
+	}
+
+	f->window = window;
+	f->windowsize = windowsize;
+	return true;
+}
+
+/* Write a number of buffers to a file in one go and handle any errors.
+	The iovec array is updated to reflect partial writes. */
+static bool hhm_db_writev(hardhat_maker_t *hhm, struct hhm_file *f, struct iovec *iov, int iovcnt) {
+	size_t len = 0;
+	ssize_t r;
+	int i;
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if(f->mapped) {
+		if(!hhm_db_window(hhm, f, (size_t)f->pos + len))
+			return false;
+		for(i = 0; i < iovcnt; i++) {
+			memcpy(f->window + f->pos, iov[i].iov_base, iov[i].iov_len);
+			f->pos += iov[i].iov_len;
+		}
+		return true;
+	}
+
+	while(len) {
+		r = pwritev(f->fd, iov, iovcnt, f->pos);
+		switch(r) {
+			case -1:
+				hhm_set_error(hhm, "writing %zu bytes to %s failed: %m", len, f->name);
+				hhm->failed = true;
+				return false;
+			case 0:
+				hhm_set_error(hhm, "writing %zu bytes to %s failed: short write", len, f->name);
+				hhm->failed = true;
+				errno = EAGAIN;
+				return false;
+			default:
+				len -= r;
+				f->pos += r;
+				for(; (size_t)r >= iov->iov_len && iovcnt > 1; iov++, iovcnt--)
+					r -= iov->iov_len;
+				iov->iov_base = (uint8_t *)iov->iov_base + r;
+				iov->iov_len -= r;
+		}
+	}
+
+	return true;
+}
+
+/* Write bytes to a file and handle any errors */
+static bool hhm_db_write(hardhat_maker_t *hhm, struct hhm_file *f, const void *buf, size_t len) {
+	struct iovec iov = {(void *)buf, len};
+	return hhm_db_writev(hhm, f, &iov, 1);
+}
+
+/* Write out the first len bytes of the output buffer, in the background
+	if possible */
+static bool hhm_db_outbuf(hardhat_maker_t *hhm, struct hhm_file *f, size_t len) {
+	if(f->aio)
+		return hhm_aio_submit(hhm, f, len);
+	return hhm_db_write(hhm, f, f->outbuf, len);
+}
+
+static bool hhm_db_flush(hardhat_maker_t *hhm, struct hhm_file *f) {
+	size_t len = f->outbuflen;
+	if(!len)
+		return true;
+	f->outbuflen = 0;
+	return hhm_db_outbuf(hhm, f, len);
+}
+
+/* Move the position where the next write goes */
+static bool hhm_db_seek(hardhat_maker_t *hhm, struct hhm_file *f, off_t off, int whence) {
+	if(!hhm_db_flush(hhm, f))
+		return false;
+	if(whence == SEEK_CUR)
+		off += f->pos;
+	f->pos = off;
+	return true;
+}
+
+/* Number of padding bytes needed at offset to write length bytes with the
+	given alignment, without crossing a block boundary if it can be helped */
+static size_t hhm_padding(hardhat_maker_t *hhm, uint64_t offset, size_t length, size_t alignment) {
+	size_t blocksize, align, start, end;
+
+	blocksize = 1 << hhm->superblock.blocksize;
+
+	align = -offset % alignment;
+	offset += align;
+
+	start = offset % blocksize;
+	end = blocksize - -(offset + length) % blocksize;
+
+	if(start > end)
+		align += -offset % blocksize;
+
+	return align;
+}
+
+/* Append zero bytes to a file; large amounts are skipped over instead */
+static bool hhm_db_zero(hardhat_maker_t *hhm, struct hhm_file *f, size_t align) {
+	size_t remaining;
+
+	if(!align)
+		return true;
+
+	if(f->mapped) {
+		if(!hhm_db_window(hhm, f, (size_t)f->pos + align))
+			return false;
+		memset(f->window + f->pos, 0, align);
+		f->pos += align;
+	} else if(align >= f->outbufsize) {
+		if(!hhm_db_seek(hhm, f, align, SEEK_CUR))
+			return false;
+	} else {
+		remaining = f->outbufsize - f->outbuflen;
+		if(align > remaining) {
+			memset(f->outbuf + f->outbuflen, 0, remaining);
+			if(!hhm_db_outbuf(hhm, f, f->outbufsize))
+				return false;
+			f->outbuflen = align - remaining;
+			memset(f->outbuf, 0, f->outbuflen);
+		} else {
+			memset(f->outbuf + f->outbuflen, 0, align);
+			f->outbuflen += align;
+			if(align == remaining && !hhm_db_flush(hhm, f))
+				return false;
+		}
+	}
+
+	f->off += align;
+	return true;
+}
+
+/* Append bytes to a file and update off. Large amounts are written out
+	together with the output buffer, without copying them into it first;
+	with background writers, only if they don't fit in the buffer at all. */
+static bool hhm_db_append(hardhat_maker_t *hhm, struct hhm_file *f, const void *buf, size_t len) {
+	struct iovec iov[2];
+	size_t remaining;
+
+	if(!len)
+		return true;
+
+	if(f->mapped) {
+		if(!hhm_db_write(hhm, f, buf, len))
+			return false;
+	} else if(len >= (f->aio ? f->outbufsize : GATHERSIZE)) {
+		if(f->aio) {
+			if(!hhm_db_flush(hhm, f))
+				return false;
+			if(!hhm_db_write(hhm, f, buf, len))
+				return false;
+		} else {
+			iov[0].iov_base = f->outbuf;
+			iov[0].iov_len = f->outbuflen;
+			iov[1].iov_base = (void *)buf;
+			iov[1].iov_len = len;
+			f->outbuflen = 0;
+			if(!hhm_db_writev(hhm, f, iov, 2))
+				return false;
+		}
+	} else {
+		remaining = f->outbufsize - f->outbuflen;
+		if(len > remaining) {
+			memcpy(f->outbuf + f->outbuflen, buf, remaining);
+			if(!hhm_db_outbuf(hhm, f, f->outbufsize))
+				return false;
+
+			f->outbuflen = len - remaining;
+			memcpy(f->outbuf, (const uint8_t *)buf + remaining, f->outbuflen);
+		} else {
+			memcpy(f->outbuf + f->outbuflen, buf, len);
+			f->outbuflen += len;
+			if(len == remaining && !hhm_db_flush(hhm, f))
+				return false;
+		}
+	}
+
+	f->off += len;
+	return true;
+}
+
+/* Append a number of buffers to a file. A buffer with a NULL base
+	stands for that many zero bytes. */
+static bool hhm_db_appendv(hardhat_maker_t *hhm, struct hhm_file *f, const struct iovec *iov, int iovcnt) {
+	int i;
+
+	for(i = 0; i < iovcnt; i++) {
+		if(iov[i].iov_base) {
+			if(!hhm_db_append(hhm, f, iov[i].iov_base, iov[i].iov_len))
+				return false;
+		} else {
+			if(!hhm_db_zero(hhm, f, iov[i].iov_len))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Write a file through a shared writable mapping from now on */
+static bool hhm_db_mapped(hardhat_maker_t *hhm, struct hhm_file *f) {
+	if(!hhm_db_flush(hhm, f))
+		return false;
+
+	if(f->window != MAP_FAILED)
+		munmap(f->window, f->windowsize);
+	f->window = MAP_FAILED;
+	f->windowsize = 0;
+
+	free(f->outbuf);
+	f->outbuf = NULL;
+	f->mapped = true;
+
+	return true;
+}
+
+/* Wait for all writes to a file to complete and stop its background
+	writers, if any */
+static bool hhm_db_drain(hardhat_maker_t *hhm, struct hhm_file *f) {
+	bool ok;
+
+	if(!hhm_db_flush(hhm, f))
+		return false;
+	if(!f->aio)
+		return true;
+	ok = hhm_aio_wait(hhm, f, 0, UINT64_MAX);
+	hhm_aio_stop(f);
+	return ok;
+}
+
+static bool hhm_db_pad(hardhat_maker_t *hhm, struct hhm_file *f, size_t length, size_t alignment) {
+	return hhm_db_zero(hhm, f, hhm_padding(hhm, f->off, length, alignment));
+}
+
+/* Write out any buffered data and make the whole file available in
+	the window */
+static bool hhm_db_map(hardhat_maker_t *hhm, struct hhm_file *f) {
+	if(!hhm_db_flush(hhm, f))
+		return false;
+	if(f->aio && !hhm_aio_wait(hhm, f, 0, UINT64_MAX))
+		return false;
+	return hhm_db_window(hhm, f, f->off);
+}
+
+/* Fetch already written bytes from a file. Bytes that are still in the
+	output buffer are returned from there; others from the window, which
+	is grown as needed. The returned pointer is valid until the next call
+	to any of the hhm_db_*() functions for this file. */
+static const uint8_t *hhm_db_getrec(hardhat_maker_t *hhm, struct hhm_file *f, uint64_t off, size_t len) {
+	uint64_t buffered = f->off - f->outbuflen;
+
+	if(off >= buffered && !f->mapped)
+		return f->outbuf + (off - buffered);
+
+	/* Partly written out? Then write out the rest as well */
+	if(off + len > buffered && !hhm_db_flush(hhm, f))
+		return NULL;
+
+	/* Still on its way to the file? */
+	if(f->aio && !hhm_aio_wait(hhm, f, off, off + len))
+		return NULL;
+
+	if(!hhm_db_window(hhm, f, off + len))
+		return NULL;
+
+	return f->window + off;
+}
+
+/* Fetch a key record, from whichever file they are stored in */
+static const uint8_t *hhm_getrec(hardhat_maker_t *hhm, uint64_t off) {
+	const uint8_t *rec;
+
+	rec = hhm_db_getrec(hhm, hhm->records, off, 6);
+	if(!rec)
+		return NULL;
+
+	return hhm_db_getrec(hhm, hhm->records, off, (size_t)6 + u16read(rec + 4));
+}
+
+/* Keep a copy of a key record in memory, as long as it fits in the budget.
+	Once a record doesn't fit, no further records are added, so the arena
+	always holds the records with the lowest indexes. */
+static void hhm_arena_add(hardhat_maker_t *hhm, uint32_t datalen, uint16_t keylen, const uint8_t *key) {
+	size_t reclen, arenasize, arenaoffsize;
+	uint8_t *rec;
+	void *buf;
+
+	/* With a memory budget, records are renumbered for every run */
+	if(hhm->arenanum != hhm->recnum || !hhm->arenabudget || hhm->budget)
+		return;
+
+	reclen = ((size_t)6 + keylen + 3) & ~(size_t)3;
+	arenasize = hhm->arenasize;
+	arenaoffsize = hhm->arenaoffsize;
+
+	if(hhm->arenanum == arenaoffsize)
+		arenaoffsize = arenaoffsize ? arenaoffsize * 2 : 65536;
+	if(hhm->arenalen + reclen > arenasize) {
+		if(!arenasize)
+			arenasize = 1048576;
+		while(hhm->arenalen + reclen > arenasize)
+			arenasize *= 2;
+	}
+
+	if(arenasize + arenaoffsize * sizeof *hhm->arenaoff > hhm->arenabudget) {
+		/* Settle for whatever is left of the budget, if that is enough */
+		if(hhm->arenalen + reclen + arenaoffsize * sizeof *hhm->arenaoff > hhm->arenabudget)
+			return;
+		arenasize = hhm->arenabudget - arenaoffsize * sizeof *hhm->arenaoff;
+	}
+
+	if(arenaoffsize != hhm->arenaoffsize) {
+		buf = realloc(hhm->arenaoff, arenaoffsize * sizeof *hhm->arenaoff);
+		if(!buf)
+			return;
+		hhm->arenaoff = buf;
+		hhm->arenaoffsize = arenaoffsize;
+	}
+
+	if(arenasize != hhm->arenasize) {
+		buf = realloc(hhm->arena, arenasize);
+		if(!buf)
+			return;
+		hhm->arena = buf;
+		hhm->arenasize = arenasize;
+	}
+
+	rec = hhm->arena + hhm->arenalen;
+	memcpy(rec, &datalen, sizeof datalen);
+	memcpy(rec + 4, &keylen, sizeof keylen);
+	memcpy(rec + 6, key, keylen);
+	hhm->arenaoff[hhm->arenanum++] = hhm->arenalen;
+	hhm->arenalen += reclen;
+}
+
+/* Release the arena; after this, records are read from the file again */
+static void hhm_arena_free(hardhat_maker_t *hhm) {
+	free(hhm->arena);
+	hhm->arena = NULL;
+	free(hhm->arenaoff);
+	hhm->arenaoff = NULL;
+	hhm->arenasize = hhm->arenalen = hhm->arenaoffsize = 0;
+	hhm->arenanum = 0;
+}
+
+/* Fetch the key record with the given index, from the arena if possible */
+static const uint8_t *hhm_key(hardhat_maker_t *hhm, uint32_t i) {
+	if(i < hhm->arenanum)
+		return hhm->arena + hhm->arenaoff[i];
+	return hhm_getrec(hhm, hhm->recbuf[i]);
+}
+
+/* Release the resources associated with a file */
+static void hhm_db_close(struct hhm_file *f) {
+	hhm_aio_stop(f);
+	if(f->fd != -1)
+		close(f->fd);
+	f->fd = -1;
+	free(f->outbuf);
+	f->outbuf = NULL;
+	if(f->window != MAP_FAILED)
+		munmap(f->window, f->windowsize);
+	f->window = MAP_FAILED;
+	f->windowsize = 0;
+}
+
+/* Create a file with a new hidden name in the directory of the database */
+static int hhm_tmpname(hardhat_maker_t *hhm, char *name, size_t size, int mode) {
+	unsigned int tries;
+	int fd;
+
+	for(tries = 0; tries < 100; tries++) {
+		snprintf(name, size, ".hardhat-%08"PRIx32, makeseed());
+		fd = openat(hhm->dirfd, name, O_RDWR|O_CREAT|O_EXCL|O_LARGEFILE|O_NOCTTY|O_CLOEXEC, mode);
+		if(fd != -1)
+			return fd;
+		if(errno != EEXIST)
+			break;
+	}
+
+	*name = '\0';
+	return -1;
+}
+
+/* Create an anonymous temporary file in the directory of the database */
+static int hhm_tmpfile(hardhat_maker_t *hhm) {
+	char name[32];
+	int fd;
+
+#ifdef O_TMPFILE
+	fd = openat(hhm->dirfd, ".", O_TMPFILE|O_RDWR|O_LARGEFILE|O_NOCTTY|O_CLOEXEC, 0600);
+	if(fd != -1)
+		return fd;
+#endif
+
+	/* Fall back to a named file that is removed right away */
+	fd = hhm_tmpname(hhm, name, sizeof name, 0600);
+	if(fd != -1)
+		unlinkat(hhm->dirfd, name, 0);
+
+	return fd;
+}
+
+/* Check that the database can be written, without creating it yet: either
+	the file or the directory it is in must be writable (which one depends
+	on hardhat_maker_atomic()), and the file can't be a directory */
+static bool hhm_db_check(hardhat_maker_t *hhm) {
+	struct stat st;
+
+	if(fstatat(hhm->dirfd, hhm->basename, &st, 0) == -1) {
+		if(errno != ENOENT)
+			return false;
+		return faccessat(hhm->dirfd, ".", W_OK, 0) != -1;
+	}
+
+	if(S_ISDIR(st.st_mode)) {
+		errno = EISDIR;
+		return false;
+	}
+
+	return faccessat(hhm->dirfd, hhm->basename, W_OK, 0) != -1
+		|| faccessat(hhm->dirfd, ".", W_OK, 0) != -1;
+}
+
+/* Open the file the database is written to, unless that happened already:
+	the database itself, or in atomic mode a file that only gets its name
+	once it's complete */
+static bool hhm_db_create(hardhat_maker_t *hhm) {
+	int fd = -1;
+
+	if(hhm->db.fd != -1)
+		return true;
+
+	if(!hhm->atomic) {
+		fd = openat(hhm->dirfd, hhm->basename, O_RDWR|O_CREAT|O_LARGEFILE|O_NOCTTY|O_CLOEXEC, hhm->mode);
+		if(fd == -1) {
+			hhm_set_error(hhm, "opening %s failed: %m", hhm->filename);
+			hhm->failed = true;
+			return false;
+		}
+		hhm->db.fd = fd;
+		return true;
+	}
+
+#ifdef O_TMPFILE
+	/* Linking an unnamed file into place requires /proc (see hhm_publish()) */
+	if(faccessat(AT_FDCWD, "/proc/self/fd", X_OK, 0) != -1)
+		fd = openat(hhm->dirfd, ".", O_TMPFILE|O_RDWR|O_LARGEFILE|O_NOCTTY|O_CLOEXEC, hhm->mode);
+#endif
+
+	/* Otherwise use a hidden name that is renamed at the end */
+	if(fd == -1)
+		fd = hhm_tmpname(hhm, hhm->tmpname, sizeof hhm->tmpname, hhm->mode);
+
+	if(fd == -1) {
+		hhm_set_error(hhm, "creating a temporary file for %s failed: %m", hhm->filename);
+		hhm->failed = true;
+		return false;
+	}
+
+	hhm->db.fd = fd;
+	return true;
+}
+
+/* Read a range of a file, handling short reads */
+static bool hhm_read(hardhat_maker_t *hhm, int fd, void *buf, size_t len, off_t off) {
+	ssize_t r;
+
+	while(len) {
+		r = pread(fd, buf, len, off);
+		if(r == -1) {
+			hhm_set_error(hhm, "reading %zu bytes of a value failed: %m", len);
+			return false;
+		}
+		if(!r) {
+			hhm_set_error(hhm, "reading %zu bytes of a value failed: unexpected end of file", len);
+			errno = EINVAL;
+			return false;
+		}
+		len -= (size_t)r;
+		off += r;
+		buf = (uint8_t *)buf + r;
+	}
+
+	return true;
+}
+
+/* Append a range of another file, reading it directly into the output
+	buffer (or the window, for mapped files) */
+static bool hhm_db_read(hardhat_maker_t *hhm, struct hhm_file *f, int fd, off_t off, size_t len) {
+	size_t chunk;
+
+	if(f->mapped) {
+		if(!hhm_db_window(hhm, f, (size_t)f->pos + len))
+			return false;
+		if(!hhm_read(hhm, fd, f->window + f->pos, len, off)) {
+			hhm->failed = true;
+			return false;
+		}
+		f->pos += (off_t)len;
+		f->off += (off_t)len;
+		return true;
+	}
+
+	while(len) {
+		if(!hhm_db_flush(hhm, f))
+			return false;
+		chunk = len < f->outbufsize ? len : f->outbufsize;
+		if(!hhm_read(hhm, fd, f->outbuf, chunk, off)) {
+			hhm->failed = true;
+			return false;
+		}
+		f->outbuflen = chunk;
+		f->off += (off_t)chunk;
+		off += (off_t)chunk;
+		len -= chunk;
+	}
+
+	return true;
+}
+
+/* Copy a range of another file to the end of a file. The kernel may share
+	the blocks between the files or at least avoid copying them to user
+	space. Where it can't, the data is written from the given mapping, or
+	read straight into the output buffer if there is none. */
+static bool hhm_db_copy(hardhat_maker_t *hhm, struct hhm_file *f, int fd, const uint8_t *map, off_t off, size_t len) {
+	if(!hhm_db_flush(hhm, f))
+		return false;
+
+	if(f->mapped && !hhm_db_window(hhm, f, (size_t)f->pos + len))
+		return false;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	while(len) {
+		ssize_t r = copy_file_range(fd, &off, f->fd, &f->pos, len, 0);
+		if(r <= 0)
+			break;
+		len -= (size_t)r;
+		f->off += r;
+	}
+#endif
+
+	if(!map)
+		return hhm_db_read(hhm, f, fd, off, len);
+
+	if(!hhm_db_write(hhm, f, map + off, len))
+		return false;
+	f->off += len;
+
+	return true;
+}
+
+/* Alignment for a value: values that are copied from a file at a block
+	boundary are put at a block boundary as well, if they are at least a
+	block long, so that the filesystem can share the blocks. Version 3
+	readers derive the padding from the alignment, so there it is fixed. */
+static size_t hhm_value_alignment(hardhat_maker_t *hhm, int fd, off_t fdoff, uint32_t datalen) {
+	size_t alignment = (size_t)1 << hhm->superblock.alignment;
+	size_t blocksize = (size_t)1 << hhm->superblock.blocksize;
+
+	if(fd != -1 && hhm->superblock.version >= 4 && blocksize > alignment
+			&& datalen >= blocksize && !((size_t)fdoff % blocksize))
+		return blocksize;
+
+	return alignment;
+}
+
+/* Write a value to the database (version 4+ only), unless deduplication
+	is enabled and an identical value was written before. Either way, the
+	offset of the value is returned in *off. If data is NULL, the value is
+	copied from fd at fdoff instead (not with deduplication). */
+static bool hhm_db_value(hardhat_maker_t *hhm, const void *data, int fd, off_t fdoff, uint32_t datalen, uint64_t *off) {
+	struct hhm_file *db = &hhm->db;
+	struct hhm_value *value;
+
+	if(hhm->dedup) {
+		uint32_t reference_hash = hhm_calchash(hhm, data, (size_t)datalen);
+		struct hashtable *ht = hhm->values;
+		struct hashprobe probe;
+		const struct hashentry *entry;
+
+		hashprobe_start(&probe, ht, reference_hash);
+		while((entry = hashprobe_next(&probe, reference_hash))) {
+			if(entry->hash != reference_hash)
+				continue;
+			value = hhm->valuebuf + entry->data;
+			if(value->len == datalen) {
+				const uint8_t *old = hhm_db_getrec(hhm, db, value->off, datalen);
+				if(!old)
+					return false;
+				if(!memcmp(old, data, datalen)) {
+					*off = value->off;
+					return true;
+				}
+			}
+		}
+
+		if(!addhash(ht, reference_hash, hhm->valuenum)) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+
+		if(hhm->valuenum == hhm->valuebufsize) {
+			hhm->valuebufsize *= 2;
+			value = realloc(hhm->valuebuf, hhm->valuebufsize * sizeof *hhm->valuebuf);
+			if(!value) {
+				hhm_set_enomem(hhm);
+				return false;
+			}
+			hhm->valuebuf = value;
+		}
+	}
+
+	if(datalen && !hhm_db_pad(hhm, db, datalen, hhm_value_alignment(hhm, fd, fdoff, datalen)))
+		return false;
+
+	*off = db->off;
+
+	if(data || fd == -1) {
+		if(!hhm_db_append(hhm, db, data, datalen))
+			return false;
+	} else {
+		if(!hhm_db_copy(hhm, db, fd, NULL, fdoff, datalen))
+			return false;
+	}
+
+	if(hhm->dedup) {
+		value = hhm->valuebuf + hhm->valuenum++;
+		value->off = *off;
+		value->len = datalen;
+	}
+
+	return true;
+}
+
+/* Copy the data section of the base database to the same place in the new
+	one, so that the offsets of its records and values remain valid */
+static bool hhm_base_copy(hardhat_maker_t *hhm) {
+	const struct hardhat *base = hhm->base;
+	const char *problem = NULL;
+
+	if((hhm->superblock.version < 4) != (base->version < 4))
+		problem = "can't convert a base database between version 3 and later versions";
+	else if(hhm->superblock.alignment != base->alignment || hhm->superblock.blocksize != base->blocksize)
+		problem = "can't change the alignment or block size of a base database";
+	else if(hhm->superblock.data_start != base->data_start)
+		problem = "the data section of the base database is in an unexpected place";
+
+	if(problem) {
+		hhm_set_error(hhm, "%s", problem);
+		hhm->failed = true;
+		return false;
+	}
+
+	return hhm_db_copy(hhm, &hhm->db, hhm->basefd, (const uint8_t *)base,
+		(off_t)base->data_start, (size_t)(base->data_end - base->data_start));
+}
+
+/* The size of the superblock, which depends on the database version */
+static size_t hhm_headersize(const hardhat_maker_t *hhm) {
+	return hhm_version_headersize(hhm->superblock.version);
+}
+
+/* Check whether two file handles refer to the same file */
+static bool hhm_same_file(int a, int b) {
+	struct stat sa, sb;
+
+	if(fstat(a, &sa) == -1 || fstat(b, &sb) == -1)
+		return false;
+
+	return sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+/* Check whether a database that was opened with hardhat_open() is the file
+	behind a file handle, by looking up its mapping in /proc. If that is not
+	possible, assume it's not. */
+static bool hhm_maps_file(int fd, const void *map) {
+	struct stat st;
+	FILE *maps;
+	char line[256];
+	unsigned long start, end;
+	unsigned int devmajor, devminor;
+	uint64_t ino;
+	bool same = false;
+
+	if(fstat(fd, &st) == -1)
+		return false;
+
+	maps = fopen("/proc/self/maps", "re");
+	if(!maps)
+		return false;
+
+	while(fgets(line, sizeof line, maps)) {
+		if(sscanf(line, "%lx-%lx %*s %*s %x:%x %"SCNu64, &start, &end, &devmajor, &devminor, &ino) != 5)
+			continue;
+		if((uintptr_t)map < start || (uintptr_t)map >= end)
+			continue;
+		same = ino == (uint64_t)st.st_ino && devmajor == major(st.st_dev) && devminor == minor(st.st_dev);
+		break;
+	}
+
+	fclose(maps);
+
+	return same;
+}
+
+/* Fix the layout of the database when the first entry is added */
+static bool hhm_start(hardhat_maker_t *hhm) {
+	static const uint8_t extension[sizeof(struct widehardhat) - sizeof(struct hardhat)];
+
+	if(hhm->started)
+		return true;
+
+	if(!hhm_db_create(hhm))
+		return false;
+
+	/* Writing the database in place would destroy the base as we go */
+	if(hhm->base && !hhm->atomic && hhm_same_file(hhm->db.fd, hhm->basefd)) {
+		hhm_set_error(hhm, "%s can only be its own base database in atomic mode", hhm->filename);
+		hhm->failed = true;
+		return false;
+	}
+
+	/* Reserve room for the superblock, which is written at the end */
+	if(!hhm_db_append(hhm, &hhm->db, &hhm->superblock, sizeof hhm->superblock))
+		return false;
+
+	if(hhm->bulk) {
+		/* Duplicates are removed at the end, no hash table needed */
+		freehash(hhm->hashtable);
+		hhm->hashtable = NULL;
+	}
+
+	if(hhm->dedup) {
+		if(hhm->superblock.version < 4) {
+			hhm_set_error(hhm, "deduplication of values requires database version 4 or later");
+			hhm->failed = true;
+			return false;
+		}
+
+		hhm->values = newhash();
+		hhm->valuebuf = malloc(hhm->valuebufsize * sizeof *hhm->valuebuf);
+		if(!hhm->values || !hhm->valuebuf) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	if(hhm->superblock.version >= 4) {
+		/* Make room for the extended superblock */
+		if(!hhm_db_append(hhm, &hhm->db, extension, hhm_headersize(hhm) - sizeof hhm->superblock))
+			return false;
+
+		/* Keys are kept in a scratch file until they can be written out
+			in directory order */
+		hhm->keys.fd = hhm_tmpfile(hhm);
+		if(hhm->keys.fd == -1) {
+			hhm_set_error(hhm, "creating a temporary file for %s failed: %m", hhm->filename);
+			hhm->failed = true;
+			return false;
+		}
+
+		hhm->keys.outbuf = malloc(OUTBUFSIZE);
+		if(!hhm->keys.outbuf) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+
+		hhm->records = &hhm->keys;
+	}
+
+	if(hhm->mapped) {
+		if(!hhm_db_mapped(hhm, &hhm->db))
+			return false;
+		if(hhm->superblock.version >= 4 && !hhm_db_mapped(hhm, &hhm->keys))
+			return false;
+	} else if(hhm->writers) {
+		if(!hhm_aio_start(hhm, &hhm->db, true))
+			return false;
+		if(hhm->superblock.version >= 4 && !hhm_aio_start(hhm, &hhm->keys, false))
+			return false;
+	}
+
+	hhm->superblock.data_start = hhm->db.off;
+	hhm->started = true;
+
+	if(hhm->base && !hhm_base_copy(hhm))
+		return false;
+
+	return true;
+}
+
+/* Allocate and initialize a hardhat_maker_t structure.
+	Returns NULL on failure, with errno set to the problem. */
+export hardhat_maker_t *hardhat_maker_new(const char *filename) {
+	return hardhat_maker_newat(AT_FDCWD, filename, 0666);
+}
+
+export hardhat_maker_t *hardhat_maker_newat(int dirfd, const char *filename, int mode) {
+	hardhat_maker_t *hhm;
+	const char *slash;
+	char *dirname;
+	int err;
+
+	if(!filename) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	hhm = malloc(sizeof *hhm);
+	if(!hhm)
+		return NULL;
+
+	*hhm = hardhat_maker_0;
+	hhm->records = &hhm->db;
+
+	hhm->superblock.hashseed = makeseed();
+	hhm->superblock.alignment = HARDHAT_DEFAULT_ALIGNMENT;
+	hhm->superblock.blocksize = HARDHAT_DEFAULT_BLOCKSIZE;
+	hhm->superblock.version = HARDHAT_DEFAULT_VERSION;
+	hhm->newsuperblock.keyblock = HARDHAT_DEFAULT_KEYBLOCK;
+	hhm->threads = HARDHAT_DEFAULT_THREADS;
+
+	hhm->filename = strdup(filename);
+	if(!hhm->filename) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+	hhm->db.name = hhm->filename;
+	hhm->mode = mode;
+
+	/* Temporary files are created next to the database */
+	slash = strrchr(filename, '/');
+	hhm->basename = slash ? hhm->filename + (slash - filename) + 1 : hhm->filename;
+	if(slash) {
+		dirname = strndup(filename, slash == filename ? (size_t)1 : (size_t)(slash - filename));
+		if(!dirname) {
+			err = errno;
+			hardhat_maker_free(hhm);
+			errno = err;
+			return NULL;
+		}
+		hhm->dirfd = openat(dirfd, dirname, O_PATH|O_DIRECTORY|O_CLOEXEC);
+		free(dirname);
+	} else {
+		hhm->dirfd = openat(dirfd, ".", O_PATH|O_DIRECTORY|O_CLOEXEC);
+	}
+	if(hhm->dirfd == -1) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+
+	hhm->keybuf = malloc(65536);
+	if(!hhm->keybuf) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+
+	hhm->lastkey = malloc(65536);
+	if(!hhm->lastkey) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+
+	hhm->db.outbuf = malloc(OUTBUFSIZE);
+	if(!hhm->db.outbuf) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+
+	/* Nothing is created until output starts, but problems should show
+		up early */
+	if(!hhm_db_check(hhm)) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+
+	hhm->recbuf = malloc(hhm->recbufsize * sizeof *hhm->recbuf);
+	if(!hhm->recbuf) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+
+	hhm->hashtable = newhash();
+	if(!hhm->hashtable) {
+		err = errno;
+		hardhat_maker_free(hhm);
+		errno = err;
+		return NULL;
+	}
+
+	return hhm;
+}
+
+/* Check if the entry isn't already in the hash table. If it is, return
+	false. If not, add it and return true. Also returns false on error,
+	after setting hhm->failed. */
+static bool hhm_check_duplicate(hardhat_maker_t *hhm, const uint8_t *key, uint16_t keylen, uint32_t reference_hash) {
+	struct hashtable *ht = hhm->hashtable;
+	struct hashprobe probe;
+	const struct hashentry *entry;
+
+	hashprobe_start(&probe, ht, reference_hash);
+	while((entry = hashprobe_next(&probe, reference_hash))) {
+		if(entry->hash != reference_hash)
+			continue;
+		const uint8_t *old = hhm_key(hhm, entry->data);
+		if(!old)
+			return false;
+		if(u16read(old + 4) == keylen && !memcmp(old + 6, key, keylen))
+			return false;
+	}
+
+	if(!addhash(ht, reference_hash, hhm->recnum)) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	return true;
+}
+
+/* Put all records added so far in the hash table, for when entries stop
+	arriving in directory order and duplicates can be anywhere */
+static bool hhm_hash_records(hardhat_maker_t *hhm) {
+	const uint8_t *rec;
+	uint32_t i;
+
+	for(i = 0; i < hhm->recnum; i++) {
+		rec = hhm_key(hhm, i);
+		if(!rec)
+			return false;
+		if(!addhash(hhm->hashtable, hhm_calchash(hhm, rec + 6, u16read(rec + 4)), i)) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* While entries arrive in directory order, a duplicate can only be the
+	previous entry. Returns false if the entry is a duplicate or on error
+	(after setting hhm->failed). Once an entry is out of order, the hash
+	table takes over. */
+static bool hhm_check_sorted(hardhat_maker_t *hhm, const uint8_t *key, uint16_t keylen) {
+	int r;
+
+	if(!hhm->recnum)
+		return true;
+
+	r = hardhat_cmp(hhm->lastkey, hhm->lastkeylen, key, keylen);
+	if(r < 0)
+		return true;
+	if(!r)
+		return false;
+
+	hhm->sorted = false;
+	return hhm->bulk || hhm_hash_records(hhm);
+}
+
+/* Look for a key among the first num records, which must be in directory
+	order. Returns false on error (after setting hhm->failed). */
+static bool hhm_search(hardhat_maker_t *hhm, const uint8_t *key, uint16_t keylen, uint32_t num, bool *found) {
+	const uint8_t *rec;
+	uint32_t lo, hi, mid;
+	int r;
+
+	lo = 0;
+	hi = num;
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		rec = hhm_key(hhm, mid);
+		if(!rec)
+			return false;
+		r = hardhat_cmp(rec + 6, u16read(rec + 4), key, keylen);
+		if(!r) {
+			*found = true;
+			return true;
+		}
+		if(r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*found = false;
+	return true;
+}
+
+/* Write a key record to the scratch file (version 4+), preceded by the
+	offset of the value. Returns the offset of the record in *off. */
+static bool hhm_keys_append(hardhat_maker_t *hhm, uint64_t valueoff, const uint8_t *key, uint16_t keylen, uint32_t datalen, uint64_t *off) {
+	struct hhm_file *keys = &hhm->keys;
+	uint8_t header[14];
+	struct iovec iov[3];
+
+	memcpy(header, &valueoff, sizeof valueoff);
+	memcpy(header + 8, &datalen, sizeof datalen);
+	memcpy(header + 12, &keylen, sizeof keylen);
+
+	iov[0].iov_base = NULL;
+	iov[0].iov_len = hhm_padding(hhm, keys->off, 0, sizeof valueoff);
+	iov[1].iov_base = header;
+	iov[1].iov_len = sizeof header;
+	iov[2].iov_base = (void *)key;
+	iov[2].iov_len = keylen;
+
+	*off = keys->off + iov[0].iov_len + sizeof valueoff;
+
+	return hhm_db_appendv(hhm, keys, iov, 3);
+}
+
+static bool hhm_spill_run(hardhat_maker_t *hhm);
+
+/* Add the offset of a record to the list (resizing it as necessary). With
+	a memory budget, a full list is sorted and written out as a run first.
+	Only then can version 6 databases have more than 2^32 entries: without
+	a budget, all of them are counted in the list. */
+static bool hhm_record(hardhat_maker_t *hhm, uint64_t off) {
+	if((!hhm->budget || hhm->superblock.version < 6) && hhm->spilled + hhm->recnum >= UINT32_MAX - 1) {
+		hhm_set_error(hhm, "too many entries");
+		hhm->failed = true;
+		return false;
+	}
+	if(hhm->budget && hhm->recnum == hhm_runsize(hhm) && !hhm_spill_run(hhm))
+		return false;
+	if(hhm->recnum == hhm->recbufsize) {
+		hhm->recbufsize *= 2;
+		if(hhm->budget && hhm->recbufsize > hhm_runsize(hhm))
+			hhm->recbufsize = hhm_runsize(hhm);
+		void *buf = realloc(hhm->recbuf, hhm->recbufsize * sizeof *hhm->recbuf);
+		if(!buf) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+		hhm->recbuf = buf;
+	}
+	hhm->recbuf[hhm->recnum++] = off;
+
+	return true;
+}
+
+/* Write out an entry. Returns the offset of its record in *off. If data is
+	NULL, the value is copied from fd at fdoff. */
+static bool hhm_write_record(hardhat_maker_t *hhm, const uint8_t *key, uint16_t keylen, const void *data, int fd, off_t fdoff, uint32_t datalen, uint64_t *off) {
+	struct hhm_file *db = &hhm->db;
+
+	if(hhm->superblock.version >= 4) {
+		/* The value goes into the database, the key into the scratch file */
+		uint64_t valueoff;
+
+		if(!hhm_db_value(hhm, data, fd, fdoff, datalen, &valueoff))
+			return false;
+
+		if(!hhm_keys_append(hhm, valueoff, key, keylen, datalen, off))
+			return false;
+	} else {
+		uint8_t header[6];
+		struct iovec iov[5];
+
+		memcpy(header, &datalen, sizeof datalen);
+		memcpy(header + 4, &keylen, sizeof keylen);
+
+		/* For padding purposes, only use the size fields in the calculation. */
+		/* Using more would cause the file to increase in size significantly. */
+		iov[0].iov_base = NULL;
+		iov[0].iov_len = hhm_padding(hhm, db->off, (size_t)6 + (size_t)datalen, 4);
+
+		*off = db->off + iov[0].iov_len;
+
+		/* Write out the entry to disk, with the value aligned */
+		iov[1].iov_base = header;
+		iov[1].iov_len = sizeof header;
+		iov[2].iov_base = (void *)key;
+		iov[2].iov_len = keylen;
+		iov[3].iov_base = NULL;
+		iov[3].iov_len = hhm_padding(hhm, *off + sizeof header + keylen, datalen, (size_t)1 << hhm->superblock.alignment);
+		iov[4].iov_base = (void *)data;
+		iov[4].iov_len = datalen;
+
+		if(data || fd == -1) {
+			if(!hhm_db_appendv(hhm, db, iov, 5))
+				return false;
+		} else {
+			if(!hhm_db_appendv(hhm, db, iov, 4))
+				return false;
+			if(!hhm_db_copy(hhm, db, fd, NULL, fdoff, datalen))
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Add an entry with an already normalized key. If the hash of the key is
+	not supplied, it is calculated only if needed. If data is NULL, the
+	value is copied from fd at fdoff. */
+static bool hhm_add(hardhat_maker_t *hhm, const uint8_t *key, uint16_t keylen, const uint32_t *hash, const void *data, int fd, off_t fdoff, uint32_t datalen) {
+	if(hhm->sorted && !hhm_check_sorted(hhm, key, keylen))
+		return !hhm->failed;
+
+	if(!hhm->sorted && !hhm->bulk && !hhm_check_duplicate(hhm, key, keylen, hash ? *hash : hhm_calchash(hhm, key, keylen)))
+		return !hhm->failed;
+
+	uint64_t off;
+
+	if(!hhm_write_record(hhm, key, keylen, data, fd, fdoff, datalen, &off))
+		return false;
+
+	hhm_arena_add(hhm, datalen, keylen, key);
+
+	if(!hhm_record(hhm, off))
+		return false;
+
+	if(hhm->sorted) {
+		/* Keep this key around to compare the next one with */
+		memcpy(hhm->lastkey, key, keylen);
+		hhm->lastkeylen = keylen;
+	}
+
+	return true;
+}
+
+/* Add an entry to the database (if it doesn't exist yet).
+	Returns true on success (or if the entry already existed!)
+	Returns false on error. */
+export bool hardhat_maker_add(hardhat_maker_t *hhm, const void *key, uint16_t keylen, const void *data, uint32_t datalen) {
+	if(!hhm || hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		return false;
+	}
+	if(!key && keylen) {
+		hhm_set_error(hhm, "key parameter to hardhat_maker_add is NULL");
+		return false;
+	}
+	if(!data && datalen) {
+		hhm_set_error(hhm, "data parameter to hardhat_maker_add is NULL");
+		return false;
+	}
+	if(datalen > INT32_MAX) {
+		hhm_set_error(hhm, "datalen parameter to hardhat_maker_add is too large");
+		return false;
+	}
+
+	if(!hhm_start(hhm))
+		return false;
+
+	keylen = (uint16_t)hardhat_normalize(hhm->keybuf, key, keylen);
+
+	return hhm_add(hhm, hhm->keybuf, keylen, NULL, data, -1, 0, datalen);
+}
+
+export bool hardhat_maker_add_fd(hardhat_maker_t *hhm, const void *key, uint16_t keylen, int fd, uint64_t offset, uint32_t datalen) {
+	void *data;
+	bool ok;
+
+	if(!hhm || hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		return false;
+	}
+	if(!key && keylen) {
+		hhm_set_error(hhm, "key parameter to hardhat_maker_add_fd is NULL");
+		return false;
+	}
+	if(fd < 0) {
+		hhm_set_error(hhm, "fd parameter to hardhat_maker_add_fd is invalid");
+		return false;
+	}
+	if(datalen > INT32_MAX) {
+		hhm_set_error(hhm, "datalen parameter to hardhat_maker_add_fd is too large");
+		return false;
+	}
+	if(offset > (uint64_t)INT64_MAX - datalen) {
+		hhm_set_error(hhm, "offset parameter to hardhat_maker_add_fd is too large");
+		return false;
+	}
+
+	if(!hhm_start(hhm))
+		return false;
+
+	if(hhm->dedup) {
+		/* The value needs to be compared with the others anyway */
+		data = malloc(datalen ? datalen : 1);
+		if(!data) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+		ok = hhm_read(hhm, fd, data, datalen, (off_t)offset)
+			&& hardhat_maker_add(hhm, key, keylen, data, datalen);
+		free(data);
+		return ok;
+	}
+
+	keylen = (uint16_t)hardhat_normalize(hhm->keybuf, key, keylen);
+
+	return hhm_add(hhm, hhm->keybuf, keylen, NULL, NULL, fd, (off_t)offset, datalen);
+}
+
+#define BATCH_ENTRIES 64
+#define BATCH_BUFSIZE ((size_t)1 << 18)
+
+/* A normalized key in the batch buffer */
+struct hhm_batchkey {
+	/* Offset in the batch buffer */
+	size_t off;
+	/* Hash of the key, if it is needed */
+	uint32_t hash;
+	/* Length of the normalized key */
+	uint16_t keylen;
+};
+
+/* Check an entry of a batch, setting an error if it can't be added */
+static bool hhm_batch_check(hardhat_maker_t *hhm, const void *key, uint16_t keylen, const void *data, uint32_t datalen) {
+	if(!key && keylen) {
+		hhm_set_error(hhm, "key parameter to hardhat_maker_add_batch is NULL");
+		return false;
+	}
+	if(!data && datalen) {
+		hhm_set_error(hhm, "data parameter to hardhat_maker_add_batch is NULL");
+		return false;
+	}
+	if(datalen > INT32_MAX) {
+		hhm_set_error(hhm, "datalen parameter to hardhat_maker_add_batch is too large");
+		return false;
+	}
+	return true;
+}
+
+/* Add a number of entries at once. The entries are handled in groups: the
+	keys of a group are normalized and (if needed) hashed first, and the
+	hash table slots they will probe are prefetched, so that the lookups
+	don't have to wait for memory one by one. */
+export bool hardhat_maker_add_batch(hardhat_maker_t *hhm, const void *const *keys, const uint16_t *keylens, const void *const *data, const uint32_t *datalens, size_t num) {
+	struct hhm_batchkey batch[BATCH_ENTRIES], *b;
+	struct hashtable *ht;
+	size_t i, j, k, len;
+	bool hashed, valid = true;
+
+	if(!hhm || hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		return false;
+	}
+	if(!num)
+		return true;
+	if(!keys || !keylens || !data || !datalens) {
+		hhm_set_error(hhm, "array parameter to hardhat_maker_add_batch is NULL");
+		return false;
+	}
+
+	if(!hhm_start(hhm))
+		return false;
+
+	if(!hhm->batchbuf) {
+		hhm->batchbuf = malloc(BATCH_BUFSIZE);
+		if(!hhm->batchbuf) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	for(i = 0; valid && i < num; i = j) {
+		/* Hashes are only needed while checking for duplicates */
+		hashed = !hhm->sorted && !hhm->bulk;
+		ht = hhm->hashtable;
+
+		len = 0;
+		for(j = i; j < num && j - i < BATCH_ENTRIES && len + keylens[j] <= BATCH_BUFSIZE; j++) {
+			valid = hhm_batch_check(hhm, keys[j], keylens[j], data[j], datalens[j]);
+			if(!valid)
+				break;
+			b = batch + (j - i);
+			b->off = len;
+			b->keylen = (uint16_t)hardhat_normalize(hhm->batchbuf + len, keys[j], keylens[j]);
+			len += b->keylen;
+			if(hashed) {
+				b->hash = hhm_calchash(hhm, hhm->batchbuf + b->off, b->keylen);
+				prefetchhash(ht, b->hash);
+			}
+		}
+
+		/* Add the entries before any invalid one */
+		for(k = i; k < j; k++) {
+			b = batch + (k - i);
+			if(!hhm_add(hhm, hhm->batchbuf + b->off, b->keylen, hashed ? &b->hash : NULL, data[k], -1, 0, datalens[k]))
+				return false;
+		}
+	}
+
+	return valid;
+}
+
+/******************************************************************************
+
+	Producers let several threads add entries to the same maker at once.
+	Each producer normalizes and hashes its keys, checks them against the
+	duplicate table of their shard and lays out its entries in a buffer of
+	its own, just as they will end up in the files. A full buffer is written
+	to a range of the file that the producer reserves for it, so producers
+	only ever wait for each other on the lock of a shard. The maker learns
+	about the records when the producer is freed.
+
+******************************************************************************/
+
+#define PRODUCER_BUFSIZE ((size_t)1 << 20)
+
+/* Keys are spread over 1 << PRODUCER_SHARD_BITS duplicate tables */
+#define PRODUCER_SHARD_BITS (6)
+#define PRODUCER_SHARDS ((size_t)1 << PRODUCER_SHARD_BITS)
+
+/* Marks the value offset of a buffered key record that is not relative to
+	the buffer, because the value was too large and was written by itself */
+#define PRODUCER_ABSOLUTE ((uint64_t)1 << 63)
+
+struct hardhat_producer {
+	/* The maker that entries are added to */
+	hardhat_maker_t *hhm;
+	/* Normalized key of the entry that is being added */
+	uint8_t *key;
+	/* Entries as they go into the database: complete records (version 3)
+		or only the values (version 4+) */
+	uint8_t *buf;
+	/* Buffer usage */
+	size_t buflen;
+	/* Key records as they go into the scratch file (version 4+ only) */
+	uint8_t *keybuf;
+	/* Key buffer usage */
+	size_t keybuflen;
+	/* Offsets of the records added through this producer; from index
+		batch on, they are relative to the buffer they are in */
+	uint64_t *recs;
+	/* Hashes of the keys of those records */
+	uint32_t *hashes;
+	/* Size of container for records and the number of them in use */
+	size_t recsize, recnum;
+	/* The first record that is still buffered */
+	size_t batch;
+	/* Writing out entries failed; the maker has the details */
+	bool failed;
+};
+
+/* Ranges of the files are reserved in multiples of this, so that padding
+	works out the same as it would if the range started at offset 0 */
+static uint64_t hhm_reserve_unit(const hardhat_maker_t *hhm) {
+	uint8_t bits = hhm->superblock.blocksize;
+
+	if(hhm->superblock.alignment > bits)
+		bits = hhm->superblock.alignment;
+	if(bits < 3)
+		bits = 3;
+
+	return (uint64_t)1 << bits;
+}
+
+/* Reserve len bytes at the end of a file. Any number of producers can do
+	this at the same time. Returns the offset of the range. */
+static uint64_t hhm_reserve(const hardhat_maker_t *hhm, struct hhm_file *f, size_t len) {
+	uint64_t unit = hhm_reserve_unit(hhm);
+	return __atomic_fetch_add(&f->reserved, ((uint64_t)len + unit - 1) & ~(unit - 1), __ATOMIC_RELAXED);
+}
+
+/* Write out everything that is buffered for a file, so that producers can
+	write to it directly from the next unit on */
+static bool hhm_reserve_start(hardhat_maker_t *hhm, struct hhm_file *f) {
+	uint64_t unit = hhm_reserve_unit(hhm);
+
+	if(!hhm_db_flush(hhm, f))
+		return false;
+	if(f->aio && !hhm_aio_wait(hhm, f, 0, UINT64_MAX))
+		return false;
+
+	f->reserved = ((uint64_t)f->off + unit - 1) & ~(unit - 1);
+	return true;
+}
+
+/* Continue writing a file after the ranges that producers reserved */
+static bool hhm_reserve_stop(hardhat_maker_t *hhm, struct hhm_file *f) {
+	f->off = f->pos = (off_t)f->reserved;
+	/* Growing the window from now on must not cut the file short */
+	return !f->mapped || hhm_db_window(hhm, f, (size_t)f->off);
+}
+
+/* Release the duplicate tables of the producers */
+static void hhm_shards_free(hardhat_maker_t *hhm) {
+	struct hhm_shard *shard;
+	size_t s;
+
+	if(!hhm->shards)
+		return;
+
+	for(s = 0; s < PRODUCER_SHARDS; s++) {
+		shard = hhm->shards + s;
+		pthread_mutex_destroy(&shard->lock);
+		freehash(shard->hashtable);
+		free(shard->keys);
+	}
+
+	free(hhm->shards);
+	hhm->shards = NULL;
+}
+
+/* Add a key to the duplicate table of its shard, unless it is in there
+	already, in which case *found is set. Returns false if memory runs out. */
+static bool hhm_shard_add(hardhat_maker_t *hhm, const uint8_t *key, uint16_t keylen, uint32_t hash, bool *found) {
+	struct hhm_shard *shard = hhm->shards + (hash >> (32 - PRODUCER_SHARD_BITS));
+	struct hashprobe probe;
+	const struct hashentry *entry;
+	const uint8_t *old;
+	size_t reclen, keyssize;
+	void *buf;
+	bool ok = true;
+
+	reclen = (sizeof keylen + (size_t)keylen + 3) & ~(size_t)3;
+
+	pthread_mutex_lock(&shard->lock);
+
+	*found = false;
+	hashprobe_start(&probe, shard->hashtable, hash);
+	while((entry = hashprobe_next(&probe, hash))) {
+		if(entry->hash != hash)
+			continue;
+		old = shard->keys + ((size_t)entry->data << 2);
+		if(u16read(old) == keylen && !memcmp(old + sizeof keylen, key, keylen)) {
+			*found = true;
+			break;
+		}
+	}
+
+	if(!*found) {
+		keyssize = shard->keyssize;
+		while(shard->keyslen + reclen > keyssize)
+			keyssize = keyssize ? keyssize * 2 : 65536;
+		if(keyssize != shard->keyssize) {
+			buf = realloc(shard->keys, keyssize);
+			ok = buf && (uint64_t)keyssize <= (uint64_t)UINT32_MAX << 2;
+			if(buf) {
+				shard->keys = buf;
+				shard->keyssize = keyssize;
+			}
+		}
+		ok = ok && addhash(shard->hashtable, hash, (uint32_t)(shard->keyslen >> 2));
+		if(ok) {
+			memcpy(shard->keys + shard->keyslen, &keylen, sizeof keylen);
+			memcpy(shard->keys + shard->keyslen + sizeof keylen, key, keylen);
+			shard->keyslen += reclen;
+		}
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return ok;
+}
+
+/* Get ready for the first producer: from now on, entries are written to
+	reserved ranges of the files, and duplicates are detected with the
+	shards. Call with the lock held. */
+static bool hhm_producers_start(hardhat_maker_t *hhm) {
+	const uint8_t *rec;
+	uint16_t keylen;
+	uint32_t i;
+	size_t s;
+	bool found;
+
+	if(!hhm_start(hhm))
+		return false;
+
+	if(hhm->dedup || hhm->budget) {
+		hhm_set_error(hhm, "producers can't be used with %s",
+			hhm->dedup ? "deduplication of values" : "a memory budget");
+		errno = EINVAL;
+		return false;
+	}
+
+	if(!hhm_reserve_start(hhm, &hhm->db))
+		return false;
+	if(hhm->superblock.version >= 4 && !hhm_reserve_start(hhm, &hhm->keys))
+		return false;
+
+	/* Producers add entries in no particular order */
+	if(hhm->sorted) {
+		hhm->sorted = false;
+		if(!hhm->bulk && !hhm_hash_records(hhm))
+			return false;
+	}
+
+	/* Duplicates are removed at the end in bulk mode */
+	if(hhm->bulk)
+		return true;
+
+	hhm->shards = calloc(PRODUCER_SHARDS, sizeof *hhm->shards);
+	if(!hhm->shards) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	for(s = 0; s < PRODUCER_SHARDS; s++)
+		pthread_mutex_init(&hhm->shards[s].lock, NULL);
+
+	for(s = 0; s < PRODUCER_SHARDS; s++) {
+		hhm->shards[s].hashtable = newhash();
+		if(!hhm->shards[s].hashtable) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	/* Entries that were added before */
+	for(i = 0; i < hhm->recnum; i++) {
+		rec = hhm_key(hhm, i);
+		if(!rec)
+			return false;
+		keylen = u16read(rec + 4);
+		if(!hhm_shard_add(hhm, rec + 6, keylen, hhm_calchash(hhm, rec + 6, keylen), &found)) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Take over again after the last producer is done. Call with the lock held. */
+static bool hhm_producers_stop(hardhat_maker_t *hhm) {
+	hhm_shards_free(hhm);
+
+	if(!hhm_reserve_stop(hhm, &hhm->db))
+		return false;
+	if(hhm->superblock.version >= 4 && !hhm_reserve_stop(hhm, &hhm->keys))
+		return false;
+
+	return true;
+}
+
+/* Record that a producer ran out of memory */
+static bool hhp_enomem(hardhat_producer_t *hhp) {
+	pthread_mutex_lock(&hhp->hhm->lock);
+	hhm_set_enomem(hhp->hhm);
+	pthread_mutex_unlock(&hhp->hhm->lock);
+
+	hhp->failed = true;
+	errno = ENOMEM;
+	return false;
+}
+
+/* Write to a range of a file that the producer reserved */
+static bool hhp_writev(hardhat_producer_t *hhp, struct hhm_file *f, struct iovec *iov, int iovcnt, uint64_t off) {
+	hardhat_maker_t *hhm = hhp->hhm;
+	size_t len = 0;
+	ssize_t r;
+	int i;
+
+	for(i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	while(len) {
+		r = pwritev(f->fd, iov, iovcnt, (off_t)off);
+		if(r <= 0) {
+			if(!r)
+				errno = EAGAIN;
+			pthread_mutex_lock(&hhm->lock);
+			hhm_set_error(hhm, "writing %zu bytes to %s failed: %m", len, f->name);
+			hhm->failed = true;
+			pthread_mutex_unlock(&hhm->lock);
+			hhp->failed = true;
+			return false;
+		}
+		len -= r;
+		off += r;
+		for(; (size_t)r >= iov->iov_len && iovcnt > 1; iov++, iovcnt--)
+			r -= iov->iov_len;
+		iov->iov_base = (uint8_t *)iov->iov_base + r;
+		iov->iov_len -= r;
+	}
+
+	return true;
+}
+
+/* Remember the offset of a record and the hash of its key */
+static bool hhp_record(hardhat_producer_t *hhp, uint64_t off, uint32_t hash) {
+	size_t recsize;
+	void *buf;
+
+	if(hhp->recnum == hhp->recsize) {
+		recsize = hhp->recsize ? hhp->recsize * 2 : 65536;
+		buf = realloc(hhp->recs, recsize * sizeof *hhp->recs);
+		if(!buf)
+			return hhp_enomem(hhp);
+		hhp->recs = buf;
+		buf = realloc(hhp->hashes, recsize * sizeof *hhp->hashes);
+		if(!buf)
+			return hhp_enomem(hhp);
+		hhp->hashes = buf;
+		hhp->recsize = recsize;
+	}
+
+	hhp->recs[hhp->recnum] = off;
+	hhp->hashes[hhp->recnum++] = hash;
+
+	return true;
+}
+
+/* Write the buffered entries to ranges of the files reserved for them, now
+	that their final offsets are known */
+static bool hhp_flush(hardhat_producer_t *hhp) {
+	hardhat_maker_t *hhm = hhp->hhm;
+	struct iovec iov;
+	uint64_t dbbase = 0, keysbase = 0, valueoff;
+	uint8_t *rec;
+	size_t i;
+
+	if(hhp->buflen) {
+		dbbase = hhm_reserve(hhm, &hhm->db, hhp->buflen);
+		iov.iov_base = hhp->buf;
+		iov.iov_len = hhp->buflen;
+		if(!hhp_writev(hhp, &hhm->db, &iov, 1, dbbase))
+			return false;
+	}
+
+	if(hhm->superblock.version >= 4) {
+		if(hhp->keybuflen)
+			keysbase = hhm_reserve(hhm, &hhm->keys, hhp->keybuflen);
+		for(i = hhp->batch; i < hhp->recnum; i++) {
+			rec = hhp->keybuf + hhp->recs[i] - sizeof valueoff;
+			valueoff = u64read(rec);
+			if(valueoff & PRODUCER_ABSOLUTE)
+				valueoff &= ~PRODUCER_ABSOLUTE;
+			else
+				valueoff += dbbase;
+			memcpy(rec, &valueoff, sizeof valueoff);
+			hhp->recs[i] += keysbase;
+		}
+		if(hhp->keybuflen) {
+			iov.iov_base = hhp->keybuf;
+			iov.iov_len = hhp->keybuflen;
+			if(!hhp_writev(hhp, &hhm->keys, &iov, 1, keysbase))
+				return false;
+		}
+	} else {
+		for(i = hhp->batch; i < hhp->recnum; i++)
+			hhp->recs[i] += dbbase;
+	}
+
+	hhp->buflen = 0;
+	hhp->keybuflen = 0;
+	hhp->batch = hhp->recnum;
+
+	return true;
+}
+
+/* Where the record and the value of an entry go if it is put in the buffer
+	at offset start (for version 4+, only the value goes in the buffer).
+	Returns the offset just past the entry. */
+static size_t hhp_layout(hardhat_maker_t *hhm, size_t start, uint16_t keylen, uint32_t datalen, size_t *recoff, size_t *valueoff) {
+	if(hhm->superblock.version >= 4) {
+		*recoff = start;
+		*valueoff = start;
+		if(datalen)
+			*valueoff += hhm_padding(hhm, start, datalen, hhm_value_alignment(hhm, -1, 0, datalen));
+	} else {
+		/* Same as hhm_write_record() */
+		*recoff = start + hhm_padding(hhm, start, (size_t)6 + (size_t)datalen, 4);
+		*valueoff = *recoff + 6 + keylen;
+		*valueoff += hhm_padding(hhm, *valueoff, datalen, (size_t)1 << hhm->superblock.alignment);
+	}
+
+	return *valueoff + datalen;
+}
+
+/* Put an entry with the normalized key in hhp->key in the buffers. Entries
+	that don't fit in a buffer by themselves are written out directly. */
+static bool hhp_buffer(hardhat_producer_t *hhp, uint16_t keylen, uint32_t hash, const void *data, uint32_t datalen) {
+	hardhat_maker_t *hhm = hhp->hhm;
+	bool keyfile = hhm->superblock.version >= 4;
+	size_t recoff, valueoff, end, keyrec = 0, keyend = 0;
+	uint64_t base, off;
+	uint8_t header[6];
+	struct iovec iov[2];
+
+	end = hhp_layout(hhm, hhp->buflen, keylen, datalen, &recoff, &valueoff);
+	if(keyfile) {
+		keyrec = hhp->keybuflen + hhm_padding(hhm, hhp->keybuflen, 0, sizeof off) + sizeof off;
+		keyend = keyrec + sizeof header + keylen;
+	}
+
+	if(end > PRODUCER_BUFSIZE || keyend > PRODUCER_BUFSIZE) {
+		if(!hhp_flush(hhp))
+			return false;
+		end = hhp_layout(hhm, 0, keylen, datalen, &recoff, &valueoff);
+		if(keyfile) {
+			keyrec = sizeof off;
+			keyend = keyrec + sizeof header + keylen;
+		}
+	}
+
+	memcpy(header, &datalen, sizeof datalen);
+	memcpy(header + 4, &keylen, sizeof keylen);
+
+	if(end > PRODUCER_BUFSIZE) {
+		/* Too large to buffer, but the buffers are empty now */
+		base = hhm_reserve(hhm, &hhm->db, end);
+		if(!keyfile) {
+			iov[0].iov_base = header;
+			iov[0].iov_len = sizeof header;
+			iov[1].iov_base = hhp->key;
+			iov[1].iov_len = keylen;
+			if(!hhp_writev(hhp, &hhm->db, iov, 2, base + recoff))
+				return false;
+		}
+		iov[0].iov_base = (void *)data;
+		iov[0].iov_len = datalen;
+		if(!hhp_writev(hhp, &hhm->db, iov, 1, base + valueoff))
+			return false;
+		if(!keyfile) {
+			if(!hhp_record(hhp, base + recoff, hash))
+				return false;
+			hhp->batch = hhp->recnum;
+			return true;
+		}
+		off = (base + valueoff) | PRODUCER_ABSOLUTE;
+	} else {
+		memset(hhp->buf + hhp->buflen, 0, recoff - hhp->buflen);
+		if(!keyfile) {
+			memcpy(hhp->buf + recoff, header, sizeof header);
+			memcpy(hhp->buf + recoff + sizeof header, hhp->key, keylen);
+		}
+		memset(hhp->buf + recoff + (keyfile ? 0 : sizeof header + keylen), 0,
+			valueoff - recoff - (keyfile ? 0 : sizeof header + keylen));
+		if(datalen)
+			memcpy(hhp->buf + valueoff, data, datalen);
+		hhp->buflen = end;
+		if(!keyfile)
+			return hhp_record(hhp, recoff, hash);
+		off = valueoff;
+	}
+
+	memset(hhp->keybuf + hhp->keybuflen, 0, keyrec - sizeof off - hhp->keybuflen);
+	memcpy(hhp->keybuf + keyrec - sizeof off, &off, sizeof off);
+	memcpy(hhp->keybuf + keyrec, header, sizeof header);
+	memcpy(hhp->keybuf + keyrec + sizeof header, hhp->key, keylen);
+	hhp->keybuflen = keyend;
+
+	return hhp_record(hhp, keyrec, hash);
+}
+
+export hardhat_producer_t *hardhat_producer_new(hardhat_maker_t *hhm) {
+	hardhat_producer_t *hhp;
+	bool ok;
+
+	if(!hhm) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	hhp = calloc(1, sizeof *hhp);
+	if(!hhp)
+		return NULL;
+
+	pthread_mutex_lock(&hhm->lock);
+	if(hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		ok = false;
+	} else {
+		ok = hhm->producers || hhm_producers_start(hhm);
+	}
+	if(ok)
+		hhm->producers++;
+	pthread_mutex_unlock(&hhm->lock);
+
+	if(!ok) {
+		free(hhp);
+		return NULL;
+	}
+
+	hhp->hhm = hhm;
+	hhp->key = malloc(65536);
+	hhp->buf = malloc(PRODUCER_BUFSIZE);
+	if(hhm->superblock.version >= 4)
+		hhp->keybuf = malloc(PRODUCER_BUFSIZE);
+
+	if(!hhp->key || !hhp->buf || (hhm->superblock.version >= 4 && !hhp->keybuf)) {
+		hardhat_producer_free(hhp);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return hhp;
+}
+
+export bool hardhat_producer_flush(hardhat_producer_t *hhp) {
+	if(!hhp || hhp->failed) {
+		errno = EINVAL;
+		return false;
+	}
+
+	return hhp_flush(hhp);
+}
+
+export bool hardhat_producer_add(hardhat_producer_t *hhp, const void *key, uint16_t keylen, const void *data, uint32_t datalen) {
+	hardhat_maker_t *hhm;
+	uint32_t hash;
+	bool found;
+
+	if(!hhp || hhp->failed) {
+		errno = EINVAL;
+		return false;
+	}
+
+	hhm = hhp->hhm;
+
+	if((!key && keylen) || (!data && datalen) || datalen > INT32_MAX) {
+		pthread_mutex_lock(&hhm->lock);
+		hhm_set_error(hhm, "invalid entry passed to hardhat_producer_add");
+		pthread_mutex_unlock(&hhm->lock);
+		errno = EINVAL;
+		return false;
+	}
+
+	keylen = (uint16_t)hardhat_normalize(hhp->key, key, keylen);
+	hash = hhm_calchash(hhm, hhp->key, keylen);
+
+	if(hhm->shards) {
+		if(!hhm_shard_add(hhm, hhp->key, keylen, hash, &found))
+			return hhp_enomem(hhp);
+		if(found)
+			return true;
+	}
+
+	return hhp_buffer(hhp, keylen, hash, data, datalen);
+}
+
+export void hardhat_producer_free(hardhat_producer_t *hhp) {
+	hardhat_maker_t *hhm;
+	size_t i;
+
+	if(!hhp)
+		return;
+
+	hhm = hhp->hhm;
+
+	if(!hhp->failed)
+		hhp_flush(hhp);
+
+	pthread_mutex_lock(&hhm->lock);
+
+	/* Hand the records over to the maker */
+	for(i = 0; i < hhp->batch && !hhm->failed; i++) {
+		if(!hhm->bulk && !addhash(hhm->hashtable, hhp->hashes[i], hhm->recnum)) {
+			hhm_set_enomem(hhm);
+			break;
+		}
+		if(!hhm_record(hhm, hhp->recs[i]))
+			break;
+	}
+
+	if(!--hhm->producers)
+		hhm_producers_stop(hhm);
+
+	pthread_mutex_unlock(&hhm->lock);
+
+	free(hhp->key);
+	free(hhp->buf);
+	free(hhp->keybuf);
+	free(hhp->recs);
+	free(hhp->hashes);
+	free(hhp);
+}
+
+/* Move a merge input to its next entry, dropping it when it runs out */
+static void hhm_merge_next(hardhat_cursor_t **cursor) {
+	if(!hardhat_fetch(*cursor, true)) {
+		hardhat_cursor_free(*cursor);
+		*cursor = NULL;
+	}
+}
+
+/* Add the entries of existing databases. The inputs are merged in
+	directory order, so keys need no normalization, and unless the maker
+	already had entries, nothing needs to be hashed or sorted either. */
+export bool hardhat_maker_merge(hardhat_maker_t *hhm, hardhat_t *const *inputs, size_t num) {
+	hardhat_cursor_t **cursors, *c, *best;
+	size_t u, b;
+	bool ok = true;
+
+	if(!hhm || hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		return false;
+	}
+	if(!inputs && num) {
+		hhm_set_error(hhm, "inputs parameter to hardhat_maker_merge is NULL");
+		return false;
+	}
+
+	if(!hhm->atomic) {
+		/* Writing the database in place would destroy such an input */
+		if(!hhm_db_create(hhm))
+			return false;
+		for(u = 0; u < num; u++) {
+			if(hhm_maps_file(hhm->db.fd, inputs[u])) {
+				hhm_set_error(hhm, "%s can only be merged into itself in atomic mode", hhm->filename);
+				hhm->failed = true;
+				return false;
+			}
+		}
+	}
+
+	if(!hhm_start(hhm))
+		return false;
+
+	cursors = calloc(num ? num : 1, sizeof *cursors);
+	if(!cursors) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	for(u = 0; u < num; u++) {
+		cursors[u] = hardhat_cursor(inputs[u], "", 0);
+		if(!cursors[u]) {
+			hhm_set_error(hhm, "can't read input %zu: %m", u);
+			ok = false;
+			break;
+		}
+		if(!cursors[u]->key)
+			hhm_merge_next(cursors + u);
+	}
+
+	while(ok) {
+		/* Find the smallest key; on ties, the earliest input wins */
+		best = NULL;
+		b = 0;
+		for(u = 0; u < num; u++) {
+			c = cursors[u];
+			if(c && (!best || hardhat_cmp(c->key, c->keylen, best->key, best->keylen) < 0)) {
+				best = c;
+				b = u;
+			}
+		}
+		if(!best)
+			break;
+
+		ok = hhm_add(hhm, best->key, best->keylen, NULL, best->data, -1, 0, best->datalen);
+
+		/* Skip the same key in the other inputs */
+		for(u = b + 1; u < num; u++) {
+			c = cursors[u];
+			if(c && c->keylen == best->keylen && !memcmp(c->key, best->key, best->keylen))
+				hhm_merge_next(cursors + u);
+		}
+		hhm_merge_next(cursors + b);
+	}
+
+	for(u = 0; u < num; u++)
+		hardhat_cursor_free(cursors[u]);
+	free(cursors);
+
+	return ok;
+}
+
+export bool hardhat_maker_delete(hardhat_maker_t *hhm, const void *key, uint16_t keylen) {
+	uint8_t *buf;
+	size_t size;
+
+	if(!hhm || hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		return false;
+	}
+	if(!key && keylen) {
+		hhm_set_error(hhm, "key parameter to hardhat_maker_delete is NULL");
+		return false;
+	}
+	if(!hhm->base) {
+		hhm_set_error(hhm, "can't delete entries without a base database");
+		return false;
+	}
+
+	if(hhm->deletedsize - hhm->deletedlen < sizeof keylen + keylen) {
+		size = hhm->deletedsize ? hhm->deletedsize : 4096;
+		while(size - hhm->deletedlen < sizeof keylen + keylen)
+			size *= 2;
+		buf = realloc(hhm->deleted, size);
+		if(!buf) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+		hhm->deleted = buf;
+		hhm->deletedsize = size;
+	}
+
+	buf = hhm->deleted + hhm->deletedlen;
+	keylen = (uint16_t)hardhat_normalize(buf + sizeof keylen, key, keylen);
+	memcpy(buf, &keylen, sizeof keylen);
+	hhm->deletedlen += sizeof keylen + keylen;
+	hhm->deletednum++;
+
+	return true;
+}
+
+/* Check if the base database (if any) has an entry */
+static bool hhm_base_has(hardhat_maker_t *hhm, const uint8_t *key, uint16_t keylen) {
+	return hhm->base && hardhat_has(hhm->base, key, keylen, hhm->basekeybuf);
+}
+
+/* Add parent directory entries for all entries that do not have them yet */
+export bool hardhat_maker_parents(hardhat_maker_t *hhm, const void *data, uint32_t datalen) {
+	uint32_t i, num;
+	const uint8_t *rec, *slash, *key;
+	uint8_t *prev = NULL;
+	uint16_t keylen, prevlen = 0;
+	bool sorted, found, ok = true;
+
+	if(!hhm || hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		return false;
+	}
+
+	/* Not all records are at hand; hardhat_maker_autoparents() works */
+	if(hhm->budget) {
+		hhm_set_error(hhm, "hardhat_maker_parents() can't be used with a memory budget");
+		return false;
+	}
+
+	num = hhm->recnum;
+	if(!num)
+		return true;
+
+	/* If the records are in directory order, parents can be looked up
+		directly (adding missing ones will spoil that for later records) */
+	sorted = hhm->sorted;
+
+	if(hhm->bulk || sorted) {
+		prev = malloc(65536);
+		if(!prev) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	/* In bulk mode, keep a temporary hash table of just the parents */
+	if(hhm->bulk) {
+		hhm->hashtable = newhash();
+		if(!hhm->hashtable) {
+			free(prev);
+			hhm_set_enomem(hhm);
+			return false;
+		}
+	}
+
+	for(i = 0; ok && i < hhm->recnum; i++) {
+		rec = hhm_key(hhm, i);
+		if(!rec) {
+			ok = false;
+			break;
+		}
+		key = rec + 6;
+		slash = memrchr(key, '/', u16read(rec + 4));
+		if(!slash)
+			continue;
+		keylen = (uint16_t)(slash - key);
+		if(prev) {
+			if(keylen == prevlen && !memcmp(prev, key, keylen))
+				continue;
+			/* Work on a copy: looking up other keys may move this one */
+			memcpy(prev, key, keylen);
+			prevlen = keylen;
+			key = prev;
+			if(sorted) {
+				if(!hhm_search(hhm, key, keylen, i < num ? i : num, &found)) {
+					ok = false;
+					break;
+				}
+				if(found)
+					continue;
+			}
+		}
+		/* Don't replace directories of the base database */
+		if(hhm_base_has(hhm, key, keylen))
+			continue;
+		if(hhm->bulk && !hhm_check_duplicate(hhm, key, keylen, hhm_calchash(hhm, key, keylen))) {
+			ok = !hhm->failed;
+			continue;
+		}
+		/* Stupidly try to add them, duplicates will be detected
+			and handled by hardhat_maker_add() */
+		ok = hardhat_maker_add(hhm, key, keylen, data, datalen);
+	}
+
+	free(prev);
+
+	if(hhm->bulk) {
+		freehash(hhm->hashtable);
+		hhm->hashtable = NULL;
+	}
+
+	return ok;
+}
+
+export bool hardhat_maker_autoparents(hardhat_maker_t *hhm, const void *data, uint32_t datalen) {
+	uint8_t *copy;
+
+	if(!hhm || hhm->failed || hhm->finished) {
+		errno = EINVAL;
+		return false;
+	}
+	if(!data && datalen) {
+		hhm_set_error(hhm, "data parameter to hardhat_maker_autoparents is NULL");
+		return false;
+	}
+	if(datalen > INT32_MAX) {
+		hhm_set_error(hhm, "datalen parameter to hardhat_maker_autoparents is too large");
+		return false;
+	}
+
+	copy = malloc(datalen ? datalen : 1);
+	if(!copy) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+	if(datalen)
+		memcpy(copy, data, datalen);
+
+	free(hhm->parentdata);
+	hhm->parentdata = copy;
+	hhm->parentdatalen = datalen;
+	hhm->autoparents = true;
+
+	return true;
+}
+
+/* Compare two entries from the hashtable by fetching their key values
+	and comparing them using hardhat_cmp().
+	Empty hash values always come last. */
+static int qsort_directory_cmp(const void *a, const void *b, void *hhm) {
+	const uint8_t *ar, *br;
+	uint32_t ad, bd;
+	int r;
+
+	if(((hardhat_maker_t *)hhm)->failed)
+		return 0;
+
+	ad = ((const struct hashentry *)a)->data;
+	bd = ((const struct hashentry *)b)->data;
+
+	if(ad == EMPTYHASH)
+		return bd == EMPTYHASH ? 0 : 1;
+	else if(bd == EMPTYHASH)
+		return -1;
+
+	ar = hhm_key(hhm, ad);
+	if(!ar)
+		return 0;
+
+	br = hhm_key(hhm, bd);
+	if(!br)
+		return 0;
+
+	/* get the first record again: the memory mapping may have moved */
+	ar = hhm_key(hhm, ad);
+	if(!ar)
+		return 0;
+
+	/* Duplicates (only in bulk mode) are kept in the order they were added */
+	r = hardhat_cmp(ar + 6, u16read(ar + 4), br + 6, u16read(br + 4));
+	return r ? r : ad < bd ? -1 : ad > bd;
+}
+
+/* Fetch the key record of the entry with the given index in the sorted
+	directory */
+static const uint8_t *hhm_dir_key(hardhat_maker_t *hhm, uint64_t i) {
+	const uint8_t *p;
+	uint64_t off;
+
+	if(!hhm->runs.num)
+		return hhm_getrec(hhm, hhm->recbuf[i]);
+
+	/* Sorted in runs: the directory is in the spill file */
+	p = hhm_db_getrec(hhm, &hhm->spill, hhm->spilldir + i * sizeof off, sizeof off);
+	if(!p)
+		return NULL;
+	memcpy(&off, p, sizeof off);
+
+	return hhm_getrec(hhm, off);
+}
+
+/* Compare the keys of two entries with the same hash value */
+static int hhm_hash_keycmp(hardhat_maker_t *hhm, uint64_t ad, uint64_t bd) {
+	const uint8_t *ar, *br;
+	uint16_t al, bl;
+	int r;
+
+	if(hhm->failed)
+		return 0;
+
+	ar = hhm_dir_key(hhm, ad);
+	if(!ar)
+		return 0;
+
+	br = hhm_dir_key(hhm, bd);
+	if(!br)
+		return 0;
+
+	/* get the first record again: the memory mapping may have moved */
+	ar = hhm_dir_key(hhm, ad);
+	if(!ar)
+		return 0;
+
+	al = u16read(ar + 4);
+	bl = u16read(br + 4);
+
+	if(al < bl) {
+		r = memcmp(ar + 6, br + 6, al);
+		return r ? r : -1;
+	} else {
+		r = memcmp(ar + 6, br + 6, bl);
+		return r ? r : al != bl;
+	}
+}
+
+/* Compare hash entries by hash value, with string comparison as a tie breaker. */
+static int qsort_hash_cmp(const void *a, const void *b, void *hhm) {
+	uint32_t ad, bd;
+
+	ad = ((const struct hashentry *)a)->hash;
+	bd = ((const struct hashentry *)b)->hash;
+
+	if(ad == bd) {
+		ad = ((const struct hashentry *)a)->data;
+		bd = ((const struct hashentry *)b)->data;
+
+		if(ad == EMPTYHASH)
+			return bd != EMPTYHASH;
+		else if(bd == EMPTYHASH)
+			return -1;
+
+		return hhm_hash_keycmp(hhm, ad, bd);
+	}
+
+	return ad < bd ? -1 : 1;
+}
+
+/* Like qsort_hash_cmp(), for the hash entries of version 6 databases */
+static int qsort_widehash_cmp(const void *a, const void *b, void *hhm) {
+	uint32_t ah, bh;
+
+	ah = ((const struct widehashentry *)a)->hash;
+	bh = ((const struct widehashentry *)b)->hash;
+
+	if(ah == bh)
+		return hhm_hash_keycmp(hhm, ((const struct widehashentry *)a)->data, ((const struct widehashentry *)b)->data);
+
+	return ah < bh ? -1 : 1;
+}
+
+/******************************************************************************
+
+	Sorting the directory. Instead of calling hardhat_cmp() for every
+	comparison, each entry carries a chunk of its key that can be compared
+	as an integer. The key is transformed so that comparing the transformed
+	keys bytewise gives the same order as hardhat_cmp(): the directory
+	part of the key (up to and including the last slash) comes first, with
+	slashes sorting higher than any other byte, then a terminator that
+	sorts lower than any byte, then the rest of the key. Each chunk holds
+	seven of those symbols of 9 bits each; a symbol of 0 marks the end.
+
+	Entries are sorted on their chunks. Groups of entries with the same
+	chunk then get the next chunk of their keys and are sorted again, and
+	so on. Small groups are sorted using hardhat_cmp() directly.
+
+******************************************************************************/
+
+#ifndef HAVE_QSORT_R
+extern void qsort_r(void *, size_t, size_t, int (*)(const void *, const void *, void *), void *);
+#endif
+
+#define HHM_CHUNK_SYMBOLS 7
+#define HHM_CHUNK_SMALL 16
+
+struct hhm_sortkey {
+	uint64_t chunk;
+	struct hashentry he;
+	/* Length of the directory part of the key, including the last slash */
+	uint16_t dirlen;
+};
+
+/* Get the chunk of the transformed key at the given depth (in symbols) */
+static uint64_t hhm_chunk(const uint8_t *key, size_t keylen, size_t dirlen, size_t depth) {
+	size_t j;
+	uint64_t chunk = 0;
+	unsigned int i, sym;
+
+	for(i = 0, j = depth; i < HHM_CHUNK_SYMBOLS; i++, j++) {
+		if(j < dirlen)
+			sym = key[j] == '/' ? 258 : key[j] + 2U;
+		else if(j == dirlen)
+			sym = 1;
+		else if(j <= keylen)
+			sym = key[j - 1] + 2U;
+		else
+			sym = 0;
+		chunk = chunk << 9 | sym;
+	}
+
+	return chunk;
+}
+
+static int qsort_chunk_cmp(const void *a, const void *b, void *hhm) {
+	uint64_t ac, bc;
+
+	(void)hhm;
+
+	ac = ((const struct hhm_sortkey *)a)->chunk;
+	bc = ((const struct hhm_sortkey *)b)->chunk;
+
+	return ac < bc ? -1 : ac > bc;
+}
+
+/* Compare on chunks, then using hardhat_cmp() on the full keys */
+static int qsort_sortkey_cmp(const void *a, const void *b, void *hhm) {
+	int r;
+
+	r = qsort_chunk_cmp(a, b, hhm);
+	if(r)
+		return r;
+
+	return qsort_directory_cmp(&((const struct hhm_sortkey *)a)->he, &((const struct hhm_sortkey *)b)->he, hhm);
+}
+
+/* Sort entries that are known to be equal up to depth */
+static void hhm_sort_chunks(hardhat_maker_t *hhm, struct hhm_sortkey *keys, size_t num, size_t depth, unsigned int threads) {
+	const uint8_t *rec, *slash;
+	uint16_t keylen;
+	size_t i, j;
+
+	for(;;) {
+		for(i = 0; i < num; i++) {
+			rec = hhm_key(hhm, keys[i].he.data);
+			if(!rec)
+				return;
+			keylen = u16read(rec + 4);
+			/* The directory part is found once, when sorting starts */
+			if(!depth) {
+				slash = memrchr(rec + 6, '/', keylen);
+				keys[i].dirlen = slash ? (uint16_t)(slash - (rec + 6) + 1) : 0;
+			}
+			keys[i].chunk = hhm_chunk(rec + 6, keylen, keys[i].dirlen, depth);
+		}
+
+		psort_r(keys, num, sizeof *keys, qsort_chunk_cmp, hhm, threads);
+		depth += HHM_CHUNK_SYMBOLS;
+
+		/* Keys that ended in this chunk and are still equal are
+			duplicates (only in bulk mode), ordered by qsort_sortkey_cmp */
+		if(keys[0].chunk == keys[num - 1].chunk) {
+			if(!(keys[0].chunk & 511)) {
+				qsort_r(keys, num, sizeof *keys, qsort_sortkey_cmp, hhm);
+				return;
+			}
+			continue;
+		}
+
+		for(i = 0; i < num; i = j) {
+			for(j = i + 1; j < num && keys[j].chunk == keys[i].chunk; j++);
+			if(j - i <= 1)
+				continue;
+			if(j - i <= HHM_CHUNK_SMALL || !(keys[i].chunk & 511))
+				qsort_r(keys + i, j - i, sizeof *keys, qsort_sortkey_cmp, hhm);
+			else
+				hhm_sort_chunks(hhm, keys + i, j - i, depth, 1);
+		}
+
+		return;
+	}
+}
+
+/* Sort the hash table in directory order. Empty entries go last. */
+static bool hhm_sort_directory(hardhat_maker_t *hhm, struct hashentry *entries, uint32_t size, uint32_t num) {
+	struct hhm_sortkey *keys;
+	uint32_t i, n;
+
+	keys = malloc((size_t)num * sizeof *keys);
+	if(!keys) {
+		psort_r(entries, size, sizeof *entries, qsort_directory_cmp, hhm, hhm->threads);
+		return !hhm->failed;
+	}
+
+	for(i = n = 0; i < size; i++)
+		if(entries[i].data != EMPTYHASH)
+			keys[n++].he = entries[i];
+
+	if(num)
+		hhm_sort_chunks(hhm, keys, num, 0, hhm->threads);
+
+	for(i = 0; i < num; i++)
+		entries[i] = keys[i].he;
+	memset(entries + num, 255, (size_t)(size - num) * sizeof *entries);
+
+	free(keys);
+
+	return !hhm->failed;
+}
+
+/* Find the longest common prefix (on ‘/’ boundaries) */
+__attribute__((optimize(3)))
+static size_t common_parents(const uint8_t *a, size_t al, const uint8_t *b, size_t bl) {
+	size_t cl = 0, l, i;
+	uint8_t ac, bc;
+
+	l = al < bl ? al : bl;
+
+	for(i = 0; i < l; i++) {
+		ac = a[i];
+		bc = b[i];
+		if(ac != bc)
+			break;
+		if(ac == '/')
+			cl = i + 1;
+	}
+
+	return cl;
+}
+
+/* Encode a varint (LEB128), returning a pointer past its end */
+static uint8_t *hhm_varint(uint8_t *p, uint64_t v) {
+	while(v >= UINT64_C(0x80)) {
+		*p++ = (uint8_t)(v | UINT64_C(0x80));
+		v >>= 7;
+	}
+	*p++ = (uint8_t)v;
+	return p;
+}
+
+/* Write out the front-coded keys and the directory of a version 4
+	database, given the offsets of the key records in the scratch file
+	in directory order. The scratch file must be mapped as a whole. */
+static bool hhm_write_keyblocks(hardhat_maker_t *hhm, const uint64_t *dir, uint64_t num) {
+	struct hhm_file *db, *keys;
+	uint64_t *blocks, i, b, nblocks;
+	uint32_t keyblock;
+	uint8_t *blockbuf, *p;
+	size_t blockbufsize, blocklen, shared;
+	const uint8_t *rec, *prev;
+	uint16_t keylen, prevlen;
+
+	db = &hhm->db;
+	keys = &hhm->keys;
+	keyblock = hhm->newsuperblock.keyblock;
+
+	nblocks = num ? ((num - 1) >> keyblock) + 1 : 0;
+	blocks = malloc((nblocks + 1) * sizeof *blocks);
+	blockbufsize = 65536;
+	blockbuf = malloc(blockbufsize);
+	if(!blocks || !blockbuf) {
+		free(blocks);
+		free(blockbuf);
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	hhm->newsuperblock.keys_start = db->off;
+
+	for(b = 0; b < nblocks; b++) {
+		/* Encode the block in memory first, so its length is known */
+		blocklen = 0;
+		prev = NULL;
+		prevlen = 0;
+		for(i = b << keyblock; i < num && i >> keyblock == b; i++) {
+			rec = keys->window + dir[i];
+			keylen = u16read(rec + 4);
+			if(keylen > hhm->newsuperblock.maxkeylen)
+				hhm->newsuperblock.maxkeylen = keylen;
+
+			for(shared = 0; shared < prevlen && shared < keylen; shared++)
+				if(prev[shared] != rec[6 + shared])
+					break;
+
+			if(blocklen + 15 + keylen - shared > blockbufsize) {
+				blockbufsize = (blocklen + 15 + keylen - shared) * 2;
+				p = realloc(blockbuf, blockbufsize);
+				if(!p) {
+					free(blocks);
+					free(blockbuf);
+					hhm_set_enomem(hhm);
+					return false;
+				}
+				blockbuf = p;
+			}
+
+			p = blockbuf + blocklen;
+			p = hhm_varint(p, shared);
+			p = hhm_varint(p, keylen - shared);
+			p = hhm_varint(p, u32read(rec));
+			memcpy(p, rec + 6 + shared, keylen - shared);
+			blocklen = (size_t)(p - blockbuf) + keylen - shared;
+
+			prev = rec + 6;
+			prevlen = keylen;
+		}
+
+		if(!hhm_db_pad(hhm, db, blocklen, 1)) {
+			free(blocks);
+			free(blockbuf);
+			return false;
+		}
+
+		blocks[b] = db->off;
+
+		if(!hhm_db_append(hhm, db, blockbuf, blocklen)) {
+			free(blocks);
+			free(blockbuf);
+			return false;
+		}
+	}
+
+	free(blockbuf);
+
+	/* The block index comes last */
+	if(!hhm_db_pad(hhm, db, nblocks * sizeof *blocks, sizeof *blocks)
+			|| !hhm_db_append(hhm, db, blocks, nblocks * sizeof *blocks)) {
+		free(blocks);
+		return false;
+	}
+
+	free(blocks);
+
+	hhm->newsuperblock.keys_end = db->off;
+
+	if(!hhm_db_pad(hhm, db, num * sizeof *dir, sizeof *dir))
+		return false;
+
+	hhm->superblock.directory_start = db->off;
+
+	/* Write out the directory: the offsets of the values, which are
+		stored in front of the key records */
+	for(i = 0; i < num; i++)
+		if(!hhm_db_append(hhm, db, keys->window + dir[i] - sizeof *dir, sizeof *dir))
+			return false;
+
+	hhm->superblock.directory_end = db->off;
+
+	return true;
+}
+
+/* Write out the front-coded keys and the directory of a version 4
+	database. The entries must be sorted in directory order. Afterwards,
+	their data fields and the recbuf refer to directory indexes. */
+static bool hhm_write_keys(hardhat_maker_t *hhm, struct hashentry *entries, uint32_t num) {
+	struct hhm_file *keys;
+	uint64_t *dir, start;
+	uint32_t i;
+
+	keys = &hhm->keys;
+	dir = hhm->recbuf;
+
+	/* Put the offsets of the key records in directory order, using the
+		scratch file as temporary storage */
+	if(!hhm_db_pad(hhm, keys, 0, sizeof *dir))
+		return false;
+
+	start = keys->off;
+
+	for(i = 0; i < num; i++) {
+		if(!hhm_db_append(hhm, keys, dir + entries[i].data, sizeof *dir))
+			return false;
+		entries[i].data = i;
+	}
+
+	/* An empty scratch file can't be mapped */
+	if(num) {
+		if(!hhm_db_map(hhm, keys))
+			return false;
+
+		memcpy(dir, keys->window + start, sizeof *dir * num);
+	}
+
+	return hhm_write_keyblocks(hhm, dir, num);
+}
+
+/* In bulk mode or for sorted input no hash table is kept while adding
+	entries, so create one for hardhat_maker_finish() to work with, holding
+	all entries in the order they were added */
+static bool hhm_list_entries(hardhat_maker_t *hhm) {
+	struct hashtable *ht;
+	struct hashentry *entries;
+	uint32_t i, num;
+
+	num = hhm->recnum;
+	ht = malloc(sizeof *ht);
+	entries = malloc((num ? num : 1) * sizeof *entries);
+	if(!ht || !entries) {
+		free(ht);
+		free(entries);
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	memset(entries, 255, sizeof *entries);
+	for(i = 0; i < num; i++) {
+		entries[i].hash = 0;
+		entries[i].data = i;
+	}
+
+	memset(ht, 0, sizeof *ht);
+	ht->entries = entries;
+	ht->fill = num;
+	ht->order = 0;
+	freehash(hhm->hashtable);
+	hhm->hashtable = ht;
+
+	return true;
+}
+
+/* Remove duplicates from the entries (in directory order) keeping the ones
+	that were added first, and fill in the hashes. Returns the number of
+	entries that are left. The space taken up by the duplicates in the
+	database file is not reclaimed. */
+static uint32_t hhm_unique_entries(hardhat_maker_t *hhm, struct hashentry *entries, uint32_t num) {
+	const uint8_t *rec, *key, *prev = NULL;
+	uint32_t i, n;
+	uint16_t keylen, prevlen = 0;
+
+	for(i = n = 0; i < num; i++) {
+		rec = hhm_key(hhm, entries[i].data);
+		if(!rec)
+			return 0;
+		key = rec + 6;
+		keylen = u16read(rec + 4);
+		if(prev && keylen == prevlen && !memcmp(prev, key, keylen))
+			continue;
+		entries[n].hash = hhm_calchash(hhm, key, keylen);
+		entries[n].data = entries[i].data;
+		n++;
+		prev = key;
+		prevlen = keylen;
+	}
+
+	return n;
+}
+
+/* Compare two keys that are preceded by their length using hardhat_cmp() */
+static int qsort_lenkey_cmp(const void *a, const void *b) {
+	const uint8_t *ak = *(const uint8_t * const *)a;
+	const uint8_t *bk = *(const uint8_t * const *)b;
+
+	return hardhat_cmp(ak + 2, u16read(ak), bk + 2, u16read(bk));
+}
+
+/* Bytes of the data section that an entry uses: its value, and for
+	version 3 also the header and key in front of it */
+static uint64_t hhm_entry_bytes(const hardhat_maker_t *hhm, uint16_t keylen, uint32_t datalen) {
+	if(hhm->superblock.version >= 4)
+		return datalen;
+	return (uint64_t)6 + keylen + datalen;
+}
+
+/* Add an entry of the base database as a record that refers to the data
+	copied from it */
+static bool hhm_base_record(hardhat_maker_t *hhm, const hardhat_cursor_t *c) {
+	const uint8_t *map = (const uint8_t *)hhm->base;
+	uint64_t off;
+
+	if(hhm->superblock.version >= 4) {
+		if(!hhm_keys_append(hhm, (uint64_t)((const uint8_t *)c->data - map), c->key, c->keylen, c->datalen, &off))
+			return false;
+	} else {
+		off = (uint64_t)((const uint8_t *)c->key - 6 - map);
+	}
+
+	return hhm_record(hhm, off);
+}
+
+/* The number of entries in the base database */
+static uint64_t hhm_base_entries(const hardhat_maker_t *hhm) {
+	const struct hardhat *base = hhm->base;
+
+	return base->version >= 6
+		? ((const struct widehardhat *)base)->entries
+		: base->entries;
+}
+
+/* Combine the entries of the base database with the new ones, which must
+	be in directory order. Base entries that were deleted or replaced are
+	left out. Replaces the entries of the hash table and updates the number
+	of entries and the size of the table. */
+static bool hhm_base_merge(hardhat_maker_t *hhm, uint32_t *num, uint32_t *size) {
+	struct hashtable *ht = hhm->hashtable;
+	struct hashentry *entries = ht->entries, *merged;
+	hardhat_cursor_t *c;
+	const uint8_t *rec, *del, **deleted;
+	uint32_t i, n, d, total;
+	int r, dr;
+
+	if((uint64_t)*num + hhm_base_entries(hhm) >= UINT32_MAX) {
+		hhm_set_error(hhm, "too many entries");
+		hhm->failed = true;
+		return false;
+	}
+	total = *num + (uint32_t)hhm_base_entries(hhm);
+
+	merged = malloc((total ? total : 1) * sizeof *merged);
+	deleted = malloc((hhm->deletednum ? hhm->deletednum : 1) * sizeof *deleted);
+	c = hardhat_cursor(hhm->base, "", 0);
+	if(!merged || !deleted || !c) {
+		free(merged);
+		free(deleted);
+		hardhat_cursor_free(c);
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	del = hhm->deleted;
+	for(d = 0; d < hhm->deletednum; d++) {
+		deleted[d] = del;
+		del += sizeof(uint16_t) + u16read(del);
+	}
+	qsort(deleted, hhm->deletednum, sizeof *deleted, qsort_lenkey_cmp);
+
+	if(!c->key)
+		hhm_merge_next(&c);
+
+	i = n = d = 0;
+	while(c || i < *num) {
+		if(!c) {
+			r = 1;
+		} else if(i == *num) {
+			r = -1;
+		} else {
+			rec = hhm_key(hhm, entries[i].data);
+			if(!rec)
+				break;
+			r = hardhat_cmp(c->key, c->keylen, rec + 6, u16read(rec + 4));
+		}
+
+		if(r > 0) {
+			rec = hhm_key(hhm, entries[i].data);
+			if(!rec)
+				break;
+			hhm->live += hhm_entry_bytes(hhm, u16read(rec + 4), u32read(rec));
+			merged[n++] = entries[i++];
+			continue;
+		}
+
+		if(r < 0) {
+			/* Keep the base entry, unless it was deleted */
+			dr = -1;
+			while(d < hhm->deletednum && (dr = hardhat_cmp(deleted[d] + 2, u16read(deleted[d]), c->key, c->keylen)) < 0)
+				d++;
+			if(dr) {
+				if(!hhm_base_record(hhm, c))
+					break;
+				hhm->live += hhm_entry_bytes(hhm, c->keylen, c->datalen);
+				merged[n].hash = hhm_calchash(hhm, c->key, c->keylen);
+				merged[n].data = hhm->recnum - 1;
+				n++;
+			}
+		}
+
+		/* A base entry that was replaced is simply skipped */
+		hhm_merge_next(&c);
+	}
+
+	hardhat_cursor_free(c);
+	free(deleted);
+
+	if(hhm->failed) {
+		free(merged);
+		return false;
+	}
+
+	free(ht->entries);
+	ht->entries = merged;
+	*num = n;
+	*size = total ? total : 1;
+
+	return true;
+}
+
+/* Add the missing parents of all entries, which must be in directory
+	order. Wherever a key has directories that its predecessor doesn't,
+	those are collected, then sorted and merged with the entries. Replaces
+	the entries of the hash table and updates the number of entries and the
+	size of the table. */
+static bool hhm_finish_parents(hardhat_maker_t *hhm, uint32_t *num, uint32_t *size) {
+	struct hashtable *ht = hhm->hashtable;
+	struct hashentry *entries = ht->entries, *merged = NULL;
+	const uint8_t *rec, *cur, *prev = NULL, *end, **dirs = NULL;
+	uint8_t *buf = NULL, *p;
+	size_t buflen = 0, bufsize = 0, dirsnum = 0, u;
+	uint16_t curlen, prevlen = 0, endlen;
+	uint32_t i, n = 0;
+	uint64_t off;
+	int r;
+	bool ok = true;
+
+	/* Map all records, so that the keys stay put while collecting */
+	if(*num && !hhm_db_map(hhm, hhm->records))
+		return false;
+
+	for(i = 0; ok && i < *num; i++) {
+		rec = hhm_key(hhm, entries[i].data);
+		if(!rec) {
+			ok = false;
+			break;
+		}
+		curlen = u16read(rec + 4);
+		cur = rec + 6;
+
+		endlen = (uint16_t)common_parents(prev, prevlen, cur, curlen);
+		for(;;) {
+			end = memchr(cur + endlen, '/', curlen - endlen);
+			if(!end)
+				break;
+			endlen = (uint16_t)(end - cur);
+
+			if(bufsize - buflen < sizeof endlen + endlen) {
+				bufsize = bufsize ? bufsize * 2 : 65536;
+				p = realloc(buf, bufsize);
+				if(!p) {
+					hhm_set_enomem(hhm);
+					ok = false;
+					break;
+				}
+				buf = p;
+			}
+			memcpy(buf + buflen, &endlen, sizeof endlen);
+			memcpy(buf + buflen + sizeof endlen, cur, endlen);
+			buflen += sizeof endlen + endlen;
+			dirsnum++;
+
+			endlen++;
+		}
+
+		prev = cur;
+		prevlen = curlen;
+	}
+
+	if(ok && (uint64_t)*num + dirsnum >= UINT32_MAX) {
+		hhm_set_error(hhm, "too many entries");
+		hhm->failed = true;
+		ok = false;
+	}
+
+	if(ok) {
+		dirs = malloc((dirsnum ? dirsnum : 1) * sizeof *dirs);
+		merged = malloc((*num + dirsnum ? *num + dirsnum : 1) * sizeof *merged);
+		if(!dirs || !merged) {
+			hhm_set_enomem(hhm);
+			ok = false;
+		}
+	}
+
+	if(ok) {
+		p = buf;
+		for(u = 0; u < dirsnum; u++) {
+			dirs[u] = p;
+			p += sizeof endlen + u16read(p);
+		}
+		qsort(dirs, dirsnum, sizeof *dirs, qsort_lenkey_cmp);
+
+		/* Merge the directories with the entries, writing out the missing ones */
+		i = 0;
+		for(u = 0; ok && u < dirsnum; u++) {
+			if(u && !qsort_lenkey_cmp(dirs + u - 1, dirs + u))
+				continue;
+			cur = dirs[u] + sizeof endlen;
+			curlen = u16read(dirs[u]);
+
+			for(r = 1; i < *num; i++) {
+				rec = hhm_key(hhm, entries[i].data);
+				if(!rec) {
+					ok = false;
+					break;
+				}
+				r = hardhat_cmp(rec + 6, u16read(rec + 4), cur, curlen);
+				if(r >= 0)
+					break;
+				merged[n++] = entries[i];
+			}
+			if(!ok || !r)
+				continue;
+
+			ok = hhm_write_record(hhm, cur, curlen, hhm->parentdata, -1, 0, hhm->parentdatalen, &off)
+				&& hhm_record(hhm, off);
+			if(ok) {
+				merged[n].hash = hhm_calchash(hhm, cur, curlen);
+				merged[n].data = hhm->recnum - 1;
+				n++;
+			}
+		}
+	}
+
+	free(buf);
+	free(dirs);
+
+	if(!ok) {
+		free(merged);
+		return false;
+	}
+
+	while(i < *num)
+		merged[n++] = entries[i++];
+
+	free(ht->entries);
+	ht->entries = merged;
+	*size = *num + (uint32_t)dirsnum ? *num + (uint32_t)dirsnum : 1;
+	*num = n;
+
+	return true;
+}
+
+/* The size of the entries of the hash tables in the database */
+static size_t hhm_hashentrysize(const hardhat_maker_t *hhm) {
+	return hhm->superblock.version >= 6
+		? sizeof(struct widehashentry)
+		: sizeof(struct hashentry);
+}
+
+/* Write out a hash table, with the entries widened for version 6
+	databases, and return where it starts and ends */
+static bool hhm_write_hashes(hardhat_maker_t *hhm, const struct hashentry *entries, uint32_t num, uint64_t *start, uint64_t *end) {
+	struct hhm_file *db = &hhm->db;
+	struct widehashentry we = {0, 0, 0};
+	size_t hesize = hhm_hashentrysize(hhm);
+	uint32_t i;
+
+	if(!hhm_db_pad(hhm, db, num * hesize, hesize))
+		return false;
+
+	*start = db->off;
+
+	if(hhm->superblock.version >= 6) {
+		for(i = 0; i < num; i++) {
+			we.hash = entries[i].hash;
+			we.data = entries[i].data;
+			if(!hhm_db_append(hhm, db, &we, sizeof we))
+				return false;
+		}
+	} else {
+		if(!hhm_db_append(hhm, db, entries, num * sizeof *entries))
+			return false;
+	}
+
+	*end = db->off;
+
+	return true;
+}
+
+/* Give a complete database that was built in atomic mode its real name.
+	An unnamed file is linked into place directly if nothing has that name
+	yet, otherwise it's linked under a hidden name first. That is then
+	renamed over the old file, so readers see either the old or the new
+	database, never something in between. */
+static bool hhm_publish(hardhat_maker_t *hhm, int fd) {
+	char path[32];
+	unsigned int tries;
+	int dirfd;
+	bool ok;
+
+	if(!*hhm->tmpname) {
+		snprintf(path, sizeof path, "/proc/self/fd/%d", fd);
+		if(linkat(AT_FDCWD, path, hhm->dirfd, hhm->basename, AT_SYMLINK_FOLLOW) == -1) {
+			if(errno == EEXIST) {
+				for(tries = 0; tries < 100; tries++) {
+					snprintf(hhm->tmpname, sizeof hhm->tmpname, ".hardhat-%08"PRIx32, makeseed());
+					if(linkat(AT_FDCWD, path, hhm->dirfd, hhm->tmpname, AT_SYMLINK_FOLLOW) != -1)
+						break;
+					*hhm->tmpname = '\0';
+					if(errno != EEXIST)
+						break;
+				}
+			}
+			if(!*hhm->tmpname) {
+				hhm_set_error(hhm, "linking %s failed: %m", hhm->filename);
+				hhm->failed = true;
+				return false;
+			}
+		}
+	}
+
+	if(*hhm->tmpname) {
+		if(renameat(hhm->dirfd, hhm->tmpname, hhm->dirfd, hhm->basename) == -1) {
+			hhm_set_error(hhm, "renaming %s failed: %m", hhm->filename);
+			hhm->failed = true;
+			return false;
+		}
+		*hhm->tmpname = '\0';
+	}
+
+	/* The new name needs to be on disk too */
+	dirfd = openat(hhm->dirfd, ".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	ok = dirfd != -1 && fsync(dirfd) != -1;
+	if(!ok) {
+		hhm_set_error(hhm, "syncing the directory of %s failed: %m", hhm->filename);
+		hhm->failed = true;
+	}
+	if(dirfd != -1)
+		close(dirfd);
+
+	return ok;
+}
+
+/* Create and write out the superblock, then flush and close the
+	database. Everything else must have been written already. */
+static bool hhm_finish_header(hardhat_maker_t *hhm, uint64_t num, uint64_t pfxnum) {
+	struct hhm_file *db = &hhm->db;
+	struct widehardhat widesuperblock;
+	const void *header;
+	size_t headersize;
+	int fd;
+
+	/* Create and write out the superblock */
+	memcpy(hhm->superblock.magic, HARDHAT_MAGIC, sizeof hhm->superblock.magic);
+	hhm->superblock.byteorder = UINT64_C(0x0123456789ABCDEF);
+	hhm->superblock.entries = (uint32_t)num;
+	hhm->superblock.prefixes = (uint32_t)pfxnum;
+	hhm->superblock.filesize = db->off;
+
+	if(hhm->superblock.version >= 6) {
+		/* The counts and checksum at the end supersede these */
+		hhm->superblock.entries = 0;
+		hhm->superblock.prefixes = 0;
+		hhm->superblock.checksum = 0;
+		hhm->newsuperblock.hardhat = hhm->superblock;
+		hhm->newsuperblock.checksum = 0;
+		memset(&widesuperblock, 0, sizeof widesuperblock);
+		widesuperblock.newhardhat = hhm->newsuperblock;
+		widesuperblock.entries = num;
+		widesuperblock.prefixes = pfxnum;
+		widesuperblock.checksum = hhm_calchash(hhm, (const void *)&widesuperblock, sizeof widesuperblock - 4);
+		header = &widesuperblock;
+		headersize = sizeof widesuperblock;
+	} else if(hhm->superblock.version >= 4) {
+		/* The checksum of the extended superblock supersedes this one */
+		hhm->superblock.checksum = 0;
+		hhm->newsuperblock.hardhat = hhm->superblock;
+		hhm->newsuperblock.checksum = hhm_calchash(hhm, (const void *)&hhm->newsuperblock, sizeof hhm->newsuperblock - 4);
+		header = &hhm->newsuperblock;
+		headersize = sizeof hhm->newsuperblock;
+	} else {
+		hhm->superblock.checksum = hhm_calchash(hhm, (const void *)&hhm->superblock, sizeof hhm->superblock - 4);
+		header = &hhm->superblock;
+		headersize = sizeof hhm->superblock;
+	}
+
+	if(!hhm_db_drain(hhm, db))
+		return false;
+
+	if(!hhm_db_seek(hhm, db, 0, SEEK_SET))
+		return false;
+
+	if(!hhm_db_write(hhm, db, header, headersize))
+		return false;
+
+	if(db->mapped && msync(db->window, (size_t)db->off, MS_SYNC) == -1) {
+		hhm_set_error(hhm, "writing %s failed: %m", hhm->filename);
+		hhm->failed = true;
+		return false;
+	}
+
+	fd = db->fd;
+	if(ftruncate(fd, (off_t)db->off) == -1) {
+		hhm_set_error(hhm, "truncating %s failed: %m", hhm->filename);
+		hhm->failed = true;
+		return false;
+	}
+
+	if(fdatasync(fd) == -1) {
+		hhm_set_error(hhm, "writing %s failed: %m", hhm->filename);
+		hhm->failed = true;
+		return false;
+	}
+
+	if(hhm->atomic && !hhm_publish(hhm, fd))
+		return false;
+
+	db->fd = -1;
+	if(close(fd) == -1) {
+		hhm_set_error(hhm, "closing %s failed: %m", hhm->filename);
+		hhm->failed = true;
+		return false;
+	}
+
+	hhm_db_close(&hhm->keys);
+	hhm_db_close(&hhm->spill);
+
+	hhm->finished = true;
+
+	return true;
+}
+
+/******************************************************************************
+
+	Sorting with a memory budget. Instead of keeping the offsets of all
+	records in memory, they are sorted in runs of limited size, which are
+	written to a scratch file: the spill file. When the database is
+	finished, the runs are merged into the directory, dropping duplicates
+	(the entry that was added first wins, as in bulk mode). Missing parents
+	are collected in a pass over the directory, sorted in runs as well and
+	merged in. The hash and prefix tables are then sorted in runs and merged
+	straight into the database.
+
+	The runs of the directory consist of the 64-bit offsets of key records.
+	Items with HHM_SPILLKEY set refer to a key in the spill file (preceded
+	by its length) instead of a record. The runs of the hash tables consist
+	of hash entries as they are written to the database.
+
+******************************************************************************/
+
+#define HHM_SPILLKEY (UINT64_C(1) << 63)
+
+/* An item of a run */
+union hhm_item {
+	uint64_t off;
+	struct hashentry he;
+	struct widehashentry we;
+};
+
+/* The current item of a run that is being merged */
+struct hhm_merge {
+	union hhm_item item;
+	/* Offset of the next item */
+	uint64_t off;
+	/* Number of items after the current one */
+	uint64_t left;
+	/* Index of the run; earlier runs win ties */
+	size_t run;
+};
+
+/* The argument of qsort_runhash_cmp() */
+struct hhm_hashrun {
+	hardhat_maker_t *hhm;
+	/* The directory index that the data of the entries is relative to */
+	uint64_t base;
+};
+
+/* The state of a merge into the directory */
+struct hhm_dirmerge {
+	/* The item that was written out last */
+	uint64_t last;
+	/* The number of items written out */
+	uint64_t num;
+};
+
+/* Create the spill file when it is first needed */
+static bool hhm_spill_open(hardhat_maker_t *hhm) {
+	struct hhm_file *spill = &hhm->spill;
+
+	if(spill->fd != -1)
+		return true;
+
+	spill->fd = hhm_tmpfile(hhm);
+	if(spill->fd == -1) {
+		hhm_set_error(hhm, "creating a temporary file for %s failed: %m", hhm->filename);
+		hhm->failed = true;
+		return false;
+	}
+
+	spill->outbuf = malloc(OUTBUFSIZE);
+	if(!spill->outbuf) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	return true;
+}
+
+/* Add a run to a list */
+static bool hhm_run_add(hardhat_maker_t *hhm, struct hhm_runs *runs, uint64_t off, uint64_t num) {
+	struct hhm_run *run;
+	size_t size;
+
+	if(runs->num == runs->size) {
+		size = runs->size ? runs->size * 2 : 16;
+		run = realloc(runs->runs, size * sizeof *run);
+		if(!run) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+		runs->runs = run;
+		runs->size = size;
+	}
+
+	run = runs->runs + runs->num++;
+	run->off = off;
+	run->num = num;
+
+	return true;
+}
+
+/* Start a new run of num items at the end of the spill file */
+static bool hhm_spill_start(hardhat_maker_t *hhm, struct hhm_runs *runs, size_t num) {
+	struct hhm_file *spill = &hhm->spill;
+
+	return hhm_spill_open(hhm)
+		&& hhm_db_pad(hhm, spill, 0, sizeof(uint64_t))
+		&& hhm_run_add(hhm, runs, (uint64_t)spill->off, num);
+}
+
+/* Append an array of items to the spill file as a new run */
+static bool hhm_spill_items(hardhat_maker_t *hhm, struct hhm_runs *runs, const void *items, size_t num) {
+	return hhm_spill_start(hhm, runs, num)
+		&& hhm_db_append(hhm, &hhm->spill, items, num * runs->itemsize);
+}
+
+/* Sort the records that were added since the previous run in directory
+	order and write their offsets to the spill file as a new run */
+static bool hhm_spill_run(hardhat_maker_t *hhm) {
+	struct hashentry *entries;
+	uint64_t *offs;
+	uint32_t i, num;
+	bool ok;
+
+	num = hhm->recnum;
+
+	/* Records that arrived in order need no sorting */
+	if(hhm->sorted) {
+		ok = hhm_spill_items(hhm, &hhm->runs, hhm->recbuf, num);
+	} else {
+		entries = malloc((num ? num : 1) * sizeof *entries);
+		if(!entries) {
+			hhm_set_enomem(hhm);
+			return false;
+		}
+
+		for(i = 0; i < num; i++) {
+			entries[i].hash = 0;
+			entries[i].data = i;
+		}
+
+		/* The comparison functions may run in several threads at once,
+			so map all records up front */
+		ok = hhm_db_map(hhm, hhm->records)
+			&& hhm_sort_directory(hhm, entries, num, num);
+
+		/* Put the offsets in order in the hash entries' place */
+		offs = (uint64_t *)entries;
+		if(ok)
+			for(i = 0; i < num; i++)
+				offs[i] = hhm->recbuf[entries[i].data];
+
+		ok = ok && hhm_spill_items(hhm, &hhm->runs, offs, num);
+
+		free(entries);
+	}
+
+	if(!ok)
+		return false;
+
+	hhm->spilled += num;
+	hhm->recnum = 0;
+
+	return true;
+}
+
+/* Fetch the key an item refers to: a key record, or a key in the spill file */
+static const uint8_t *hhm_item_key(hardhat_maker_t *hhm, uint64_t item, uint16_t *keylen) {
+	const uint8_t *p;
+
+	if(item & HHM_SPILLKEY) {
+		item &= ~HHM_SPILLKEY;
+		p = hhm_db_getrec(hhm, &hhm->spill, item, sizeof *keylen);
+		if(!p)
+			return NULL;
+		*keylen = u16read(p);
+		p = hhm_db_getrec(hhm, &hhm->spill, item, sizeof *keylen + *keylen);
+		return p ? p + sizeof *keylen : NULL;
+	}
+
+	p = hhm_getrec(hhm, item);
+	if(!p)
+		return NULL;
+	*keylen = u16read(p + 4);
+
+	return p + 6;
+}
+
+/* Compare two items by the keys they refer to, using hardhat_cmp() */
+static int qsort_item_cmp(const void *a, const void *b, void *hhm) {
+	const uint8_t *ak, *bk;
+	uint64_t ai, bi;
+	uint16_t al, bl;
+
+	if(((hardhat_maker_t *)hhm)->failed)
+		return 0;
+
+	ai = ((const union hhm_item *)a)->off;
+	bi = ((const union hhm_item *)b)->off;
+
+	ak = hhm_item_key(hhm, ai, &al);
+	if(!ak)
+		return 0;
+
+	bk = hhm_item_key(hhm, bi, &bl);
+	if(!bk)
+		return 0;
+
+	/* get the first key again: the memory mapping may have moved */
+	ak = hhm_item_key(hhm, ai, &al);
+	if(!ak)
+		return 0;
+
+	return hardhat_cmp(ak, al, bk, bl);
+}
+
+static int hhm_merge_cmp(hardhat_maker_t *hhm, const struct hhm_merge *a, const struct hhm_merge *b, int (*compar)(const void *, const void *, void *)) {
+	int r;
+
+	r = compar(&a->item, &b->item, hhm);
+	return r ? r : a->run < b->run ? -1 : a->run > b->run;
+}
+
+/* Move the item at position i of the heap down to where it belongs */
+static void hhm_merge_down(hardhat_maker_t *hhm, struct hhm_merge *heap, size_t num, size_t i, int (*compar)(const void *, const void *, void *)) {
+	struct hhm_merge tmp;
+	size_t child;
+
+	for(;;) {
+		child = 2 * i + 1;
+		if(child >= num)
+			break;
+		if(child + 1 < num && hhm_merge_cmp(hhm, heap + child + 1, heap + child, compar) < 0)
+			child++;
+		if(hhm_merge_cmp(hhm, heap + child, heap + i, compar) >= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Fetch the next item of a run from the spill file */
+static bool hhm_merge_next_item(hardhat_maker_t *hhm, struct hhm_merge *m, size_t itemsize) {
+	const uint8_t *p;
+
+	p = hhm_db_getrec(hhm, &hhm->spill, m->off, itemsize);
+	if(!p)
+		return false;
+	memcpy(&m->item, p, itemsize);
+	m->off += itemsize;
+	m->left--;
+
+	return true;
+}
+
+/* Merge runs from the spill file, using a heap of their current items, and
+	call emit for each item in order. On ties, earlier runs go first. */
+static bool hhm_merge_runs(hardhat_maker_t *hhm, const struct hhm_runs *runs, int (*compar)(const void *, const void *, void *), bool (*emit)(hardhat_maker_t *, const union hhm_item *, void *), void *arg) {
+	struct hhm_merge *heap;
+	size_t u, num;
+	bool ok = true;
+
+	if(!runs->num)
+		return true;
+
+	/* Write out and map the runs as a whole, so they can be read back
+		while the output is appended */
+	if(!hhm_db_map(hhm, &hhm->spill))
+		return false;
+
+	heap = malloc(runs->num * sizeof *heap);
+	if(!heap) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
+
+	for(u = num = 0; ok && u < runs->num; u++) {
+		if(!runs->runs[u].num)
+			continue;
+		heap[num].off = runs->runs[u].off;
+		heap[num].left = runs->runs[u].num;
+		heap[num].run = u;
+		ok = hhm_merge_next_item(hhm, heap + num, runs->itemsize);
+		num++;
+	}
+
+	for(u = num / 2; ok && u--;)
+		hhm_merge_down(hhm, heap, num, u, compar);
+
+	while(ok && num && !hhm->failed) {
+		ok = emit(hhm, &heap->item, arg);
+		if(!ok)
+			break;
+		if(heap->left)
+			ok = hhm_merge_next_item(hhm, heap, runs->itemsize);
+		else
+			*heap = heap[--num];
+		hhm_merge_down(hhm, heap, num, 0, compar);
+	}
+
+	free(heap);
+
+	return ok && !hhm->failed;
+}
+
+/* Append an item to the directory in the spill file, unless its key was
+	just appended. Keys in the spill file are missing parents, which get a
+	key record first. */
+static bool hhm_emit_dir(hardhat_maker_t *hhm, const union hhm_item *item, void *arg) {
+	struct hhm_dirmerge *dm = arg;
+	const uint8_t *key, *last;
+	uint16_t keylen, lastlen;
+	uint64_t off = item->off;
+
+	if(dm->num) {
+		key = hhm_item_key(hhm, off, &keylen);
+		last = key ? hhm_item_key(hhm, dm->last, &lastlen) : NULL;
+		/* get the key again: the memory mapping may have moved */
+		key = last ? hhm_item_key(hhm, off, &keylen) : NULL;
+		if(!key)
+			return false;
+		if(keylen == lastlen && !memcmp(key, last, keylen))
+			return true;
+	}
+
+	if(off & HHM_SPILLKEY) {
+		key = hhm_item_key(hhm, off, &keylen);
+		if(!key || !hhm_write_record(hhm, key, keylen, hhm->parentdata, -1, 0, hhm->parentdatalen, &off))
+			return false;
 	}
-	hhm->recbuf[hhm->recnum++] = off;
+
+	if(hhm->superblock.version < 6 && dm->num == UINT32_MAX - 1) {
+		hhm_set_error(hhm, "too many entries");
+		hhm->failed = true;
+		return false;
+	}
+
+	if(!hhm_db_append(hhm, &hhm->spill, &off, sizeof off))
+		return false;
+
+	dm->last = off;
+	dm->num++;
 
 	return true;
 }
 
-/* Add parent directory entries for all entries that do not have them yet */
-export bool hardhat_maker_parents(hardhat_maker_t *hhm, const void *data, uint32_t datalen) {
-	uint32_t i;
-	const uint8_t *rec, *slash, *key;
-	uint16_t keylen;
+/* Append an item (a hash entry) of the given runs to the database */
+static bool hhm_emit_db(hardhat_maker_t *hhm, const union hhm_item *item, void *arg) {
+	const struct hhm_runs *runs = arg;
 
-	if(!hhm || hhm->failed || hhm->finished) {
-		errno = EINVAL;
+	return hhm_db_append(hhm, &hhm->db, item, runs->itemsize);
+}
+
+/* Merge runs into a new directory at the end of the spill file */
+static bool hhm_merge_dir(hardhat_maker_t *hhm, const struct hhm_runs *runs, struct hhm_dirmerge *dm) {
+	struct hhm_file *spill = &hhm->spill;
+	uint64_t start;
+
+	dm->last = 0;
+	dm->num = 0;
+
+	if(!hhm_db_pad(hhm, spill, 0, sizeof dm->last))
+		return false;
+	start = (uint64_t)spill->off;
+
+	if(!hhm_merge_runs(hhm, runs, qsort_item_cmp, hhm_emit_dir, dm))
+		return false;
+
+	hhm->spilldir = start;
+
+	return true;
+}
+
+/* Write collected directories to the spill file, each preceded by its
+	length, followed by a run of references to them in directory order */
+static bool hhm_spill_dirs(hardhat_maker_t *hhm, struct hhm_runs *runs, const uint8_t *buf, size_t num) {
+	const uint8_t **dirs, *p;
+	uint64_t *items;
+	size_t u, n;
+	bool ok = true;
+
+	dirs = malloc(num * sizeof *dirs);
+	items = malloc(num * sizeof *items);
+	if(!dirs || !items) {
+		free(dirs);
+		free(items);
+		hhm_set_enomem(hhm);
 		return false;
 	}
 
-	for(i = 0; i < hhm->recnum; i++) {
-		rec = hhm_getrec(hhm, hhm->recbuf[i]);
-		if(!rec)
-			return false;
-		key = rec + 6;
-		slash = memrchr(key, '/', u16read(rec + 4));
-		if(!slash)
+	p = buf;
+	for(u = 0; u < num; u++) {
+		dirs[u] = p;
+		p += sizeof(uint16_t) + u16read(p);
+	}
+	qsort(dirs, num, sizeof *dirs, qsort_lenkey_cmp);
+
+	for(u = n = 0; ok && u < num; u++) {
+		if(u && !qsort_lenkey_cmp(dirs + u - 1, dirs + u))
 			continue;
-		keylen = (uint16_t)(slash - key);
-		/* Stupidly try to add them, duplicates will be detected
-			and handled by hardhat_maker_add() */
-		if(!hardhat_maker_add(hhm, key, keylen, data, datalen))
+		items[n++] = HHM_SPILLKEY | (uint64_t)hhm->spill.off;
+		ok = hhm_db_append(hhm, &hhm->spill, dirs[u], sizeof(uint16_t) + u16read(dirs[u]));
+	}
+
+	ok = ok && hhm_spill_items(hhm, runs, items, n);
+
+	free(dirs);
+	free(items);
+
+	return ok;
+}
+
+/* Like qsort_hash_cmp(), for hash entries whose data is relative to the
+	start of a run, so that they fit in 32 bits */
+static int qsort_runhash_cmp(const void *a, const void *b, void *arg) {
+	const struct hhm_hashrun *run = arg;
+	uint32_t ah, bh;
+
+	ah = ((const struct hashentry *)a)->hash;
+	bh = ((const struct hashentry *)b)->hash;
+
+	if(ah == bh)
+		return hhm_hash_keycmp(run->hhm, run->base + ((const struct hashentry *)a)->data, run->base + ((const struct hashentry *)b)->data);
+
+	return ah < bh ? -1 : 1;
+}
+
+/* Sort hash entries whose data is relative to base and write them to the
+	spill file as a new run, in the form they take in the database */
+static bool hhm_spill_hashes(hardhat_maker_t *hhm, struct hhm_runs *runs, struct hashentry *entries, size_t num, uint64_t base) {
+	struct hhm_hashrun run = {hhm, base};
+	struct widehashentry we = {0, 0, 0};
+	size_t u;
+
+	if(!num)
+		return true;
+
+	sorthash(entries, num, qsort_runhash_cmp, &run);
+	if(hhm->failed)
+		return false;
+
+	if(runs->itemsize == sizeof *entries) {
+		for(u = 0; u < num; u++)
+			entries[u].data += (uint32_t)base;
+		return hhm_spill_items(hhm, runs, entries, num);
+	}
+
+	if(!hhm_spill_start(hhm, runs, num))
+		return false;
+
+	for(u = 0; u < num; u++) {
+		we.hash = entries[u].hash;
+		we.data = base + entries[u].data;
+		if(!hhm_db_append(hhm, &hhm->spill, &we, sizeof we))
 			return false;
 	}
 
 	return true;
 }
 
-/* Compare two entries from the hashtable by fetching their key values
-	and comparing them using hardhat_cmp().
-	Empty hash values always come last. */
-static int qsort_directory_cmp(const void *a, const void *b, void *hhm) {
-	const uint8_t *ar, *br;
-	uint32_t ad, bd;
-	const uint64_t *recs;
+/* Add the missing parents, like hhm_finish_parents() does: collect the
+	directories of the entries in the directory, then merge them in. */
+static bool hhm_external_parents(hardhat_maker_t *hhm, struct hhm_dirmerge *dm) {
+	struct hhm_runs runs = {NULL, 0, 0, sizeof(uint64_t)};
+	const uint8_t *rec, *cur, *prev = NULL, *end;
+	uint8_t *buf;
+	size_t buflen = 0, bufsize, dirsnum = 0;
+	uint16_t curlen, prevlen = 0, endlen;
+	uint64_t i;
+	bool ok;
+
+	/* Records must stay put while collecting */
+	if(!hhm_db_map(hhm, hhm->records) || !hhm_db_map(hhm, &hhm->spill))
+		return false;
 
-	if(((hardhat_maker_t *)hhm)->failed)
-		return 0;
+	bufsize = (size_t)(hhm->budget / 2);
+	if(bufsize < sizeof endlen + UINT16_MAX)
+		bufsize = sizeof endlen + UINT16_MAX;
+	buf = malloc(bufsize);
+	if(!buf) {
+		hhm_set_enomem(hhm);
+		return false;
+	}
 
-	ad = ((const struct hashentry *)a)->data;
-	bd = ((const struct hashentry *)b)->data;
+	/* The entries go first, so that they win over their namesakes */
+	ok = hhm_run_add(hhm, &runs, hhm->spilldir, dm->num);
 
-	if(ad == EMPTYHASH)
-		return bd == EMPTYHASH ? 0 : 1;
-	else if(bd == EMPTYHASH)
-		return -1;
+	for(i = 0; ok && i < dm->num; i++) {
+		rec = hhm_dir_key(hhm, i);
+		if(!rec) {
+			ok = false;
+			break;
+		}
+		curlen = u16read(rec + 4);
+		cur = rec + 6;
 
-	recs = ((hardhat_maker_t *)hhm)->recbuf;
+		endlen = (uint16_t)common_parents(prev, prevlen, cur, curlen);
+		for(;;) {
+			end = memchr(cur + endlen, '/', curlen - endlen);
+			if(!end)
+				break;
+			endlen = (uint16_t)(end - cur);
 
-	ar = hhm_getrec(hhm, recs[ad]);
-	if(!ar)
-		return 0;
+			if(bufsize - buflen < sizeof endlen + endlen) {
+				ok = hhm_spill_dirs(hhm, &runs, buf, dirsnum);
+				buflen = dirsnum = 0;
+				if(!ok)
+					break;
+			}
+			memcpy(buf + buflen, &endlen, sizeof endlen);
+			memcpy(buf + buflen + sizeof endlen, cur, endlen);
+			buflen += sizeof endlen + endlen;
+			dirsnum++;
 
-	br = hhm_getrec(hhm, recs[bd]);
-	if(!br)
-		return 0;
+			endlen++;
+		}
 
-	/* get the first record again: the memory mapping may have moved */
-	ar = hhm_getrec(hhm, recs[ad]);
-	if(!ar)
-		return 0;
+		prev = cur;
+		prevlen = curlen;
+	}
 
-	return hardhat_cmp(ar + 6, u16read(ar + 4), br + 6, u16read(br + 4));
+	if(ok && dirsnum)
+		ok = hhm_spill_dirs(hhm, &runs, buf, dirsnum);
+
+	free(buf);
+
+	if(ok && runs.num > 1)
+		ok = hhm_merge_dir(hhm, &runs, dm);
+
+	free(runs.runs);
+
+	return ok;
 }
 
-/* Compare hash entries by hash value, with string comparison as a tie breaker. */
-static int qsort_hash_cmp(const void *a, const void *b, void *hhm) {
-	const uint8_t *ar, *br;
-	uint32_t ad, bd;
-	uint16_t al, bl;
-	const uint64_t *recs;
-	int r;
+/* hardhat_maker_finish() for entries that were sorted in runs */
+static bool hhm_finish_external(hardhat_maker_t *hhm) {
+	struct hhm_file *db = &hhm->db, *spill = &hhm->spill;
+	struct hhm_dirmerge dm;
+	struct hhm_runs hashruns = {NULL, 0, 0, hhm_hashentrysize(hhm)};
+	struct hhm_runs pfxruns = {NULL, 0, 0, hhm_hashentrysize(hhm)};
+	struct hashentry *hashes, *pfxs;
+	int (*compar)(const void *, const void *, void *);
+	const uint64_t *dir;
+	const uint8_t *rec, *cur, *prev, *end;
+	size_t runsize, hashnum, pfxnum;
+	uint64_t i, num, pfxtotal, hashbase, pfxbase;
+	uint16_t curlen, prevlen, endlen;
+	bool ok;
 
-	ad = ((const struct hashentry *)a)->hash;
-	bd = ((const struct hashentry *)b)->hash;
+	if(hhm->recnum && !hhm_spill_run(hhm))
+		return false;
 
-	if(ad == bd) {
-		if(((hardhat_maker_t *)hhm)->failed)
-			return 0;
+	/* Merge the runs into the directory */
+	if(!hhm_db_map(hhm, hhm->records) || !hhm_merge_dir(hhm, &hhm->runs, &dm))
+		return false;
 
-		ad = ((const struct hashentry *)a)->data;
-		bd = ((const struct hashentry *)b)->data;
+	if(hhm->autoparents && !hhm_external_parents(hhm, &dm))
+		return false;
 
-		if(ad == EMPTYHASH)
-			return bd != EMPTYHASH;
-		else if(bd == EMPTYHASH)
-			return -1;
+	num = dm.num;
 
-		recs = ((hardhat_maker_t *)hhm)->recbuf;
+	hhm->superblock.data_end = db->off;
 
-		ar = hhm_getrec(hhm, recs[ad]);
-		if(!ar)
-			return 0;
+	/* No more values will be added */
+	freehash(hhm->values);
+	hhm->values = NULL;
+	free(hhm->valuebuf);
+	hhm->valuebuf = NULL;
 
-		br = hhm_getrec(hhm, recs[bd]);
-		if(!br)
-			return 0;
+	if(!hhm_db_map(hhm, hhm->records) || !hhm_db_map(hhm, spill))
+		return false;
 
-		/* get the first record again: the memory mapping may have moved */
-		ar = hhm_getrec(hhm, recs[ad]);
-		if(!ar)
-			return 0;
+	dir = (const uint64_t *)(spill->window + hhm->spilldir);
 
-		al = u16read(ar + 4);
-		bl = u16read(br + 4);
+	if(hhm->superblock.version >= 4) {
+		if(!hhm_write_keyblocks(hhm, dir, num))
+			return false;
+	} else {
+		if(!hhm_db_pad(hhm, db, num * sizeof *dir, sizeof *dir))
+			return false;
 
-		if(al < bl) {
-			r = memcmp(ar + 6, br + 6, al);
-			return r ? r : -1;
-		} else {
-			r = memcmp(ar + 6, br + 6, bl);
-			return r ? r : al != bl;
-		}
+		hhm->superblock.directory_start = db->off;
+
+		if(!hhm_db_append(hhm, db, dir, num * sizeof *dir))
+			return false;
+
+		hhm->superblock.directory_end = db->off;
 	}
 
-	return ad < bd ? -1 : 1;
-}
+	/* Collect the hashes of the entries and of their prefixes in runs.
+		Their data is relative to the first entry of the run, so that
+		it fits in a struct hashentry. */
+	runsize = hhm_runsize(hhm);
+	hashes = malloc(runsize * sizeof *hashes);
+	pfxs = malloc(runsize * sizeof *pfxs);
+	ok = hashes && pfxs;
+	if(!ok)
+		hhm_set_enomem(hhm);
+
+	hashnum = pfxnum = 0;
+	pfxtotal = hashbase = pfxbase = 0;
+	prev = NULL;
+	prevlen = 0;
+	for(i = 0; ok && i < num; i++) {
+		rec = hhm_dir_key(hhm, i);
+		if(!rec) {
+			ok = false;
+			break;
+		}
+		curlen = u16read(rec + 4);
+		cur = rec + 6;
 
-/* Find the longest common prefix (on ‘/’ boundaries) */
-__attribute__((optimize(3)))
-static size_t common_parents(const uint8_t *a, size_t al, const uint8_t *b, size_t bl) {
-	size_t cl = 0, l, i;
-	uint8_t ac, bc;
+		if(hashnum == runsize) {
+			ok = hhm_spill_hashes(hhm, &hashruns, hashes, hashnum, hashbase);
+			hashnum = 0;
+		}
+		if(!hashnum)
+			hashbase = i;
+		hashes[hashnum].hash = hhm_calchash(hhm, cur, curlen);
+		hashes[hashnum].data = (uint32_t)(i - hashbase);
+		hashnum++;
 
-	l = al < bl ? al : bl;
+		endlen = common_parents(prev, prevlen, cur, curlen);
+		end = cur + endlen;
+		while(ok) {
+			end = memchr(end, '/', curlen - endlen);
+			if(!end)
+				break;
+			end++;
 
-	for(i = 0; i < l; i++) {
-		ac = a[i];
-		bc = b[i];
-		if(ac != bc)
-			break;
-		if(ac == '/')
-			cl = i + 1;
+			endlen = (uint16_t)(end - cur);
+			if(pfxnum == runsize || (pfxnum && i - pfxbase >= UINT32_MAX)) {
+				ok = hhm_spill_hashes(hhm, &pfxruns, pfxs, pfxnum, pfxbase);
+				pfxnum = 0;
+			}
+			if(!pfxnum)
+				pfxbase = i;
+			pfxs[pfxnum].hash = hhm_calchash(hhm, cur, endlen);
+			pfxs[pfxnum].data = (uint32_t)(i - pfxbase);
+			pfxnum++;
+			pfxtotal++;
+		}
+		prev = cur;
+		prevlen = curlen;
 	}
 
-	return cl;
-}
+	ok = ok && hhm_spill_hashes(hhm, &hashruns, hashes, hashnum, hashbase)
+		&& hhm_spill_hashes(hhm, &pfxruns, pfxs, pfxnum, pfxbase);
 
-#ifndef HAVE_QSORT_R
-extern void qsort_r(void *, size_t, size_t, int (*)(const void *, const void *, void *), void *);
-#endif
+	free(hashes);
+	free(pfxs);
+
+	if(ok && hhm->superblock.version < 6 && pfxtotal >= UINT32_MAX) {
+		hhm_set_error(hhm, "too many prefixes");
+		hhm->failed = true;
+		ok = false;
+	}
+
+	/* Merge them into the hash table and the prefix table */
+	compar = hhm->superblock.version >= 6 ? qsort_widehash_cmp : qsort_hash_cmp;
+
+	ok = ok && hhm_db_pad(hhm, db, num * hashruns.itemsize, hashruns.itemsize);
+	hhm->superblock.hash_start = db->off;
+	ok = ok && hhm_merge_runs(hhm, &hashruns, compar, hhm_emit_db, &hashruns);
+	hhm->superblock.hash_end = db->off;
+
+	ok = ok && hhm_db_pad(hhm, db, pfxtotal * pfxruns.itemsize, pfxruns.itemsize);
+	hhm->superblock.prefix_start = db->off;
+	ok = ok && hhm_merge_runs(hhm, &pfxruns, compar, hhm_emit_db, &pfxruns);
+	hhm->superblock.prefix_end = db->off;
+
+	free(hashruns.runs);
+	free(pfxruns.runs);
+
+	if(!ok)
+		return false;
+
+	return hhm_finish_header(hhm, num, pfxtotal);
+}
 
 /* Finish up the database by writing the indexes and the superblock */
 export bool hardhat_maker_finish(hardhat_maker_t *hhm) {
-	int fd;
+	struct hhm_file *db;
 	struct hashtable *ht;
 	struct hashentry *he, *entries;
 	uint32_t i, num, pfxnum, size;
 	uint64_t *dir;
-	const uint8_t *cur, *prev, *end;
+	const uint8_t *records, *cur, *prev, *end;
 	uint16_t curlen, prevlen, endlen;
 
 	if(!hhm || hhm->failed || hhm->finished) {
@@ -828,65 +5050,124 @@ export bool hardhat_maker_finish(hardhat_maker_t *hhm) {
 		return false;
 	}
 
-	num = hhm->recnum;
-	hhm->superblock.data_end = hhm->off;
+	if(hhm->producers) {
+		hhm_set_error(hhm, "producers must be freed before the database is finished");
+		errno = EBUSY;
+		return false;
+	}
 
-	/* Sort the hashtable in directory order */
-	ht = hhm->hashtable;
-	size = order_to_size(ht->order);
-	entries = ht->entries;
-	qsort_r(entries, size, sizeof *entries, qsort_directory_cmp, hhm);
-	if(hhm->failed)
+	if(!hhm_start(hhm))
 		return false;
 
-	if(!hhm_db_pad(hhm, num * sizeof *dir, sizeof *dir))
+	db = &hhm->db;
+	num = hhm->recnum;
+
+	/* Entries that didn't fit in memory were sorted in runs */
+	if(hhm->runs.num)
+		return hhm_finish_external(hhm);
+
+	/* Map all records up front: the comparison functions may run in
+		several threads at once, so they must not move the window */
+	if(num && !hhm_db_map(hhm, hhm->records))
 		return false;
 
-	hhm->superblock.directory_start = hhm->off;
+	if(hhm->sorted) {
+		/* Everything is in directory order already */
+		if(!hhm_list_entries(hhm))
+			return false;
+		ht = hhm->hashtable;
+		size = num ? num : 1;
+		entries = ht->entries;
+	} else {
+		if(hhm->bulk && !hhm_list_entries(hhm))
+			return false;
 
-	/* Write out the directory using the sorted hashtable for ordering */
-	dir = hhm->recbuf;
-	for(i = 0; i < num; i++) {
-		he = entries + i;
+		/* Sort the hashtable in directory order */
+		ht = hhm->hashtable;
+		flattenhash(ht);
+		size = hhm->bulk ? (num ? num : 1) : order_to_size(ht->order);
+		entries = ht->entries;
+		if(!hhm_sort_directory(hhm, entries, size, num))
+			return false;
+	}
+
+	if(hhm->bulk || hhm->sorted) {
+		num = hhm_unique_entries(hhm, entries, num);
+		if(hhm->failed)
+			return false;
+	}
 
-		if(!hhm_db_append(hhm, dir + he->data, sizeof *dir))
+	if(hhm->base) {
+		if(!hhm_base_merge(hhm, &num, &size))
 			return false;
+		entries = ht->entries;
+	}
 
-		he->data = i;
+	if(hhm->autoparents) {
+		if(!hhm_finish_parents(hhm, &num, &size))
+			return false;
+		entries = ht->entries;
 	}
 
-	hhm->superblock.directory_end = hhm->off;
+	hhm->superblock.data_end = db->off;
 
-	if(!hhm_getrec(hhm, hhm->superblock.directory_end))
-		return false;
+	/* No more values will be added */
+	freehash(hhm->values);
+	hhm->values = NULL;
+	free(hhm->valuebuf);
+	hhm->valuebuf = NULL;
+
+	/* The records are about to be renumbered in directory order */
+	hhm_arena_free(hhm);
+
+	dir = hhm->recbuf;
+
+	if(hhm->superblock.version >= 4) {
+		if(!hhm_write_keys(hhm, entries, num))
+			return false;
+	} else {
+		if(!hhm_db_pad(hhm, db, num * sizeof *dir, sizeof *dir))
+			return false;
+
+		hhm->superblock.directory_start = db->off;
 
-	/* Read back the list of offsets as we wrote it out earlier */
-	memcpy(dir, hhm->window + hhm->superblock.directory_start, sizeof *dir * num);
+		/* Write out the directory using the sorted hashtable for ordering */
+		for(i = 0; i < num; i++) {
+			he = entries + i;
+
+			if(!hhm_db_append(hhm, db, dir + he->data, sizeof *dir))
+				return false;
+
+			he->data = i;
+		}
+
+		hhm->superblock.directory_end = db->off;
+
+		if(!hhm_db_map(hhm, db))
+			return false;
+
+		/* Read back the list of offsets as we wrote it out earlier */
+		memcpy(dir, db->window + hhm->superblock.directory_start, sizeof *dir * num);
+	}
 
 	/* Now sort the hashtable again, this time on hash value */
-	qsort_r(entries, num, sizeof *entries, qsort_hash_cmp, hhm);
+	sorthash(entries, num, qsort_hash_cmp, hhm);
 	if(hhm->failed)
 		return false;
 
-	if(!hhm_db_pad(hhm, num * sizeof *entries, sizeof *entries))
-		return false;
-
-	hhm->superblock.hash_start = hhm->off;
-
 	/* Write out the hashtable (which will serve as the primary
 		entry lookup table) */
-	if(!hhm_db_append(hhm, entries, num * sizeof *entries))
+	if(!hhm_write_hashes(hhm, entries, num, &hhm->superblock.hash_start, &hhm->superblock.hash_end))
 		return false;
 
-	hhm->superblock.hash_end = hhm->off;
-
 	/* Calculate the list of common prefixes, reusing the old hash
 		table as storage */
+	records = hhm->records->window;
 	prev = NULL;
 	prevlen = 0;
 	pfxnum = 0;
 	for(i = 0; i < num; i++) {
-		cur = hhm->window + dir[i];
+		cur = records + dir[i];
 		curlen = u16read(cur + 4);
 		cur += 6;
 
@@ -903,17 +5184,13 @@ export bool hardhat_maker_finish(hardhat_maker_t *hhm) {
 				size = size << 1;
 				entries = realloc(entries, size * sizeof *entries);
 				if(!entries) {
-					hhm->failed = true;
-					if(hhm->error != enomem) {
-						free(hhm->error);
-						hhm->error = enomem;
-					}
+					hhm_set_enomem(hhm);
 					return false;
 				}
 				ht->entries = entries;
 			}
 			he = entries + pfxnum++;
-			he->hash = calchash_murmur3(cur, endlen, hhm->superblock.hashseed);
+			he->hash = hhm_calchash(hhm, cur, endlen);
 			he->data = i;
 		}
 		prev = cur;
@@ -921,76 +5198,46 @@ export bool hardhat_maker_finish(hardhat_maker_t *hhm) {
 	}
 
 	/* Write out the prefix list as a hash table */
-	qsort_r(entries, pfxnum, sizeof *entries, qsort_hash_cmp, hhm);
+	sorthash(entries, pfxnum, qsort_hash_cmp, hhm);
 	if(hhm->failed)
 		return false;
 
-	if(!hhm_db_pad(hhm, pfxnum * sizeof *entries, sizeof *entries))
-		return false;
-
-	hhm->superblock.prefix_start = hhm->off;
-
-	if(!hhm_db_append(hhm, entries, pfxnum * sizeof *entries))
-		return false;
-
-	hhm->superblock.prefix_end = hhm->off;
-
-	/* Create and write out the superblock */
-	memcpy(hhm->superblock.magic, HARDHAT_MAGIC, sizeof hhm->superblock.magic);
-	hhm->superblock.byteorder = UINT64_C(0x0123456789ABCDEF);
-	hhm->superblock.version = UINT32_C(3);
-	hhm->superblock.entries = num;
-	hhm->superblock.prefixes = pfxnum;
-	hhm->superblock.filesize = hhm->off;
-	hhm->superblock.checksum = calchash_murmur3((const void *)&hhm->superblock, sizeof hhm->superblock - 4, hhm->superblock.hashseed);
-
-	if(!hhm_db_seek(hhm, 0, SEEK_SET))
-		return false;
-
-	if(!hhm_db_write(hhm, &hhm->superblock, sizeof hhm->superblock))
-		return false;
-
-	if(!hhm_db_flush(hhm))
-		return false;
-
-	fd = hhm->fd;
-	if(ftruncate(fd, (off_t)hhm->off) == -1) {
-		hhm_set_error(hhm, "truncating %s failed: %m", hhm->filename);
-		hhm->failed = true;
+	if(!hhm_write_hashes(hhm, entries, pfxnum, &hhm->superblock.prefix_start, &hhm->superblock.prefix_end))
 		return false;
-	}
-
-	if(fdatasync(fd) == -1) {
-		hhm_set_error(hhm, "writing %s failed: %m", hhm->filename);
-		hhm->failed = true;
-		return false;
-	}
-
-	hhm->fd = -1;
-	if(close(fd) == -1) {
-		hhm_set_error(hhm, "closing %s failed: %m", hhm->filename);
-		hhm->failed = true;
-		return false;
-	}
-
-	hhm->finished = true;
 
-	return true;
+	return hhm_finish_header(hhm, num, pfxnum);
 }
 
 /* Free a hardhat_maker_t struct and all it contains */
 export void hardhat_maker_free(hardhat_maker_t *hhm) {
 	if(!hhm)
 		return;
-	if(hhm->fd != -1)
-		close(hhm->fd);
+	hhm_db_close(&hhm->db);
+	/* An unfinished database that never got its real name */
+	if(*hhm->tmpname)
+		unlinkat(hhm->dirfd, hhm->tmpname, 0);
+	hhm_db_close(&hhm->keys);
+	hhm_db_close(&hhm->spill);
+	free(hhm->runs.runs);
+	if(hhm->dirfd != -1)
+		close(hhm->dirfd);
 	freehash(hhm->hashtable);
+	freehash(hhm->values);
+	free(hhm->valuebuf);
 	free(hhm->keybuf);
+	free(hhm->lastkey);
 	free(hhm->recbuf);
-	free(hhm->outbuf);
+	hhm_arena_free(hhm);
 	free(hhm->filename);
-	if(hhm->window != MAP_FAILED)
-		munmap(hhm->window, hhm->windowsize);
+	hhm_shards_free(hhm);
+	pthread_mutex_destroy(&hhm->lock);
+	hardhat_close(hhm->base);
+	if(hhm->basefd != -1)
+		close(hhm->basefd);
+	free(hhm->basekeybuf);
+	free(hhm->deleted);
+	free(hhm->batchbuf);
+	free(hhm->parentdata);
 	if(hhm->error != enomem)
 		free(hhm->error);
 	*hhm = hardhat_maker_0;
@@ -25,7 +25,10 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "reader.h"
+
 typedef struct hardhat_maker hardhat_maker_t;
+typedef struct hardhat_producer hardhat_producer_t;
 
 /*	Retrieve the last error that occurred in the context of
 	this hardhat_maker_t structure.
@@ -39,6 +42,9 @@ extern const char *hardhat_maker_error(hardhat_maker_t *hhm);
 extern bool hardhat_maker_fatal(hardhat_maker_t *hhm);
 
 /*	Allocate and initialize a new hardhat_maker_t control structure.
+	The database file is only created (or opened) once output starts, that
+	is, when the first entry is added or the database is finished. Whether
+	that will be possible is checked right away, though.
 	Returns NULL (and sets errno) on error. */
 extern hardhat_maker_t *hardhat_maker_new(const char *filename);
 extern hardhat_maker_t *hardhat_maker_newat(int dirfd, const char *filename, int mode);
@@ -63,10 +69,197 @@ extern uint64_t hardhat_maker_alignment(hardhat_maker_t *hhm, uint64_t alignment
 extern uint64_t hardhat_maker_blocksize(hardhat_maker_t *hhm, uint64_t blocksize);
 #define HAVE_HARDHAT_MAKER_BLOCKSIZE
 
+/*	Configure the version of the database format to write.
+	Returns the previous version or 0 on error.
+	Supply a value of 0 to query the current version.
+	Version 3 is the default. Version 4 stores the keys front-coded,
+	separately from the values, which makes the database smaller and
+	listings faster but needs a scratch file next to the database while
+	it is being created. Version 5 is version 4 with a faster hash
+	function. Version 6 is version 5 with 64-bit entry counts and indexes,
+	for databases of more than 2^32 entries (which only
+	hardhat_maker_memory() can create). None of these can be read by older
+	versions of this library. */
+extern uint32_t hardhat_maker_version(hardhat_maker_t *hhm, uint32_t version);
+#define HAVE_HARDHAT_MAKER_VERSION
+
+/*	Store values that are identical to a previously added value only once,
+	letting the entries share it. Only supported for databases of version
+	4 and later. Must be configured before entries are added.
+	Returns false on error. */
+extern bool hardhat_maker_deduplicate(hardhat_maker_t *hhm, bool dedup);
+#define HAVE_HARDHAT_MAKER_DEDUPLICATE
+
+/*	Don't check for duplicate keys while adding entries, but remove them
+	all at once when the database is finished. Use this when duplicates are
+	rare or impossible: the first entry added still wins, but the space
+	taken up by the others is not reclaimed. Must be configured before
+	entries are added. Returns false on error. */
+extern bool hardhat_maker_bulk(hardhat_maker_t *hhm, bool bulk);
+#define HAVE_HARDHAT_MAKER_BULK
+
+/*	Keep copies of the keys in memory, using at most the given number of
+	bytes, so that checking for duplicates and sorting don't need to read
+	them back from disk. Keys that don't fit are read back as usual.
+	A budget of 0 (the default) disables this. Must be configured before
+	entries are added. Returns false on error. */
+extern bool hardhat_maker_arena(hardhat_maker_t *hhm, uint64_t budget);
+#define HAVE_HARDHAT_MAKER_ARENA
+
+/*	Limit the memory used to keep track of the entries to roughly the
+	given number of bytes, so that databases with more entries than fit in
+	memory can be created. Entries are sorted in runs that are kept in a
+	temporary file and merged when the database is finished. Implies bulk
+	mode (see hardhat_maker_bulk()). Can't be combined with a base database
+	or with hardhat_maker_parents(), but hardhat_maker_autoparents() works.
+	With version 6, the number of entries is not limited to 2^32.
+	A budget of 0 (the default) keeps everything in memory. Must be
+	configured before entries are added. Returns false on error. */
+extern bool hardhat_maker_memory(hardhat_maker_t *hhm, uint64_t budget);
+#define HAVE_HARDHAT_MAKER_MEMORY
+
+/*	Start from an existing database (version 3 or later, in native byte
+	order): all its entries are included, except those that are added
+	again (the new entry replaces the old one) or deleted with
+	hardhat_maker_delete(). Its data section is copied as a whole, using
+	copy_file_range() where available, so only the keys and indexes are
+	processed one by one. This includes the data of entries that are
+	replaced or deleted, so the data section only grows with every update;
+	see hardhat_maker_dead() to tell when it's time to rebuild the database
+	without a base, for example with hardhat_maker_merge(), which copies
+	only the entries. The version, alignment and block size are taken
+	from the base database; the version can then only be changed to one
+	with the same data section layout (4 and 5). Must be configured before
+	entries are added. Returns false on error. */
+extern bool hardhat_maker_base(hardhat_maker_t *hhm, const char *filename);
+extern bool hardhat_maker_baseat(hardhat_maker_t *hhm, int dirfd, const char *filename);
+#define HAVE_HARDHAT_MAKER_BASE
+
+/*	Leave an entry of the base database out. Has no effect on entries that
+	are added to the maker. The space taken up by deleted entries is not
+	reclaimed (see hardhat_maker_dead()). Returns false on error. */
+extern bool hardhat_maker_delete(hardhat_maker_t *hhm, const void *key, uint16_t keylen);
+#define HAVE_HARDHAT_MAKER_DELETE
+
+/*	After hardhat_maker_finish(), the number of bytes in the data section
+	of a database with a base that no entry uses: the data of replaced and
+	deleted entries (also from earlier updates) and padding. Values that
+	are shared by several entries are counted once for each of them, so
+	this may be an underestimate. Returns 0 without a base database. */
+extern uint64_t hardhat_maker_dead(hardhat_maker_t *hhm);
+#define HAVE_HARDHAT_MAKER_DEAD
+
+/*	Configure the number of threads used to sort the directory when the
+	database is finished. The result does not depend on this setting.
+	Returns the previous number or 0 on error.
+	Supply a value of 0 to query the current number of threads. */
+extern unsigned int hardhat_maker_threads(hardhat_maker_t *hhm, unsigned int threads);
+#define HAVE_HARDHAT_MAKER_THREADS
+
+/*	Use the given seed for the hash functions instead of a random one, so
+	that the same entries always give the same database, byte for byte.
+	Must be configured before entries are added. Returns false on error. */
+extern bool hardhat_maker_hashseed(hardhat_maker_t *hhm, uint32_t seed);
+#define HAVE_HARDHAT_MAKER_HASHSEED
+
+/*	Write the database from the given number of background threads, using
+	large output buffers, so that adding entries doesn't have to wait for
+	the disk. Writeback of each buffer is started as soon as it is written,
+	so that little is left to do when the database is synced at the end.
+	0 (the default) writes everything from the calling thread. Must be
+	configured before entries are added. Returns false on error. */
+extern bool hardhat_maker_writers(hardhat_maker_t *hhm, unsigned int writers);
+#define HAVE_HARDHAT_MAKER_WRITERS
+
+/*	Write the database and its scratch file through shared writable
+	mappings, which are also used to read back what was written, instead
+	of through write(). The files are grown in large steps as needed and
+	trimmed when the database is finished. Background writers are not
+	used in this mode. Must be configured before entries are added.
+	Returns false on error. */
+extern bool hardhat_maker_mapped(hardhat_maker_t *hhm, bool mapped);
+#define HAVE_HARDHAT_MAKER_MAPPED
+
+/*	Check for duplicate keys with a hash table that compares a control
+	byte per slot for 16 slots at a time, and that grows by moving the
+	entries over to a table twice the size a few at a time while entries
+	are added, instead of all at once. That way adding an entry never
+	stalls for long, even with hundreds of millions of entries, but adding
+	is a little slower overall. Must be configured before entries are
+	added. Returns false on error. */
+extern bool hardhat_maker_grouphash(hardhat_maker_t *hhm, bool grouphash);
+#define HAVE_HARDHAT_MAKER_GROUPHASH
+
+/*	Build the database in a new file in the same directory that has no
+	name (O_TMPFILE) or a hidden one, and only link it into place,
+	replacing any existing file by that name, after hardhat_maker_finish()
+	has written and synced it. Readers never see a partially written
+	database: they get the old one until the new one is complete. The
+	replaced file's permissions and hard links are not carried over. This
+	also makes it possible to use the database itself as the base (see
+	hardhat_maker_base()) or as an input of hardhat_maker_merge(), which
+	is refused otherwise. Must be configured before entries are added.
+	Returns false on error. */
+extern bool hardhat_maker_atomic(hardhat_maker_t *hhm, bool atomic);
+#define HAVE_HARDHAT_MAKER_ATOMIC
+
 /*	Add an entry. Will silently ignore attempts to add duplicate keys
-	(and even return true). Returns false on error. */
+	(and even return true). Returns false on error.
+	Adding entries in hardhat_cmp() order is considerably faster: as long
+	as they arrive in that order, no hash table or sorting is needed. */
 extern bool hardhat_maker_add(hardhat_maker_t *hhm, const void *key, uint16_t keylen, const void *data, uint32_t datalen);
 
+/*	Like hardhat_maker_add(), but the value is the given range of a file,
+	which is copied with copy_file_range() where available: it doesn't pass
+	through user space and filesystems that support it can share the blocks
+	instead of copying them. To make that possible, values of at least a
+	block (see hardhat_maker_blocksize()) that start at a block boundary in
+	the file are stored at a block boundary too, in databases of version 4
+	and later. With deduplication, the
+	value is read into memory to compare it with the others.
+	Returns false on error. */
+extern bool hardhat_maker_add_fd(hardhat_maker_t *hhm, const void *key, uint16_t keylen, int fd, uint64_t offset, uint32_t datalen);
+#define HAVE_HARDHAT_MAKER_ADD_FD
+
+/*	Add num entries, given as arrays of keys, values and their lengths.
+	Does the same as calling hardhat_maker_add() for each of them, but
+	with less overhead per entry. If an entry can't be added, the ones
+	before it are still added. Returns false on error. */
+extern bool hardhat_maker_add_batch(hardhat_maker_t *hhm, const void *const *keys, const uint16_t *keylens, const void *const *data, const uint32_t *datalens, size_t num);
+#define HAVE_HARDHAT_MAKER_ADD_BATCH
+
+/*	Create a producer, which adds entries to the maker from another thread.
+	Each thread should use its own producer. Producers check keys for
+	duplicates in tables that are split into shards with a lock each, and
+	write their entries to ranges of the file that they reserve for
+	themselves, so any number of them can be used at the same time. Other
+	functions of the maker must not be called while any producer exists.
+	Producers can't be combined with deduplication of values or a memory
+	budget. Returns NULL (and sets errno) on error. */
+extern hardhat_producer_t *hardhat_producer_new(hardhat_maker_t *hhm);
+#define HAVE_HARDHAT_PRODUCER
+
+/*	Add an entry through a producer. The entry may stay in the producer's
+	buffer until it is flushed. Returns false on error. */
+extern bool hardhat_producer_add(hardhat_producer_t *hhp, const void *key, uint16_t keylen, const void *data, uint32_t datalen);
+
+/*	Write out all buffered entries. Returns false on error. */
+extern bool hardhat_producer_flush(hardhat_producer_t *hhp);
+
+/*	Flush and free the producer, and hand its entries to the maker. Errors
+	are reported by hardhat_maker_finish(), which can only be called once
+	all producers are freed. */
+extern void hardhat_producer_free(hardhat_producer_t *hhp);
+
+/*	Add all entries of one or more existing databases. When several
+	inputs have an entry with the same key, the one from the earliest
+	input is used (and if the key was added to the maker before, that entry
+	is kept). The inputs are read in directory order, so this is much faster
+	than adding their entries one by one in any other order.
+	Returns false on error. */
+extern bool hardhat_maker_merge(hardhat_maker_t *hhm, hardhat_t *const *inputs, size_t num);
+#define HAVE_HARDHAT_MAKER_MERGE
+
 /*	Fills in missing parent nodes. For example, if you would just add the following keys:
 
 	foo
@@ -78,6 +271,14 @@ extern bool hardhat_maker_add(hardhat_maker_t *hhm, const void *key, uint16_t ke
 	empty string). Returns false on error. */
 extern bool hardhat_maker_parents(hardhat_maker_t *hhm, const void *data, uint32_t datalen);
 
+/*	Like hardhat_maker_parents(), but the parents are added by
+	hardhat_maker_finish(), for all entries including those that are added
+	after calling this function. The missing parents are found in a single
+	pass over the sorted entries, which is much faster.
+	Returns false on error. */
+extern bool hardhat_maker_autoparents(hardhat_maker_t *hhm, const void *data, uint32_t datalen);
+#define HAVE_HARDHAT_MAKER_AUTOPARENTS
+
 /*	Create the indexes, write and flush everything to disk. Returns false on
 	error. After calling this function, no entries can be added. */
 extern bool hardhat_maker_finish(hardhat_maker_t *hhm);
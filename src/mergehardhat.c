@@ -0,0 +1,123 @@
+/******************************************************************************
+
+	hardhat - read and write databases optimized for filename-like keys
+	Copyright (c) 2011-2016 Wessel Dankers <wsl@fruit.je>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "reader.h"
+#include "maker.h"
+
+/******************************************************************************
+
+	Simple tool that merges one or more hardhat databases into a new one.
+	If a key occurs in more than one input, the entry from the first of
+	those inputs is used. The output replaces an existing file only once it
+	is complete, so it can also be one of the inputs.
+
+	Options:
+
+		-v version	database format version to write
+		-d		store identical values only once (implies -v 4)
+		-l		let later inputs take precedence instead
+
+******************************************************************************/
+
+static void usage(const char *progname) {
+	fprintf(stderr, "Usage: %s [-v version] [-d] [-l] output.db input.db [input.db...]\n", progname);
+	exit(2);
+}
+
+int main(int argc, char **argv) {
+	int i, c, num;
+	hardhat_t **inputs, *hh;
+	hardhat_maker_t *hhm;
+	char *end;
+	unsigned long version = 0;
+	bool dedup = false, last = false;
+
+	while((c = getopt(argc, argv, "v:dl")) != EOF) {
+		switch(c) {
+			case 'v':
+				version = strtoul(optarg, &end, 10);
+				if(!*optarg || *end || !version || version > UINT32_MAX) {
+					fprintf(stderr, "%s: invalid version '%s'\n", argv[0], optarg);
+					exit(2);
+				}
+				break;
+			case 'd':
+				dedup = true;
+				break;
+			case 'l':
+				last = true;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(argc - optind < 2)
+		usage(argv[0]);
+
+	if(dedup && !version)
+		version = 4;
+
+	num = argc - optind - 1;
+	inputs = malloc((size_t)num * sizeof *inputs);
+	if(!inputs) {
+		perror("malloc()");
+		exit(2);
+	}
+
+	for(i = 0; i < num; i++) {
+		hh = hardhat_open(argv[optind + 1 + i]);
+		if(!hh) {
+			perror(argv[optind + 1 + i]);
+			exit(2);
+		}
+		inputs[last ? num - 1 - i : i] = hh;
+	}
+
+	hhm = hardhat_maker_new(argv[optind]);
+	if(!hhm) {
+		perror(argv[optind]);
+		exit(2);
+	}
+
+	if(!hardhat_maker_atomic(hhm, true)
+			|| (version && !hardhat_maker_version(hhm, (uint32_t)version))
+			|| (dedup && !hardhat_maker_deduplicate(hhm, true))
+			|| !hardhat_maker_merge(hhm, inputs, (size_t)num)
+			|| !hardhat_maker_finish(hhm)) {
+		fprintf(stderr, "%s: %s\n", argv[optind], hardhat_maker_error(hhm));
+		exit(2);
+	}
+
+	hardhat_maker_free(hhm);
+
+	for(i = 0; i < num; i++)
+		hardhat_close(inputs[i]);
+	free(inputs);
+
+	return 0;
+}
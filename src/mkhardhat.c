@@ -22,6 +22,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -44,6 +45,22 @@
 	Line breaks must be a single \n. The file must end with an empty line
 	(i.e., an extra \n). The keys and values are binary safe.
 
+	Options:
+
+		-v version	database format version to write
+		-d		store identical values only once (implies -v 4)
+		-b		check for duplicate keys only at the end
+		-g		use a hash table that grows a little at a time
+		-j threads	number of threads to use for sorting
+		-w writers	number of threads to write the output in the background
+		-M		write the output through shared mappings
+		-m megabytes	memory to use for keeping keys in memory
+		-e megabytes	memory budget, beyond which entries are sorted in runs on disk
+		-a		replace the output file atomically once it is complete
+		-i base.db	include the entries of an existing database, whose data
+				section is copied as is, including the data of replaced
+				and deleted entries; "mergehardhat out.db out.db" drops it
+
 ******************************************************************************/
 
 static bool errors = false;
@@ -129,23 +146,108 @@ static uint64_t readnumber(FILE *fh, const char *name, int end) {
 	return n;
 }
 
+static void usage(const char *progname) {
+	fprintf(stderr, "Usage: %s [-v version] [-d] [-b] [-g] [-j threads] [-w writers] [-M] [-m megabytes] [-e megabytes] [-a] [-i base.db] output.db input.txt [input...]\n", progname);
+	exit(2);
+}
+
 int main(int argc, char **argv) {
 	int i, c;
 	FILE *fh;
 	hardhat_maker_t *hhm;
-	char *keybuf, *databuf;
+	char *keybuf, *databuf, *end;
 	size_t databufsize = 1048576;
 	uint64_t keysize, datasize;
+	unsigned long version = 0, threads = 0, writers = 0;
+	unsigned long long arena = 0, budget = 0;
+	const char *base = NULL;
+	bool dedup = false, bulk = false, grouphash = false, mapped = false, atomic = false;
 	uint32_t line;
 
-	if(argc < 3) {
-		fprintf(stderr, "Usage: %s output.db input.txt [input...]\n", argv[0]);
-		exit(2);
+	while((c = getopt(argc, argv, "v:dbgj:w:Mm:e:ai:")) != EOF) {
+		switch(c) {
+			case 'v':
+				version = strtoul(optarg, &end, 10);
+				if(!*optarg || *end || !version || version > UINT32_MAX) {
+					fprintf(stderr, "%s: invalid version '%s'\n", argv[0], optarg);
+					exit(2);
+				}
+				break;
+			case 'd':
+				dedup = true;
+				break;
+			case 'b':
+				bulk = true;
+				break;
+			case 'g':
+				grouphash = true;
+				break;
+			case 'j':
+				threads = strtoul(optarg, &end, 10);
+				if(!*optarg || *end || !threads || threads > UINT_MAX) {
+					fprintf(stderr, "%s: invalid number of threads '%s'\n", argv[0], optarg);
+					exit(2);
+				}
+				break;
+			case 'w':
+				writers = strtoul(optarg, &end, 10);
+				if(!*optarg || *end || writers > UINT_MAX) {
+					fprintf(stderr, "%s: invalid number of writers '%s'\n", argv[0], optarg);
+					exit(2);
+				}
+				break;
+			case 'M':
+				mapped = true;
+				break;
+			case 'm':
+				arena = strtoull(optarg, &end, 10);
+				if(!*optarg || *end || arena > UINT64_MAX >> 20) {
+					fprintf(stderr, "%s: invalid amount of memory '%s'\n", argv[0], optarg);
+					exit(2);
+				}
+				break;
+			case 'e':
+				budget = strtoull(optarg, &end, 10);
+				if(!*optarg || *end || !budget || budget > UINT64_MAX >> 20) {
+					fprintf(stderr, "%s: invalid amount of memory '%s'\n", argv[0], optarg);
+					exit(2);
+				}
+				break;
+			case 'a':
+				atomic = true;
+				break;
+			case 'i':
+				base = optarg;
+				break;
+			default:
+				usage(argv[0]);
+		}
 	}
 
-	hhm = hardhat_maker_new(argv[1]);
+	if(argc - optind < 2)
+		usage(argv[0]);
+
+	if(dedup && !version)
+		version = 4;
+
+	hhm = hardhat_maker_new(argv[optind]);
 	if(!hhm) {
-		perror(argv[1]);
+		perror(argv[optind]);
+		exit(2);
+	}
+
+	if((base && !hardhat_maker_base(hhm, base))
+			|| (version && !hardhat_maker_version(hhm, (uint32_t)version))
+			|| (dedup && !hardhat_maker_deduplicate(hhm, true))
+			|| (bulk && !hardhat_maker_bulk(hhm, true))
+			|| (grouphash && !hardhat_maker_grouphash(hhm, true))
+			|| (threads && !hardhat_maker_threads(hhm, (unsigned int)threads))
+			|| (mapped && !hardhat_maker_mapped(hhm, true))
+			|| (atomic && !hardhat_maker_atomic(hhm, true))
+			|| (writers && !hardhat_maker_writers(hhm, (unsigned int)writers))
+			|| (arena && !hardhat_maker_arena(hhm, (uint64_t)arena << 20))
+			|| (budget && !hardhat_maker_memory(hhm, (uint64_t)budget << 20))) {
+		fprintf(stderr, "%s: %s\n", argv[optind], hardhat_maker_error(hhm));
 		exit(2);
 	}
 
@@ -161,7 +263,7 @@ int main(int argc, char **argv) {
 		exit(2);
 	}
 
-	for(i = 2; i < argc; i++) {
+	for(i = optind + 1; i < argc; i++) {
 		fh = fopen(argv[i], "r");
 		if(!fh) {
 			perror(argv[i]);
@@ -226,7 +328,7 @@ int main(int argc, char **argv) {
 		fclose(fh);
 	}
 
-	if(!hardhat_maker_parents(hhm, "", 0) || !hardhat_maker_finish(hhm)) {
+	if(!hardhat_maker_autoparents(hhm, "", 0) || !hardhat_maker_finish(hhm)) {
 		fprintf(stderr, "%s\n", hardhat_maker_error(hhm));
 		if(hardhat_maker_fatal(hhm))
 			exit(2);
@@ -0,0 +1,242 @@
+/******************************************************************************
+
+	hardhat - read and write databases optimized for filename-like keys
+	Copyright (c) 2011-2016 Wessel Dankers <wsl@fruit.je>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+******************************************************************************/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "psort.h"
+
+/******************************************************************************
+
+	Parallel merge sort. The array is cut into one chunk per thread and
+	each chunk is sorted with qsort_r() in its own thread. The sorted runs
+	are then merged pairwise, bouncing between the array and a scratch
+	buffer of the same size, until a single run remains.
+
+	Merging two runs is split up as well: the output is cut into equal
+	parts and for each cut the number of elements that come from the left
+	run is found with a binary search (the "co-rank"). Each part is then
+	merged independently, so all threads keep busy until the last round.
+
+******************************************************************************/
+
+#ifndef HAVE_QSORT_R
+extern void qsort_r(void *, size_t, size_t, int (*)(const void *, const void *, void *), void *);
+#endif
+
+/* Below this many elements per thread, threads aren't worth the bother */
+#define PSORT_MIN_CHUNK ((size_t)16384)
+
+typedef int (*psort_cmp_t)(const void *, const void *, void *);
+
+struct psort {
+	size_t size;
+	psort_cmp_t compar;
+	void *arg;
+};
+
+/* A unit of work: sort a in place if out is NULL,
+	otherwise merge a and b into out */
+struct psort_task {
+	const struct psort *ps;
+	char *a, *b, *out;
+	size_t an, bn;
+	pthread_t thread;
+	bool started;
+};
+
+static void psort_merge(const struct psort *ps, const char *a, size_t an, const char *b, size_t bn, char *out) {
+	size_t size = ps->size;
+
+	while(an && bn) {
+		/* take from the left run on ties */
+		if(ps->compar(a, b, ps->arg) <= 0) {
+			memcpy(out, a, size);
+			a += size;
+			an--;
+		} else {
+			memcpy(out, b, size);
+			b += size;
+			bn--;
+		}
+		out += size;
+	}
+
+	memcpy(out, a, an * size);
+	out += an * size;
+	memcpy(out, b, bn * size);
+}
+
+/* Find how many of the first k elements of the merge of a and b come from a */
+static size_t psort_corank(const struct psort *ps, size_t k, const char *a, size_t an, const char *b, size_t bn) {
+	size_t lo, hi, i;
+
+	lo = k > bn ? k - bn : 0;
+	hi = k < an ? k : an;
+
+	while(lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if(ps->compar(b + (k - i - 1) * ps->size, a + i * ps->size, ps->arg) < 0)
+			hi = i;
+		else
+			lo = i + 1;
+	}
+
+	return lo;
+}
+
+static void *psort_task_run(void *arg) {
+	struct psort_task *task = arg;
+	const struct psort *ps = task->ps;
+
+	if(task->out)
+		psort_merge(ps, task->a, task->an, task->b, task->bn, task->out);
+	else
+		qsort_r(task->a, task->an, ps->size, ps->compar, ps->arg);
+
+	return NULL;
+}
+
+/* Run all tasks, one thread each. The last one runs in the calling
+	thread, as does any task for which no thread could be started. */
+static void psort_tasks_run(struct psort_task *tasks, size_t num) {
+	size_t u;
+
+	for(u = 0; u + 1 < num; u++) {
+		tasks[u].started = !pthread_create(&tasks[u].thread, NULL, psort_task_run, tasks + u);
+		if(!tasks[u].started)
+			psort_task_run(tasks + u);
+	}
+
+	if(num)
+		psort_task_run(tasks + num - 1);
+
+	for(u = 0; u + 1 < num; u++)
+		if(tasks[u].started)
+			pthread_join(tasks[u].thread, NULL);
+}
+
+void psort_r(void *base, size_t nmemb, size_t size, psort_cmp_t compar, void *arg, unsigned int threads) {
+	struct psort ps = {size, compar, arg};
+	struct psort_task *tasks;
+	size_t *bounds, chunks, runs, pairs, parts, num, p, q, r, k, s, e, m, n, i, prev;
+	char *src, *dst, *tmp;
+
+	chunks = nmemb / PSORT_MIN_CHUNK;
+	if(chunks > threads)
+		chunks = threads;
+
+	if(chunks < 2) {
+		qsort_r(base, nmemb, size, compar, arg);
+		return;
+	}
+
+	tmp = malloc(nmemb * size);
+	bounds = malloc((chunks + 1) * sizeof *bounds);
+	/* one task per chunk, plus one for an odd run out */
+	tasks = malloc((chunks + 1) * sizeof *tasks);
+	if(!tmp || !bounds || !tasks) {
+		free(tmp);
+		free(bounds);
+		free(tasks);
+		qsort_r(base, nmemb, size, compar, arg);
+		return;
+	}
+
+	/* Sort each chunk */
+	for(r = 0; r <= chunks; r++)
+		bounds[r] = nmemb * r / chunks;
+
+	for(r = 0; r < chunks; r++)
+		tasks[r] = (struct psort_task){
+			.ps = &ps,
+			.a = (char *)base + bounds[r] * size,
+			.an = bounds[r + 1] - bounds[r],
+		};
+
+	psort_tasks_run(tasks, chunks);
+
+	/* Merge pairs of runs until only one is left */
+	src = base;
+	dst = tmp;
+	for(runs = chunks; runs > 1; runs = (runs + 1) / 2) {
+		pairs = runs / 2;
+		parts = chunks / pairs;
+
+		num = 0;
+		for(p = 0; p < pairs; p++) {
+			s = bounds[2 * p];
+			m = bounds[2 * p + 1] - s;
+			n = bounds[2 * p + 2] - bounds[2 * p + 1];
+			prev = 0;
+			for(q = 1; q <= parts; q++) {
+				k = (m + n) * q / parts;
+				i = q == parts ? m : psort_corank(&ps, k, src + s * size, m, src + (s + m) * size, n);
+				e = (m + n) * (q - 1) / parts;
+				tasks[num++] = (struct psort_task){
+					.ps = &ps,
+					.a = src + (s + prev) * size,
+					.an = i - prev,
+					.b = src + (s + m + e - prev) * size,
+					.bn = k - e - (i - prev),
+					.out = dst + (s + e) * size,
+				};
+				prev = i;
+			}
+		}
+
+		/* An odd run out is copied over as is */
+		if(runs & 1) {
+			s = bounds[runs - 1];
+			tasks[num++] = (struct psort_task){
+				.ps = &ps,
+				.a = src + s * size,
+				.an = bounds[runs] - s,
+				.b = src + bounds[runs] * size,
+				.out = dst + s * size,
+			};
+		}
+
+		psort_tasks_run(tasks, num);
+
+		for(r = 0; r <= pairs; r++)
+			bounds[r] = bounds[2 * r];
+		if(runs & 1)
+			bounds[pairs + 1] = bounds[runs];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	if(src != base) {
+		memcpy(base, src, nmemb * size);
+		tmp = src;
+	} else {
+		tmp = dst;
+	}
+
+	free(tmp);
+	free(bounds);
+	free(tasks);
+}
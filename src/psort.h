@@ -0,0 +1,35 @@
+/******************************************************************************
+
+	hardhat - read and write databases optimized for filename-like keys
+	Copyright (c) 2011-2016 Wessel Dankers <wsl@fruit.je>
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 2 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program. If not, see <http://www.gnu.org/licenses/>.
+
+******************************************************************************/
+
+#ifndef HARDHAT_PSORT_H
+#define HARDHAT_PSORT_H
+
+#include <stddef.h>
+
+/*	Sort like qsort_r(), using up to the given number of threads. The
+	comparison function must be safe to call from several threads at once.
+	Elements that compare equal may end up in any order, just as with
+	qsort_r(). Falls back to a plain qsort_r() for small arrays or if
+	threads or memory can't be had. */
+extern void psort_r(void *base, size_t nmemb, size_t size,
+	int (*compar)(const void *, const void *, void *), void *arg,
+	unsigned int threads);
+
+#endif
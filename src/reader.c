@@ -34,6 +34,7 @@
 #include "maker.h"
 #include "hashtable.h"
 #include "layout.h"
+#include "lookup.h"
 #include "reader.h"
 #include "murmur3.h"
 
@@ -43,9 +44,9 @@
 
 #define export __attribute__((visibility("default")))
 
-#define CURSOR_NONE (UINT32_MAX)
+#define CURSOR_NONE (UINT64_MAX)
 
-static const hardhat_cursor_t hardhat_cursor_0 = {.cur = CURSOR_NONE};
+static const hardhat_cursor_t hardhat_cursor_0 = {.cur = CURSOR_NONE, .keycur = CURSOR_NONE};
 
 static int sectioncmp(const void *ap, const void *bp) {
 	uint64_t a = *(const uint64_t *)ap;
@@ -53,6 +54,42 @@ static int sectioncmp(const void *ap, const void *bp) {
 	return a < b ? -1 : a != b;
 }
 
+/* Decode a varint (LEB128) at *pos, without reading past end */
+static inline bool hhc_varint(const uint8_t *buf, uint64_t *pos, uint64_t end, uint64_t *value) {
+	uint64_t p = *pos, v = 0;
+	unsigned int shift;
+	uint8_t b;
+
+	for(shift = 0; shift < 64; shift += 7) {
+		if(p >= end)
+			return false;
+		b = buf[p++];
+		v |= (uint64_t)(b & 0x7F) << shift;
+		if(!(b & 0x80)) {
+			*pos = p;
+			*value = v;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/* Guess where hash lies in a hash table section from lower to upper,
+	assuming hashes are spread evenly between lower_hash and upper_hash.
+	Computes lower + (hash - lower_hash) * (upper - lower) / (upper_hash -
+	lower_hash + 1) without overflowing, for sections of any size. */
+static inline uint64_t hhc_interpolate(uint64_t lower, uint64_t upper, uint32_t hash, uint32_t lower_hash, uint32_t upper_hash) {
+	uint64_t range = upper - lower;
+	uint64_t offset = hash - lower_hash;
+	uint64_t span = (uint64_t)(upper_hash - lower_hash) + UINT64_C(1);
+
+	if(range <= UINT32_MAX)
+		return lower + offset * range / span;
+
+	return lower + offset * (range / span) + offset * (range % span) / span;
+}
+
 /* We handle endianness by compiling readerimpl.h twice: first
 ** as "native endian" and then as "other endian". */
 
@@ -197,16 +234,30 @@ export void hardhat_close(hardhat_t *hardhat) {
 
 export hardhat_cursor_t *hardhat_cursor(hardhat_t *hardhat, const void *prefix, uint16_t prefixlen) {
 	hardhat_cursor_t *c;
+	uint32_t version;
+	size_t keybufsize;
 
 	if(!hardhat) {
 		errno = EINVAL;
 		return NULL;
 	}
 
-	c = malloc(sizeof *c + prefixlen);
+	version = hardhat->byteorder == UINT64_C(0x0123456789ABCDEF)
+		? hardhat->version
+		: u32(hardhat->version);
+
+	/* front-coded keys are decoded into a buffer after the prefix, just
+		large enough for the longest key */
+	keybufsize = hardhat->byteorder == UINT64_C(0x0123456789ABCDEF)
+		? hhc_keybufsize_ne(hardhat)
+		: hhc_keybufsize_oe(hardhat);
+
+	c = malloc(sizeof *c + prefixlen + keybufsize);
 	if(!c)
 		return NULL;
 	*c = hardhat_cursor_0;
+	if(version >= UINT32_C(4))
+		c->keybuf = (uint8_t *)c + sizeof *c + prefixlen;
 
 	c->prefixlen = prefixlen = (uint16_t)hardhat_normalize(c->prefix, prefix, prefixlen);
 	c->hardhat = hardhat;
@@ -223,6 +274,17 @@ export hardhat_cursor_t *hardhat_cursor(hardhat_t *hardhat, const void *prefix,
 	return c;
 }
 
+bool hardhat_has(const struct hardhat *hardhat, const void *key, uint16_t keylen, uint8_t *keybuf) {
+	hardhat_cursor_t lookup = hardhat_cursor_0;
+
+	lookup.hardhat = hardhat;
+	lookup.keybuf = keybuf;
+
+	return hardhat->byteorder == UINT64_C(0x0123456789ABCDEF)
+		? hhc_hash_lookup_ne(&lookup, key, keylen)
+		: hhc_hash_lookup_oe(&lookup, key, keylen);
+}
+
 export void hardhat_cursor_free(hardhat_cursor_t *c) {
 	free(c);
 }
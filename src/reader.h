@@ -36,13 +36,15 @@ typedef const struct hardhat hardhat_t;
 typedef struct hardhat_cursor {
 	/* Pointer to hardhat handle. */
 	hardhat_t *hardhat;
-	/* Pointer to key value, not \0 terminated. */
+	/* Pointer to key value, not \0 terminated. For version 4 databases
+	   this points into a buffer inside the cursor that is overwritten by
+	   the next hardhat_fetch(). */
 	const void *key;
 	/* Pointer to data value, not \0 terminated. */
 	const void *data;
 	/* Unique identifier for each key/value pair. Only valid if
 	   key/value are. */
-	uint32_t cur;
+	uint64_t cur;
 	/* Length of current data */
 	uint32_t datalen;
 	/* Length of current data */
@@ -51,6 +53,14 @@ typedef struct hardhat_cursor {
 	uint16_t prefixlen;
 	/* Whether the first entry has been returned. */
 	bool started;
+	/* Length of the key in keybuf. Private! */
+	uint16_t keybuflen;
+	/* Entry whose key is in keybuf. Private! */
+	uint64_t keycur;
+	/* Offset of the front-coded key following the one in keybuf. Private! */
+	uint64_t keypos;
+	/* Buffer for decoding front-coded keys. Private! */
+	uint8_t *keybuf;
 	/* Inline buffer containing the prefix. Private!
 	  Extends past the end of the structure. */
 	uint8_t prefix[1];
@@ -33,13 +33,54 @@ static uint32_t HHE(hhc_calchash)(hardhat_t *hardhat, const uint8_t *key, size_t
 		case 4:
 			murmurhash3_32(key, len, u32(hardhat->hashseed), &hash);
 			return hash;
+		case 5:
+		case 6:
+			return calchash_wyhash(key, len, u32(hardhat->hashseed));
 		default:
 			abort();
 	}
 }
 
+/* The number of entries; version 6 databases store it in 64 bits */
+static inline uint64_t HHE(hhc_entries)(hardhat_t *hardhat) {
+	return u32(hardhat->version) >= UINT32_C(6)
+		? u64(((const struct widehardhat *)hardhat)->entries)
+		: u32(hardhat->entries);
+}
+
+/* The number of prefixes; version 6 databases store it in 64 bits */
+static inline uint64_t HHE(hhc_prefixes)(hardhat_t *hardhat) {
+	return u32(hardhat->version) >= UINT32_C(6)
+		? u64(((const struct widehardhat *)hardhat)->prefixes)
+		: u32(hardhat->prefixes);
+}
+
+/* The hash value of entry u of a hash table section */
+static inline uint32_t HHE(hhc_he_hash)(const uint8_t *ht, uint64_t u, bool wide) {
+	return wide
+		? u32(((const struct widehashentry *)ht)[u].hash)
+		: u32(((const struct hashentry *)ht)[u].hash);
+}
+
+/* The directory index of entry u of a hash table section */
+static inline uint64_t HHE(hhc_he_data)(const uint8_t *ht, uint64_t u, bool wide) {
+	return wide
+		? u64(((const struct widehashentry *)ht)[u].data)
+		: u32(((const struct hashentry *)ht)[u].data);
+}
+
+/* Size of the buffer that front-coded keys are decoded into */
+static inline size_t HHE(hhc_keybufsize)(hardhat_t *hardhat) {
+	return u32(hardhat->version) >= UINT32_C(4)
+		? u16(((const struct newhardhat *)hardhat)->maxkeylen)
+		: 0;
+}
+
 static bool HHE(hhc_validate)(hardhat_t *hardhat, const struct stat *st) {
-	uint64_t sections[8];
+	const struct newhardhat *newhardhat = (const struct newhardhat *)hardhat;
+	const struct widehardhat *widehardhat = (const struct widehardhat *)hardhat;
+	uint64_t sections[10], headersize = sizeof *hardhat, nblocks, entries, prefixes, hesize;
+	size_t numsections = 4, u;
 
 	if(memcmp(hardhat->magic, HARDHAT_MAGIC, sizeof hardhat->magic))
 		return false;
@@ -68,6 +109,46 @@ static bool HHE(hhc_validate)(hardhat_t *hardhat, const struct stat *st) {
 			return false;
 		if(hardhat->blocksize >= 32)
 			return false;
+	} else if(u32(hardhat->version) <= UINT32_C(5)) {
+		headersize = sizeof *newhardhat;
+		if(st->st_size < (off_t)headersize)
+			return false;
+		if(HHE(hhc_calchash)(hardhat, (const void *)hardhat, sizeof *newhardhat - 4)
+				!= u32(newhardhat->checksum))
+			return false;
+		/* the embedded checksum is superseded by the one at the end */
+		if(hardhat->checksum)
+			return false;
+		if(hardhat->alignment >= 32)
+			return false;
+		if(hardhat->blocksize >= 32)
+			return false;
+		if(newhardhat->keyblock >= 16)
+			return false;
+		if(newhardhat->padding)
+			return false;
+	} else if(u32(hardhat->version) <= UINT32_C(6)) {
+		headersize = sizeof *widehardhat;
+		if(st->st_size < (off_t)headersize)
+			return false;
+		if(HHE(hhc_calchash)(hardhat, (const void *)hardhat, sizeof *widehardhat - 4)
+				!= u32(widehardhat->checksum))
+			return false;
+		/* the embedded checksums and counts are superseded by the ones at the end */
+		if(hardhat->checksum || newhardhat->checksum)
+			return false;
+		if(hardhat->entries || hardhat->prefixes)
+			return false;
+		if(hardhat->alignment >= 32)
+			return false;
+		if(hardhat->blocksize >= 32)
+			return false;
+		if(newhardhat->keyblock >= 16)
+			return false;
+		if(newhardhat->padding)
+			return false;
+		if(widehardhat->padding)
+			return false;
 	} else {
 		return false;
 	}
@@ -75,22 +156,34 @@ static bool HHE(hhc_validate)(hardhat_t *hardhat, const struct stat *st) {
 	if(hardhat->padding)
 		return false;
 
+	entries = HHE(hhc_entries)(hardhat);
+	prefixes = HHE(hhc_prefixes)(hardhat);
+	hesize = u32(hardhat->version) >= UINT32_C(6)
+		? sizeof(struct widehashentry)
+		: sizeof(struct hashentry);
+
+	/* so that the sizes of the sections below can't overflow */
+	if(entries > (uint64_t)st->st_size / hesize)
+		return false;
+	if(prefixes > (uint64_t)st->st_size / hesize)
+		return false;
+
 	if(u64(hardhat->data_start) % sizeof(uint32_t))
 		return false;
-	if(u64(hardhat->hash_start) % sizeof(uint32_t))
+	if(u64(hardhat->hash_start) % (hesize / 2))
 		return false;
 	if(u64(hardhat->directory_start) % sizeof(uint64_t))
 		return false;
-	if(u64(hardhat->prefix_start) % sizeof(uint32_t))
+	if(u64(hardhat->prefix_start) % (hesize / 2))
 		return false;
 
-	if(u64(hardhat->data_start) < sizeof *hardhat)
+	if(u64(hardhat->data_start) < headersize)
 		return false;
-	if(u64(hardhat->hash_start) < sizeof *hardhat)
+	if(u64(hardhat->hash_start) < headersize)
 		return false;
-	if(u64(hardhat->directory_start) < sizeof *hardhat)
+	if(u64(hardhat->directory_start) < headersize)
 		return false;
-	if(u64(hardhat->prefix_start) < sizeof *hardhat)
+	if(u64(hardhat->prefix_start) < headersize)
 		return false;
 
 	if(u64(hardhat->data_end) > (uint64_t)st->st_size)
@@ -111,11 +204,11 @@ static bool HHE(hhc_validate)(hardhat_t *hardhat, const struct stat *st) {
 	if(u64(hardhat->prefix_end) < u64(hardhat->prefix_start))
 		return false;
 
-	if(u64(hardhat->directory_end) - u64(hardhat->directory_start) < (uint64_t)u32(hardhat->entries) * (uint64_t)sizeof(uint64_t))
+	if(u64(hardhat->directory_end) - u64(hardhat->directory_start) < entries * (uint64_t)sizeof(uint64_t))
 		return false;
-	if(u64(hardhat->hash_end) - u64(hardhat->hash_start) < (uint64_t)u32(hardhat->entries) * (uint64_t)(2 * sizeof(uint32_t)))
+	if(u64(hardhat->hash_end) - u64(hardhat->hash_start) < entries * hesize)
 		return false;
-	if(u64(hardhat->prefix_end) - u64(hardhat->prefix_start) < (uint64_t)u32(hardhat->prefixes) * (uint64_t)(2 * sizeof(uint32_t)))
+	if(u64(hardhat->prefix_end) - u64(hardhat->prefix_start) < prefixes * hesize)
 		return false;
 
 	sections[0] = u64(hardhat->data_start);
@@ -127,14 +220,32 @@ static bool HHE(hhc_validate)(hardhat_t *hardhat, const struct stat *st) {
 	sections[6] = u64(hardhat->prefix_start);
 	sections[7] = u64(hardhat->prefix_end);
 
-	qsort(sections, sizeof sections / (sizeof *sections * 2), sizeof *sections * 2, sectioncmp);
+	if(u32(hardhat->version) >= UINT32_C(4)) {
+		nblocks = entries
+			? ((entries - 1) >> newhardhat->keyblock) + 1
+			: 0;
 
-	if(sections[1] > sections[2])
-		return false;
-	if(sections[3] > sections[4])
-		return false;
-	if(sections[5] > sections[6])
-		return false;
+		if(u64(newhardhat->keys_end) % sizeof(uint64_t))
+			return false;
+		if(u64(newhardhat->keys_start) < headersize)
+			return false;
+		if(u64(newhardhat->keys_end) > (uint64_t)st->st_size)
+			return false;
+		if(u64(newhardhat->keys_end) < u64(newhardhat->keys_start))
+			return false;
+		if(u64(newhardhat->keys_end) - u64(newhardhat->keys_start) < nblocks * (uint64_t)sizeof(uint64_t))
+			return false;
+
+		sections[8] = u64(newhardhat->keys_start);
+		sections[9] = u64(newhardhat->keys_end);
+		numsections = 5;
+	}
+
+	qsort(sections, numsections, sizeof *sections * 2, sectioncmp);
+
+	for(u = 1; u < numsections; u++)
+		if(sections[u * 2 - 1] > sections[u * 2])
+			return false;
 
 	return true;
 }
@@ -185,41 +296,133 @@ static void HHE(hardhat_close)(hardhat_t *hardhat) {
 	munmap(cc.u8ptr, (size_t)u64(hardhat->filesize));
 }
 
+static inline bool HHE(hhc_fetch_entry)(hardhat_cursor_t *c);
+
 static void HHE(hardhat_debug_dump)(hardhat_t *hardhat) {
-	const struct hashentry *he, *ht;
-	uint32_t u;
-	const uint64_t *directory;
-	const uint8_t *rec, *buf;
+	hardhat_cursor_t lookup = {.hardhat = hardhat, .keycur = CURSOR_NONE};
+	uint64_t u, num;
+	const uint8_t *buf, *ht;
+	bool wide;
 
 	buf = (const uint8_t *)hardhat;
-	directory = (const uint64_t *)(buf + u64(hardhat->directory_start));
+	wide = u32(hardhat->version) >= UINT32_C(6);
+
+	if(u32(hardhat->version) >= UINT32_C(4)) {
+		lookup.keybuf = malloc(HHE(hhc_keybufsize)(hardhat) + 1);
+		if(!lookup.keybuf)
+			return;
+	}
 
 	puts("main hash:");
-	ht = (const struct hashentry *)(buf + u64(hardhat->hash_start));
-	for(u = 0; u < u32(hardhat->entries); u++) {
-		he = ht + u;
-		rec = buf + u64(directory[u32(he->data)]);
-		printf("\thash: 0x%08"PRIx32", data: %"PRId32", key: '", u32(he->hash), u32(he->data));
-		fwrite(rec + 6, 1, u16read(rec + 4), stdout);
+	ht = buf + u64(hardhat->hash_start);
+	num = HHE(hhc_entries)(hardhat);
+	for(u = 0; u < num; u++) {
+		lookup.cur = HHE(hhc_he_data)(ht, u, wide);
+		printf("\thash: 0x%08"PRIx32", data: %"PRIu64", key: '", HHE(hhc_he_hash)(ht, u, wide), lookup.cur);
+		if(HHE(hhc_fetch_entry)(&lookup))
+			fwrite(lookup.key, 1, lookup.keylen, stdout);
 		puts("'");
 	}
 
 	puts("prefix hash:");
-	ht = (const struct hashentry *)(buf + u64(hardhat->prefix_start));
-	for(u = 0; u < u32(hardhat->prefixes); u++) {
-		he = ht + u;
-		rec = buf + u64(directory[u32(he->data)]);
-		printf("\thash: 0x%08"PRIx32", data: %"PRId32", key: '", u32(he->hash), u32(he->data));
-		fwrite(rec + 6, 1, u16read(rec + 4), stdout);
+	ht = buf + u64(hardhat->prefix_start);
+	num = HHE(hhc_prefixes)(hardhat);
+	for(u = 0; u < num; u++) {
+		lookup.cur = HHE(hhc_he_data)(ht, u, wide);
+		printf("\thash: 0x%08"PRIx32", data: %"PRIu64", key: '", HHE(hhc_he_hash)(ht, u, wide), lookup.cur);
+		if(HHE(hhc_fetch_entry)(&lookup))
+			fwrite(lookup.key, 1, lookup.keylen, stdout);
 		puts("'");
 	}
+
+	free(lookup.keybuf);
+}
+
+/*
+**	Version 4 counterpart of hhc_fetch_entry(): decode the front-coded key
+**	of entry c->cur into the cursor's key buffer. If the buffer holds the
+**	key of the preceding entry in the same block, decoding continues from
+**	there. Otherwise it starts at the restart point at the beginning of the
+**	block, so at most one block is decoded.
+*/
+static bool HHE(hhc_fetch_frontcoded)(hardhat_cursor_t *c) {
+	uint16_t keylen;
+	uint64_t index, u, mask, recnum, pos, end, off, shared, suffix, datalen, data_start, data_end;
+	const uint8_t *buf;
+	uint8_t *keybuf;
+	const struct hardhat *hardhat;
+	const struct newhardhat *newhardhat;
+	const uint64_t *directory, *blocks;
+
+	keybuf = c->keybuf;
+	if(!keybuf)
+		return false;
+
+	index = c->cur;
+	hardhat = c->hardhat;
+	recnum = HHE(hhc_entries)(hardhat);
+	if(index >= recnum)
+		return false;
+
+	newhardhat = (const struct newhardhat *)hardhat;
+	buf = (const uint8_t *)hardhat;
+	mask = (UINT64_C(1) << newhardhat->keyblock) - UINT64_C(1);
+
+	/* the block index sits at the end of the key section */
+	end = u64(newhardhat->keys_end) - (((recnum - 1) >> newhardhat->keyblock) + 1) * sizeof *blocks;
+	blocks = (const uint64_t *)(buf + end);
+
+	if(c->keycur != CURSOR_NONE && c->keycur + 1 == index && index & mask) {
+		u = index;
+		pos = c->keypos;
+		keylen = c->keybuflen;
+	} else {
+		u = index & ~mask;
+		pos = u64(blocks[index >> newhardhat->keyblock]);
+		keylen = 0;
+		if(pos < u64(newhardhat->keys_start))
+			return false;
+	}
+
+	for(;;) {
+		if(!hhc_varint(buf, &pos, end, &shared)
+				|| !hhc_varint(buf, &pos, end, &suffix)
+				|| !hhc_varint(buf, &pos, end, &datalen))
+			return false;
+		if(shared > keylen || suffix > u16(newhardhat->maxkeylen) - shared || suffix > end - pos || datalen > UINT32_MAX)
+			return false;
+		memcpy(keybuf + shared, buf + pos, suffix);
+		pos += suffix;
+		keylen = (uint16_t)(shared + suffix);
+		if(u++ == index)
+			break;
+	}
+
+	directory = (const uint64_t *)(buf + u64(hardhat->directory_start));
+	off = u64(directory[index]);
+	data_start = u64(hardhat->data_start);
+	data_end = u64(hardhat->data_end);
+	if(off < data_start || off > data_end || datalen > data_end - off)
+		return false;
+
+	c->keycur = index;
+	c->keypos = pos;
+	c->keybuflen = keylen;
+
+	c->key = keybuf;
+	c->keylen = keylen;
+	c->data = buf + off;
+	c->datalen = (uint32_t)datalen;
+
+	return true;
 }
 
 /*
 **	Try to fetch a single entry into the (dummy) cursor object, taking
 **	extreme care to guard against pointers outside the memory mapped region.
-**  We do not have to worry about overflow, all values are restricted to
-**  32 bits and the math is done in 64 bit.
+**  Record offsets are 64 bits wide, so each one is checked against the end
+**  of the data section before anything is added to it. The lengths that
+**  are added are restricted to 32 bits, and the math is done in 64 bit.
 **
 **	Usage: fill in the hardhat and cur fields of the hardhat_cursor_t.
 **	This function will either return false (if an anomaly was detected) or
@@ -227,8 +430,7 @@ static void HHE(hardhat_debug_dump)(hardhat_t *hardhat) {
 */
 static inline bool HHE(hhc_fetch_entry)(hardhat_cursor_t *c) {
 	uint16_t keylen;
-	uint32_t recnum, index;
-	uint64_t off, reclen, data_start, data_end, datalen, datapad, blocksize;
+	uint64_t recnum, index, off, reclen, data_start, data_end, datalen, datapad, blocksize;
 	uint64_t data_off, start, end;
 	const uint8_t *rec, *buf;
 	const struct hardhat *hardhat;
@@ -236,7 +438,9 @@ static inline bool HHE(hhc_fetch_entry)(hardhat_cursor_t *c) {
 
 	index = c->cur;
 	hardhat = c->hardhat;
-	recnum = u32(hardhat->entries);
+	if(u32(hardhat->version) >= UINT32_C(4))
+		return HHE(hhc_fetch_frontcoded)(c);
+	recnum = HHE(hhc_entries)(hardhat);
 	if(index >= recnum)
 		return false;
 
@@ -246,7 +450,7 @@ static inline bool HHE(hhc_fetch_entry)(hardhat_cursor_t *c) {
 	reclen = 6;
 	data_start = u64(hardhat->data_start);
 	data_end = u64(hardhat->data_end);
-	if(off < data_start || off + reclen > data_end || off % 4)
+	if(off < data_start || off > data_end || reclen > data_end - off || off % 4)
 		return false;
 
 	buf = (const uint8_t *)hardhat;
@@ -274,7 +478,7 @@ static inline bool HHE(hhc_fetch_entry)(hardhat_cursor_t *c) {
 	}
 
 	reclen += datalen;
-	if(off + reclen > data_end)
+	if(reclen > data_end - off)
 		return false;
 
 	c->key = rec + 6;
@@ -285,29 +489,28 @@ static inline bool HHE(hhc_fetch_entry)(hardhat_cursor_t *c) {
 	return true;
 }
 
-static void HHE(hhc_hash_find)(hardhat_cursor_t *c) {
-	const struct hashentry *he, *ht;
+/* Look up the entry with exactly this key. Fill in the hardhat, keybuf and
+	keycur fields of the lookup cursor first; if the entry is found, the rest
+	is filled in and true is returned. */
+static bool HHE(hhc_hash_lookup)(hardhat_cursor_t *lookup, const void *str, uint16_t len) {
 	const struct hardhat *hardhat;
-	hardhat_cursor_t lookup;
-	uint32_t u, hp, hash, he_hash, recnum, upper, lower, upper_hash, lower_hash;
-	uint16_t len;
-	const uint8_t *buf;
-	const void *str;
+	uint64_t u, hp, recnum, upper, lower;
+	uint32_t hash, he_hash, upper_hash, lower_hash;
+	const uint8_t *buf, *ht;
 	unsigned int tries = 0;
+	bool wide;
 	int r;
 
-	hardhat = c->hardhat;
-	recnum = u32(hardhat->entries);
+	hardhat = lookup->hardhat;
+	recnum = HHE(hhc_entries)(hardhat);
 	if(!recnum)
-		return;
-	lookup.hardhat = hardhat;
+		return false;
+	wide = u32(hardhat->version) >= UINT32_C(6);
 
-	str = c->prefix;
-	len = c->prefixlen;
 	hash = HHE(hhc_calchash)(hardhat, str, len);
 	buf = (const uint8_t *)hardhat;
 
-	ht = (const struct hashentry *)(buf + u64(hardhat->hash_start));
+	ht = buf + u64(hardhat->hash_start);
 
 	lower = 0;
 	upper = recnum;
@@ -317,20 +520,19 @@ static void HHE(hhc_hash_find)(hardhat_cursor_t *c) {
 	/* binary search for the hash value */
 	for(;;) {
 		hp = tries++ < 10
-			? lower + (uint32_t)((uint64_t)(hash - lower_hash) * (uint64_t)(upper - lower) / ((uint64_t)(upper_hash - lower_hash) + UINT64_C(1)))
+			? hhc_interpolate(lower, upper, hash, lower_hash, upper_hash)
 			: lower + (upper - lower) / 2;
-		he = ht + hp;
-//		fprintf(stderr, "%s:%d tries=%u lower=%"PRIu32" upper=%"PRIu32" hp=%"PRIu32" hash=0x%08"PRIx32" lower_hash=0x%08"PRIx32" upper_hash=0x%08"PRIx32"\n", __FILE__, __LINE__, tries, lower, upper, hp, hash, lower_hash, upper_hash);
-		he_hash = u32(he->hash);
+//		fprintf(stderr, "%s:%d tries=%u lower=%"PRIu64" upper=%"PRIu64" hp=%"PRIu64" hash=0x%08"PRIx32" lower_hash=0x%08"PRIx32" upper_hash=0x%08"PRIx32"\n", __FILE__, __LINE__, tries, lower, upper, hp, hash, lower_hash, upper_hash);
+		he_hash = HHE(hhc_he_hash)(ht, hp, wide);
 		if(he_hash == hash) {
 			if(u32(hardhat->version) < 3)
 				break;
-			lookup.cur = u32(he->data);
-			if(!HHE(hhc_fetch_entry)(&lookup))
-				return;
-			if(lookup.keylen < len) {
+			lookup->cur = HHE(hhc_he_data)(ht, hp, wide);
+			if(!HHE(hhc_fetch_entry)(lookup))
+				return false;
+			if(lookup->keylen < len) {
 				/* found key is shorter than the reference key */
-				r = memcmp(lookup.key, str, lookup.keylen);
+				r = memcmp(lookup->key, str, lookup->keylen);
 				if(r > 0) {
 					/* found key is shorter but lexicographically bigger */
 					upper = hp;
@@ -342,15 +544,9 @@ static void HHE(hhc_hash_find)(hardhat_cursor_t *c) {
 					lower_hash = he_hash;
 				}
 			} else {
-				r = memcmp(lookup.key, str, len);
-				if(lookup.keylen == len && !r) {
-					c->cur = lookup.cur;
-					c->key = lookup.key;
-					c->keylen = lookup.keylen;
-					c->data = lookup.data;
-					c->datalen = lookup.datalen;
-					return;
-				}
+				r = memcmp(lookup->key, str, len);
+				if(lookup->keylen == len && !r)
+					return true;
 				if(r < 0) {
 					/* found key is lexicographically smaller */
 					lower = hp + 1;
@@ -370,7 +566,7 @@ static void HHE(hhc_hash_find)(hardhat_cursor_t *c) {
 			upper_hash = he_hash;
 		}
 		if(lower == upper || (lower_hash == upper_hash && lower_hash != hash))
-			return;
+			return false;
 	}
 
 	/* There may be multiple keys with the correct hash value.
@@ -380,62 +576,81 @@ static void HHE(hhc_hash_find)(hardhat_cursor_t *c) {
 
 	/* search upward to find the real value */
 	for(u = hp; u < recnum; u++) {
-		he = ht + u;
-		he_hash = u32(he->hash);
+		he_hash = HHE(hhc_he_hash)(ht, u, wide);
 		if(he_hash != hash)
 			break;
 
-		lookup.cur = u32(he->data);
-		if(!HHE(hhc_fetch_entry)(&lookup))
-			return;
+		lookup->cur = HHE(hhc_he_data)(ht, u, wide);
+		if(!HHE(hhc_fetch_entry)(lookup))
+			return false;
 
-		if(lookup.keylen == len && !memcmp(lookup.key, str, len)) {
-			c->cur = lookup.cur;
-			c->key = lookup.key;
-			c->keylen = lookup.keylen;
-			c->data = lookup.data;
-			c->datalen = lookup.datalen;
-			return;
-		}
+		if(lookup->keylen == len && !memcmp(lookup->key, str, len))
+			return true;
 	}
 
 	/* search downward to find the real value */
 	for(u = hp - 1; u < recnum; u--) {
-		he = ht + u;
-		he_hash = u32(he->hash);
+		he_hash = HHE(hhc_he_hash)(ht, u, wide);
 		if(he_hash != hash)
 			break;
 
-		lookup.cur = u32(he->data);
-		if(!HHE(hhc_fetch_entry)(&lookup))
-			return;
+		lookup->cur = HHE(hhc_he_data)(ht, u, wide);
+		if(!HHE(hhc_fetch_entry)(lookup))
+			return false;
 
-		if(lookup.keylen == len && !memcmp(lookup.key, str, len)) {
-			c->cur = lookup.cur;
-			c->key = lookup.key;
-			c->keylen = lookup.keylen;
-			c->data = lookup.data;
-			c->datalen = lookup.datalen;
-			return;
-		}
+		if(lookup->keylen == len && !memcmp(lookup->key, str, len))
+			return true;
 	}
+
+	return false;
 }
 
-static uint32_t HHE(hhc_prefix_find)(hardhat_t *hardhat, const void *str, uint16_t len, bool recursive) {
+static void HHE(hhc_hash_find)(hardhat_cursor_t *c) {
 	hardhat_cursor_t lookup;
-	const struct hashentry *he, *ht;
-	uint32_t u, hp, hash, he_hash, he_data, hashnum, recnum, upper, lower, upper_hash, lower_hash;
-	const uint8_t *buf;
+
+	lookup.hardhat = c->hardhat;
+	lookup.keybuf = c->keybuf;
+	lookup.keycur = CURSOR_NONE;
+
+	if(!HHE(hhc_hash_lookup)(&lookup, c->prefix, c->prefixlen))
+		return;
+
+	c->cur = lookup.cur;
+	c->key = lookup.key;
+	c->keylen = lookup.keylen;
+	c->data = lookup.data;
+	c->datalen = lookup.datalen;
+	c->keycur = lookup.keycur;
+	c->keypos = lookup.keypos;
+	c->keybuflen = lookup.keybuflen;
+}
+
+static uint64_t HHE(hhc_prefix_find)(hardhat_cursor_t *c, bool recursive) {
+	hardhat_t *hardhat;
+	hardhat_cursor_t lookup;
+	uint64_t u, hp, he_data, hashnum, recnum, upper, lower;
+	uint32_t hash, he_hash, upper_hash, lower_hash;
+	const uint8_t *buf, *ht;
+	const void *str;
+	uint16_t len;
 	int r;
 	unsigned int tries = 0;
+	bool wide;
 
-	recnum = u32(hardhat->entries);
-	hashnum = u32(hardhat->prefixes);
+	hardhat = c->hardhat;
+	str = c->prefix;
+	len = c->prefixlen;
+
+	recnum = HHE(hhc_entries)(hardhat);
+	hashnum = HHE(hhc_prefixes)(hardhat);
+	wide = u32(hardhat->version) >= UINT32_C(6);
 
 	if(!recnum)
 		return CURSOR_NONE;
 
 	lookup.hardhat = hardhat;
+	lookup.keybuf = c->keybuf;
+	lookup.keycur = CURSOR_NONE;
 
 	if(!len) {
 		// special treatment for "" to prevent it from being
@@ -463,7 +678,7 @@ static uint32_t HHE(hhc_prefix_find)(hardhat_t *hardhat, const void *str, uint16
 
 	hash = HHE(hhc_calchash)(hardhat, str, len);
 	buf = (const uint8_t *)hardhat;
-	ht = (const struct hashentry *)(buf + u64(hardhat->prefix_start));
+	ht = buf + u64(hardhat->prefix_start);
 
 	lower = 0;
 	upper = hashnum;
@@ -472,16 +687,15 @@ static uint32_t HHE(hhc_prefix_find)(hardhat_t *hardhat, const void *str, uint16
 
 	for(;;) {
 		hp = tries++ < 10
-			? lower + (uint32_t)((uint64_t)(hash - lower_hash) * (uint64_t)(upper - lower) / ((uint64_t)(upper_hash - lower_hash) + UINT64_C(1)))
+			? hhc_interpolate(lower, upper, hash, lower_hash, upper_hash)
 			: lower + (upper - lower) / 2;
-		he = ht + hp;
-//		fprintf(stderr, "%s:%d tries=%u lower=%"PRIu32" upper=%"PRIu32" hp=%"PRIu32" hash=0x%08"PRIx32" lower_hash=0x%08"PRIx32" upper_hash=0x%08"PRIx32"\n", __FILE__, __LINE__, tries, lower, upper, hp, hash, lower_hash, upper_hash);
+//		fprintf(stderr, "%s:%d tries=%u lower=%"PRIu64" upper=%"PRIu64" hp=%"PRIu64" hash=0x%08"PRIx32" lower_hash=0x%08"PRIx32" upper_hash=0x%08"PRIx32"\n", __FILE__, __LINE__, tries, lower, upper, hp, hash, lower_hash, upper_hash);
 
-		he_hash = u32(he->hash);
+		he_hash = HHE(hhc_he_hash)(ht, hp, wide);
 		if(he_hash == hash) {
 			if(u32(hardhat->version) < 3)
 				break;
-			lookup.cur = u32(he->data);
+			lookup.cur = HHE(hhc_he_data)(ht, hp, wide);
 			if(!HHE(hhc_fetch_entry)(&lookup))
 				return CURSOR_NONE;
 			if(lookup.keylen < len) {
@@ -541,11 +755,10 @@ static uint32_t HHE(hhc_prefix_find)(hardhat_t *hardhat, const void *str, uint16
 	** comparing key values one by one. */
 
 	for(u = hp; u < hashnum; u++) {
-		he = ht + u;
-		he_hash = u32(he->hash);
+		he_hash = HHE(hhc_he_hash)(ht, u, wide);
 		if(he_hash != hash)
 			break;
-		lookup.cur = he_data = u32(he->data);
+		lookup.cur = he_data = HHE(hhc_he_data)(ht, u, wide);
 		if(!HHE(hhc_fetch_entry)(&lookup))
 			return CURSOR_NONE;
 		if(lookup.keylen < len || memcmp(lookup.key, str, len) || (!recursive && memchr(lookup.key + len, '/', lookup.keylen - len)))
@@ -562,11 +775,10 @@ static uint32_t HHE(hhc_prefix_find)(hardhat_t *hardhat, const void *str, uint16
 	}
 
 	for(u = hp - 1; u < hashnum; u--) {
-		he = ht + u;
-		he_hash = u32(he->hash);
+		he_hash = HHE(hhc_he_hash)(ht, u, wide);
 		if(he_hash != hash)
 			break;
-		lookup.cur = he_data = u32(he->data);
+		lookup.cur = he_data = HHE(hhc_he_data)(ht, u, wide);
 		if(!HHE(hhc_fetch_entry)(&lookup))
 			return CURSOR_NONE;
 		if(lookup.keylen < len || memcmp(lookup.key, str, len) || (!recursive && memchr(lookup.key + len, '/', lookup.keylen - len)))
@@ -588,7 +800,7 @@ static uint32_t HHE(hhc_prefix_find)(hardhat_t *hardhat, const void *str, uint16
 static bool HHE(hardhat_fetch)(hardhat_cursor_t *c, bool recursive) {
 	const struct hardhat *hardhat;
 	uint64_t off, reclen, data_start, data_end;
-	uint32_t cur;
+	uint64_t cur;
 	const uint64_t *directory;
 	const uint8_t *rec, *buf;
 	uint16_t keylen;
@@ -603,7 +815,18 @@ static bool HHE(hardhat_fetch)(hardhat_cursor_t *c, bool recursive) {
 
 	if(c->started) {
 		cur++;
-		if(cur < u32(hardhat->entries)) {
+		if(cur >= HHE(hhc_entries)(hardhat)) {
+			cur = CURSOR_NONE;
+		} else if(u32(hardhat->version) >= UINT32_C(4)) {
+			/* decoding continues from the previous key */
+			c->cur = cur;
+			if(HHE(hhc_fetch_frontcoded)(c)
+					&& c->keylen >= c->prefixlen
+					&& !memcmp(c->key, c->prefix, c->prefixlen)
+					&& (recursive || !memchr((const uint8_t *)c->key + c->prefixlen, '/', (size_t)(c->keylen - c->prefixlen))))
+				return c->started = true;
+			cur = CURSOR_NONE;
+		} else {
 			data_start = u64(hardhat->data_start);
 			data_end = u64(hardhat->data_end);
 			off = u64(directory[cur]);
@@ -622,12 +845,12 @@ static bool HHE(hardhat_fetch)(hardhat_cursor_t *c, bool recursive) {
 						cur = CURSOR_NONE;
 				}
 			}
-		} else {
-			cur = CURSOR_NONE;
 		}
 	} else {
 		/* hhc_prefix_find() validates the entry for us */
-		cur = HHE(hhc_prefix_find)(hardhat, c->prefix, c->prefixlen, recursive);
+		cur = HHE(hhc_prefix_find)(c, recursive);
+		/* and overwrites the key buffer in the process */
+		c->keycur = CURSOR_NONE;
 	}
 
 	c->cur = cur;
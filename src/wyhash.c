@@ -0,0 +1,135 @@
+/******************************************************************************
+
+	wyhash was written by Wang Yi, and is placed in the public domain.
+	The author hereby disclaims copyright to this source code.
+
+	This implementation reads its input as little-endian words on all
+	platforms, so it produces the same results everywhere.
+
+******************************************************************************/
+
+#include "wyhash.h"
+
+#ifdef __GNUC__
+#define PURE_INLINE __attribute__((always_inline,pure,optimize(3))) inline
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define PURE_INLINE inline
+#define likely(x) (x)
+#define unlikely(x) (x)
+#endif
+
+static const uint64_t secret[4] = {
+	UINT64_C(0x2D358DCCAA6C78A5),
+	UINT64_C(0x8BB84B93962EACC9),
+	UINT64_C(0x4B33A62ED433D4A3),
+	UINT64_C(0x4D5A2DA51DE1AA47),
+};
+
+// Multiply two 64-bit values into a 128-bit result, returned as its low
+// and high halves in *a and *b.
+static inline void mum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+	unsigned __int128 r = *a;
+	r *= *b;
+	*a = (uint64_t)r;
+	*b = (uint64_t)(r >> 64);
+#else
+	uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+	uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+	uint64_t t = rl + (rm0 << 32), c = t < rl;
+	uint64_t lo = t + (rm1 << 32);
+	c += lo < t;
+	*a = lo;
+	*b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static PURE_INLINE uint64_t mix(uint64_t a, uint64_t b) {
+	mum(&a, &b);
+	return a ^ b;
+}
+
+// Block read - unaligned little-endian loads
+static PURE_INLINE uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
+}
+
+static PURE_INLINE uint64_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof v);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static PURE_INLINE uint64_t read3(const uint8_t *p, size_t k) {
+	return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+//-----------------------------------------------------------------------------
+
+uint64_t wyhash(const void *key, size_t len, uint64_t seed) {
+	const uint8_t *p = (const uint8_t *)key;
+	uint64_t a, b;
+
+	seed ^= mix(seed ^ secret[0], secret[1]);
+
+	if(likely(len <= 16)) {
+		if(likely(len >= 4)) {
+			size_t off = (len >> 3) << 2;
+			a = (read32(p) << 32) | read32(p + off);
+			b = (read32(p + len - 4) << 32) | read32(p + len - 4 - off);
+		} else if(likely(len > 0)) {
+			a = read3(p, len);
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		size_t i = len;
+
+		//----------
+		// body: three independent lanes of 16 bytes each
+
+		if(unlikely(i > 48)) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+				see1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ see1);
+				see2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while(likely(i > 48));
+			seed ^= see1 ^ see2;
+		}
+
+		while(unlikely(i > 16)) {
+			seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+
+		//----------
+		// tail: the last 16 bytes, possibly overlapping the body
+
+		a = read64(p + i - 16);
+		b = read64(p + i - 8);
+	}
+
+	//----------
+	// finalization
+
+	a ^= secret[1];
+	b ^= seed;
+	mum(&a, &b);
+
+	return mix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
@@ -0,0 +1,19 @@
+/******************************************************************************
+
+	wyhash was written by Wang Yi, and is placed in the public domain.
+	The author hereby disclaims copyright to this source code.
+
+	This implementation reads its input as little-endian words on all
+	platforms, so it produces the same results everywhere.
+
+******************************************************************************/
+
+#ifndef HARDHAT_WYHASH_H
+#define HARDHAT_WYHASH_H
+
+#include <string.h>
+#include <stdint.h>
+
+uint64_t wyhash(const void *key, size_t len, uint64_t seed);
+
+#endif
@@ -4,23 +4,1094 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "src/reader.h"
 #include "src/maker.h"
+#include "src/hashtable.h"
 #include "tests/tap.h"
 
 const char hex[] = "0123456789abcdef";
 
-int main(void) {
-	char *filename;
-	const char *tmpdir;
+static const char *normalize_tests[][2] = {
+	{"", ""},
+	{"foo", "foo"},
+	{"/foo/", "foo"},
+	{"foo//bar", "foo/bar"},
+	{"foo/./bar/.", "foo/bar"},
+	{"foo/../bar", "bar"},
+	{"a/b/c/../../d", "a/d"},
+	{".hidden/x/.y", ".hidden/x/.y"},
+	{"a/very/long/path/that/is/already/normal", "a/very/long/path/that/is/already/normal"},
+	{"a/very/long/path/that/is/not//normal", "a/very/long/path/that/is/not/normal"},
+	{"a/very/long/path/that/is/not/normal/", "a/very/long/path/that/is/not/normal"},
+	{"a/very/long/path/that/is/.../normal", "a/very/long/path/that/is/.../normal"},
+};
+
+/* Straightforward version of hardhat_cmp(), to check the real one against */
+static int reference_cmp(const uint8_t *a, size_t al, const uint8_t *b, size_t bl) {
+	size_t i, n = al < bl ? al : bl;
+
+	for(i = 0; i < n && a[i] == b[i]; i++);
+
+	if(i == al)
+		return i == bl ? 0 : -1;
+	if(i == bl)
+		return 1;
+
+	if(a[i] == '/')
+		return 1;
+	if(b[i] == '/')
+		return -1;
+
+	if(memchr(a + i, '/', al - i)) {
+		if(!memchr(b + i, '/', bl - i))
+			return 1;
+	} else {
+		if(memchr(b + i, '/', bl - i))
+			return -1;
+	}
+
+	return a[i] < b[i] ? -1 : 1;
+}
+
+/* Compare random pairs of paths that share a prefix of random length,
+	drawn from a small alphabet so that slashes and ties are common */
+static bool check_cmp(void) {
+	static const uint8_t alphabet[] = {'a', 'b', '/', 0, 255};
+	uint8_t a[80], b[80];
+	size_t al, bl, z;
+	unsigned int u;
+
+	for(u = 0; u < 100000; u++) {
+		al = (size_t)rand() % sizeof a;
+		for(z = 0; z < al; z++)
+			a[z] = alphabet[rand() % sizeof alphabet];
+		bl = (size_t)rand() % sizeof b;
+		memcpy(b, a, bl < al ? bl : al);
+		/* mostly change a single byte, at or around a vector boundary */
+		if(bl > al) {
+			for(z = al; z < bl; z++)
+				b[z] = alphabet[rand() % sizeof alphabet];
+		} else if(bl) {
+			z = u & 1 ? (size_t)rand() % bl : ((size_t)rand() % 3 + 15) % bl;
+			b[z] = alphabet[rand() % sizeof alphabet];
+		}
+		if(hardhat_cmp(a, al, b, bl) != reference_cmp(a, al, b, bl))
+			return false;
+		if(hardhat_cmp(b, bl, a, al) != reference_cmp(b, bl, a, al))
+			return false;
+	}
+
+	return true;
+}
+
+/* Whether a hash table has an entry */
+static bool hash_has(const struct hashtable *ht, uint32_t hash, uint32_t data) {
+	struct hashprobe p;
+	const struct hashentry *entry;
+
+	hashprobe_start(&p, ht, hash);
+	while((entry = hashprobe_next(&p, hash)))
+		if(entry->hash == hash && entry->data == data)
+			return true;
+
+	return false;
+}
+
+/* Fill a group-probed table and check that growing it keeps the previous
+	table around, that its entries are moved over while more are added,
+	that everything can be found all along, and that flattenhash() keeps
+	all of them */
+static bool check_grouphash(void) {
+	struct hashtable *ht;
+	order_t order;
+	uint32_t u, v, n = 100000;
+	unsigned int grown = 0, moving = 0;
+	uint8_t *seen;
+	bool ok;
+
+	ht = newgrouphash();
+	if(!ht)
+		return false;
+
+	ok = true;
+	for(u = 0; ok && u < n; u++) {
+		order = ht->order;
+		ok = addhash(ht, calchash_fnv1a((const uint8_t *)&u, sizeof u), u);
+		if(ht->order != order) {
+			grown++;
+			ok = ok && ht->old_ctrl && ht->old_order == order;
+		}
+		if(ht->old_ctrl && ht->old_group > 0) {
+			/* halfway through moving */
+			if(moving++ % 1000 == 0)
+				for(v = 0; ok && v <= u; v++)
+					ok = hash_has(ht, calchash_fnv1a((const uint8_t *)&v, sizeof v), v);
+		}
+	}
+
+	/* a flattened table can't be probed, but must hold each entry once */
+	seen = calloc(n, 1);
+	ok = ok && seen;
+	if(ok) {
+		flattenhash(ht);
+		for(v = 0; v < order_to_size(ht->order); v++) {
+			if(ht->entries[v].data == EMPTYHASH)
+				continue;
+			u = ht->entries[v].data;
+			ok = ok && u < n && !seen[u]
+				&& ht->entries[v].hash == calchash_fnv1a((const uint8_t *)&u, sizeof u);
+			if(u < n)
+				seen[u] = 1;
+		}
+		for(v = 0; ok && v < n; v++)
+			ok = seen[v];
+	}
+
+	free(seen);
+	freehash(ht);
+
+	return ok && grown > 5 && moving > 1000;
+}
+
+/* Create a database from random keys with long shared prefixes and lots of
+	slashes, then check that a recursive listing is in hardhat_cmp() order */
+static bool check_order(const char *filename) {
+	static const uint8_t alphabet[] = {'a', 'b', '/', 1, 255};
+	hardhat_maker_t *hhm;
 	hardhat_t *hh;
+	hardhat_cursor_t *c;
+	uint8_t key[80], prev[80];
+	size_t keylen, prevlen = 0, z;
+	unsigned int u, n = 0;
+	bool ok;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	memset(key, 'x', 40);
+	ok = true;
+	for(u = 0; ok && u < 20000; u++) {
+		keylen = 40 + (size_t)rand() % 40;
+		for(z = u & 1 ? 40 : 0; z < keylen; z++)
+			key[z] = alphabet[rand() % sizeof alphabet];
+		ok = hardhat_maker_add(hhm, key, (uint16_t)keylen, "", 0);
+		memset(key, 'x', 40);
+	}
+	ok = ok && hardhat_maker_finish(hhm);
+	hardhat_maker_free(hhm);
+	if(!ok)
+		return false;
+
+	hh = hardhat_open(filename);
+	if(!hh)
+		return false;
+
+	c = hardhat_cursor(hh, "", 0);
+	ok = c != NULL;
+	while(ok && hardhat_fetch(c, true)) {
+		if(n++ && hardhat_cmp(prev, prevlen, c->key, c->keylen) >= 0)
+			ok = false;
+		memcpy(prev, c->key, c->keylen);
+		prevlen = c->keylen;
+	}
+
+	hardhat_cursor_free(c);
+	hardhat_close(hh);
+
+	return ok && n > 1000;
+}
+
+/* Whether two files have the same contents */
+static bool same_file(const char *a, const char *b) {
+	FILE *fa, *fb;
+	char bufa[65536], bufb[65536];
+	size_t na, nb;
+	bool same;
+
+	fa = fopen(a, "rb");
+	fb = fopen(b, "rb");
+	same = fa && fb;
+	while(same) {
+		na = fread(bufa, 1, sizeof bufa, fa);
+		nb = fread(bufb, 1, sizeof bufb, fb);
+		same = na == nb && !memcmp(bufa, bufb, na);
+		if(na < sizeof bufa)
+			break;
+	}
+	same = same && !ferror(fa) && !ferror(fb);
+
+	if(fa)
+		fclose(fa);
+	if(fb)
+		fclose(fb);
+
+	return same;
+}
+
+/* How build_tree() creates a database */
+struct tree_options {
+	uint32_t version;
+	/* Number of times entry() is called */
+	unsigned int count;
+	unsigned int threads;
+	unsigned int writers;
+	uint64_t arena;
+	uint64_t memory;
+	bool dedup;
+	bool bulk;
+	bool grouphash;
+	bool mapped;
+	/* Passed to hardhat_maker_hashseed() unless 0 */
+	uint32_t seed;
+	/* Let hardhat_maker_finish() add the parents, instead of
+		hardhat_maker_parents() after the entries */
+	bool autoparents;
+	/* Fills in the key and value of the u-th entry, or returns false to
+		leave it out. Defaults to tree_entry(). */
+	bool (*entry)(const struct tree_options *o, unsigned int u, char *key, char *data);
+	/* Which entries half_entry() gives the right value */
+	unsigned int parity;
+	/* The value half_entry() gives the other entries (if any) */
+	const char *other;
+};
+
+/* Keys in a few levels of directories */
+static bool tree_entry(const struct tree_options *o, unsigned int u, char *key, char *data) {
+	(void)o;
+	sprintf(key, "a/very/long/shared/prefix/%u/file%u", u % 7, u);
+	sprintf(data, "value %x", u % 13);
+	return true;
+}
+
+/* The entries of tree_entry(), then all of them again with another value */
+static bool twice_entry(const struct tree_options *o, unsigned int u, char *key, char *data) {
+	if(u < o->count / 2)
+		return tree_entry(o, u, key, data);
+	tree_entry(o, u - o->count / 2, key, data);
+	strcpy(data, "duplicate");
+	return true;
+}
+
+/* Each entry of tree_entry() followed by another copy of an earlier one,
+	so that duplicates are found while the hash table is growing too */
+static bool interleaved_entry(const struct tree_options *o, unsigned int u, char *key, char *data) {
+	if(u % 2 == 0)
+		return tree_entry(o, u / 2, key, data);
+	tree_entry(o, u / 4, key, data);
+	strcpy(data, "duplicate");
+	return true;
+}
+
+/* Only the entries of tree_entry() with the given parity get the right
+	value. The others get a different value or are left out. */
+static bool half_entry(const struct tree_options *o, unsigned int u, char *key, char *data) {
+	tree_entry(o, u, key, data);
+	if(u % 2 == o->parity)
+		return true;
+	if(!o->other)
+		return false;
+	strcpy(data, o->other);
+	return true;
+}
+
+/* The entries of tree_entry(), followed by a parent that exists already,
+	which hardhat_maker_finish() must leave alone */
+static bool parent_entry(const struct tree_options *o, unsigned int u, char *key, char *data) {
+	if(u + 1 < o->count)
+		return tree_entry(o, u, key, data);
+	strcpy(key, "a/very/long");
+	*data = '\0';
+	return true;
+}
+
+/* Create a database with keys in a few levels of directories */
+static bool build_tree(const char *filename, const struct tree_options *o) {
+	hardhat_maker_t *hhm;
+	bool (*entry)(const struct tree_options *, unsigned int, char *, char *);
+	unsigned int u;
+	char key[64], data[32];
+	bool ok;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	entry = o->entry ? o->entry : tree_entry;
+
+	ok = hardhat_maker_version(hhm, o->version)
+		&& hardhat_maker_deduplicate(hhm, o->dedup)
+		&& hardhat_maker_bulk(hhm, o->bulk)
+		&& hardhat_maker_grouphash(hhm, o->grouphash)
+		&& hardhat_maker_threads(hhm, o->threads)
+		&& hardhat_maker_arena(hhm, o->arena)
+		&& hardhat_maker_writers(hhm, o->writers)
+		&& hardhat_maker_mapped(hhm, o->mapped)
+		&& hardhat_maker_memory(hhm, o->memory)
+		&& (!o->seed || hardhat_maker_hashseed(hhm, o->seed))
+		&& (!o->autoparents || hardhat_maker_autoparents(hhm, "", 0));
+
+	/* not supported with a budget */
+	if(o->memory)
+		ok = ok && !hardhat_maker_parents(hhm, "", 0);
+
+	for(u = 0; ok && u < o->count; u++)
+		if(entry(o, u, key, data))
+			ok = hardhat_maker_add(hhm, key, strlen(key), data, strlen(data));
+
+	/* too late to change these */
+	ok = ok && !hardhat_maker_grouphash(hhm, !o->grouphash);
+	ok = ok && (!o->seed || !hardhat_maker_hashseed(hhm, o->seed));
+
+	if(!o->autoparents)
+		ok = ok && hardhat_maker_parents(hhm, "", 0);
+	ok = ok && hardhat_maker_finish(hhm);
+	if(!ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	hardhat_maker_free(hhm);
+
+	return ok;
+}
+
+/* Merge two databases into a new one */
+static bool build_merge(const char *filename, uint32_t version, hardhat_t *a, hardhat_t *b) {
+	hardhat_maker_t *hhm;
+	hardhat_t *inputs[2] = {a, b};
+	bool ok;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	ok = hardhat_maker_version(hhm, version)
+		&& hardhat_maker_merge(hhm, inputs, 2)
+		&& hardhat_maker_finish(hhm);
+	if(!ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	hardhat_maker_free(hhm);
+
+	return ok;
+}
+
+/* Check the value of a single entry */
+static bool has_value(hardhat_t *hh, const char *key, const char *data) {
+	hardhat_cursor_t *c;
+	bool ok;
+
+	c = hardhat_cursor(hh, key, strlen(key));
+	ok = c && c->key && c->datalen == strlen(data) && !memcmp(c->data, data, c->datalen);
+	hardhat_cursor_free(c);
+
+	return ok;
+}
+
+/* Fill a buffer with a pattern that depends on the entry */
+static void fill_value(uint8_t *data, size_t len, unsigned int u) {
+	size_t i;
+
+	for(i = 0; i < len; i++)
+		data[i] = (uint8_t)(i * 31 + u);
+}
+
+/* Create a database with values of all sizes up to a few hundred KiB,
+	using the given output options (checked by check_sizes()) */
+static bool build_sizes(const char *filename, uint32_t version, unsigned int writers, bool mapped) {
+	hardhat_maker_t *hhm;
+	unsigned int u;
+	char key[32];
+	uint8_t *data;
+	bool ok;
+
+	data = malloc(1 << 20);
+	if(!data)
+		return false;
+
+	hhm = hardhat_maker_new(filename);
+	ok = hhm && hardhat_maker_version(hhm, version) && hardhat_maker_writers(hhm, writers)
+		&& hardhat_maker_mapped(hhm, mapped);
+
+	for(u = 0; ok && u < 100; u++) {
+		sprintf(key, "sizes/%u", u);
+		fill_value(data, (size_t)u * u * 37, u);
+		ok = hardhat_maker_add(hhm, key, strlen(key), data, u * u * 37);
+	}
+
+	ok = ok && hardhat_maker_finish(hhm);
+	if(hhm && !ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	hardhat_maker_free(hhm);
+	free(data);
+
+	return ok;
+}
+
+static bool check_sizes(const char *filename) {
+	hardhat_t *hh;
+	hardhat_cursor_t *c;
+	unsigned int u;
+	char key[32];
+	uint8_t *data;
+	bool ok;
+
+	data = malloc(1 << 20);
+	hh = hardhat_open(filename);
+	ok = data && hh;
+
+	for(u = 0; ok && u < 100; u++) {
+		sprintf(key, "sizes/%u", u);
+		fill_value(data, (size_t)u * u * 37, u);
+		c = hardhat_cursor(hh, key, strlen(key));
+		ok = c && c->key && c->datalen == u * u * 37 && !memcmp(c->data, data, c->datalen);
+		hardhat_cursor_free(c);
+	}
+
+	hardhat_close(hh);
+	free(data);
+
+	return ok;
+}
+
+/* Keys of many lengths, up to the longest one possible */
+static size_t key_length(unsigned int u) {
+	return u < 99 ? (size_t)u * u * 6 + 3 : UINT16_MAX;
+}
+
+/* Create a database with keys of all lengths and check that they can be
+	looked up and listed, which decodes them into the cursor's key buffer */
+static bool build_keylens(const char *filename, uint32_t version) {
+	hardhat_maker_t *hhm;
+	hardhat_t *hh;
+	hardhat_cursor_t *c;
+	unsigned int u, n;
+	size_t len;
+	char *key;
+	bool ok;
+
+	key = malloc(UINT16_MAX);
+	if(!key)
+		return false;
+
+	hhm = hardhat_maker_new(filename);
+	ok = hhm && hardhat_maker_version(hhm, version);
+
+	for(u = 0; ok && u < 100; u++) {
+		len = key_length(u);
+		memset(key, 'a' + u % 26, len);
+		memcpy(key, "k/", 2);
+		ok = hardhat_maker_add(hhm, key, (uint16_t)len, &u, sizeof u);
+	}
+
+	ok = ok && hardhat_maker_finish(hhm);
+	if(hhm && !ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+	hardhat_maker_free(hhm);
+
+	hh = ok ? hardhat_open(filename) : NULL;
+	ok = ok && hh;
+
+	for(u = 0; ok && u < 100; u++) {
+		len = key_length(u);
+		memset(key, 'a' + u % 26, len);
+		memcpy(key, "k/", 2);
+		c = hardhat_cursor(hh, key, (uint16_t)len);
+		ok = c && c->key && c->keylen == len && !memcmp(c->key, key, len)
+			&& c->datalen == sizeof u && !memcmp(c->data, &u, sizeof u);
+		hardhat_cursor_free(c);
+	}
+
+	n = 0;
+	c = ok ? hardhat_cursor(hh, "k", 1) : NULL;
+	while(c && hardhat_fetch(c, true))
+		if(c->keylen == key_length(*(const unsigned int *)c->data))
+			n++;
+	hardhat_cursor_free(c);
+	ok = ok && n == 100;
+
+	hardhat_close(hh);
+	free(key);
+
+	return ok;
+}
+
+#define FD_SOURCE_SIZE (1 << 20)
+
+/* Offset and length in the source file of the value of the given entry;
+	even entries start at a block boundary */
+static void fd_range(unsigned int u, uint64_t *offset, uint32_t *len) {
+	*offset = u % 2 ? (uint64_t)u * 1000 + 3 : (uint64_t)u * 4096;
+	*len = u * u * 97 % (FD_SOURCE_SIZE - 100 * 4096);
+}
+
+/* Create a database with values taken from a file with hardhat_maker_add_fd()
+	and check that they arrived intact */
+static bool build_fd(const char *filename, const char *source, uint32_t version, bool dedup, bool mapped) {
+	hardhat_maker_t *hhm;
+	hardhat_t *hh;
+	hardhat_cursor_t *c;
+	unsigned int u;
+	uint64_t offset;
+	uint32_t len;
+	char key[32];
+	uint8_t *data;
+	bool ok;
+	int fd;
+
+	data = malloc(FD_SOURCE_SIZE);
+	if(!data)
+		return false;
+	fill_value(data, FD_SOURCE_SIZE, 7);
+
+	fd = open(source, O_RDWR|O_CREAT|O_TRUNC, 0666);
+	ok = fd != -1 && write(fd, data, FD_SOURCE_SIZE) == FD_SOURCE_SIZE;
+
+	hhm = hardhat_maker_new(filename);
+	ok = ok && hhm && hardhat_maker_version(hhm, version)
+		&& hardhat_maker_deduplicate(hhm, dedup)
+		&& hardhat_maker_mapped(hhm, mapped);
+
+	for(u = 0; ok && u < 100; u++) {
+		sprintf(key, "fd/%u", u);
+		fd_range(u, &offset, &len);
+		ok = hardhat_maker_add_fd(hhm, key, strlen(key), fd, offset, len);
+	}
+
+	ok = ok && hardhat_maker_finish(hhm);
+	if(hhm && !ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	hardhat_maker_free(hhm);
+	if(fd != -1)
+		close(fd);
+
+	if(ok) {
+		hh = hardhat_open(filename);
+		ok = hh != NULL;
+		for(u = 0; ok && u < 100; u++) {
+			sprintf(key, "fd/%u", u);
+			fd_range(u, &offset, &len);
+			c = hardhat_cursor(hh, key, strlen(key));
+			ok = c && c->key && c->datalen == len && !memcmp(c->data, data + offset, len);
+			hardhat_cursor_free(c);
+		}
+		hardhat_close(hh);
+	}
+
+	free(data);
+
+	return ok;
+}
+
+/* Try to add a value that extends past the end of its file */
+static bool add_fd_eof(const char *filename, const char *source) {
+	hardhat_maker_t *hhm;
+	bool ok;
+	int fd;
+
+	fd = open(source, O_RDONLY);
+	if(fd == -1)
+		return false;
+
+	hhm = hardhat_maker_new(filename);
+	ok = hhm && !hardhat_maker_add_fd(hhm, "fd/eof", 6, fd, FD_SOURCE_SIZE - 10, 20)
+		&& *hardhat_maker_error(hhm);
+
+	hardhat_maker_free(hhm);
+	close(fd);
+
+	return ok;
+}
+
+/* Update an existing database: replace, add and delete a few entries */
+static bool build_update(const char *filename, const char *base, uint32_t version, bool bulk, uint64_t *dead) {
+	hardhat_maker_t *hhm;
+	bool ok;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	ok = hardhat_maker_base(hhm, base)
+		&& hardhat_maker_version(hhm, version)
+		&& hardhat_maker_bulk(hhm, bulk)
+		&& hardhat_maker_add(hhm, "a/very/long/shared/prefix/0/file0", 33, "changed", 7)
+		&& hardhat_maker_add(hhm, "a/new/file", 10, "new", 3)
+		&& hardhat_maker_delete(hhm, "a/very/long/shared/prefix/1/file1", 33)
+		&& hardhat_maker_delete(hhm, "a/not/there", 11)
+		&& hardhat_maker_parents(hhm, "dir", 3)
+		&& hardhat_maker_finish(hhm);
+	if(!ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	*dead = hardhat_maker_dead(hhm);
+	hardhat_maker_free(hhm);
+
+	return ok;
+}
+
+/* Count the entries in a database */
+static unsigned int count_entries(hardhat_t *hh) {
+	hardhat_cursor_t *c;
+	unsigned int n = 0;
+
+	c = hardhat_cursor(hh, "", 0);
+	while(c) {
+		if(c->key)
+			n++;
+		if(!hardhat_fetch(c, true))
+			break;
+	}
+	hardhat_cursor_free(c);
+
+	return n;
+}
+
+/* Create or update a database in atomic mode. While it's being built,
+	what's at its name is counted into *during (-1 if there's nothing). */
+static bool build_atomic(const char *filename, uint32_t version, bool update, int *during) {
+	hardhat_maker_t *hhm;
+	hardhat_t *hh;
+	unsigned int u;
+	char key[64];
+	bool ok;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	ok = hardhat_maker_atomic(hhm, true)
+		&& (!update || hardhat_maker_base(hhm, filename))
+		&& hardhat_maker_version(hhm, version);
+
+	for(u = 0; ok && u < 100; u++) {
+		sprintf(key, "a/%u/file%u", u % 7, update ? u + 100 : u);
+		ok = hardhat_maker_add(hhm, key, strlen(key), "value", 5);
+	}
+
+	hh = hardhat_open(filename);
+	*during = hh ? (int)count_entries(hh) : -1;
+	hardhat_close(hh);
+
+	ok = ok && hardhat_maker_finish(hhm);
+	if(!ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	ok = ok && !hardhat_maker_atomic(hhm, false);
+
+	hardhat_maker_free(hhm);
+
+	return ok;
+}
+
+/* Create a database in which large values of odd sizes are written out
+	directly, so that the output buffer starts at odd offsets, while the
+	records after them are read back from that buffer to check for
+	duplicates and identical values */
+static bool build_buffered(const char *filename, uint32_t version, bool dedup) {
+	hardhat_maker_t *hhm;
+	hardhat_t *hh;
+	hardhat_cursor_t *c;
+	unsigned int u;
+	size_t len;
+	char key[32];
+	uint8_t *data;
+	bool ok;
+
+	data = malloc(1 << 20);
+	if(!data)
+		return false;
+
+	hhm = hardhat_maker_new(filename);
+	ok = hhm && hardhat_maker_version(hhm, version) && hardhat_maker_deduplicate(hhm, dedup);
+
+	/* Out of order, so duplicates are looked up in the hash table */
+	ok = ok && hardhat_maker_add(hhm, "z", 1, "", 0);
+
+	for(u = 0; ok && u < 50; u++) {
+		len = (size_t)40001 + u;
+		fill_value(data, len, u);
+		sprintf(key, "buffered/%u/big", u);
+		ok = hardhat_maker_add(hhm, key, strlen(key), data, (uint32_t)len);
+		sprintf(key, "buffered/%u/small", u);
+		ok = ok && hardhat_maker_add(hhm, key, strlen(key), "small", 5)
+			&& hardhat_maker_add(hhm, key, strlen(key), "other", 5);
+		sprintf(key, "buffered/%u/copy", u);
+		ok = ok && hardhat_maker_add(hhm, key, strlen(key), "small", 5);
+	}
+
+	ok = ok && hardhat_maker_finish(hhm);
+	if(hhm && !ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+	hardhat_maker_free(hhm);
+
+	hh = ok ? hardhat_open(filename) : NULL;
+	ok = ok && hh && count_entries(hh) == 151;
+
+	for(u = 0; ok && u < 50; u++) {
+		len = (size_t)40001 + u;
+		fill_value(data, len, u);
+		sprintf(key, "buffered/%u/big", u);
+		c = hardhat_cursor(hh, key, strlen(key));
+		ok = c && c->key && c->datalen == len && !memcmp(c->data, data, len);
+		hardhat_cursor_free(c);
+		sprintf(key, "buffered/%u/small", u);
+		ok = ok && has_value(hh, key, "small");
+		sprintf(key, "buffered/%u/copy", u);
+		ok = ok && has_value(hh, key, "small");
+	}
+
+	hardhat_close(hh);
+	free(data);
+
+	return ok;
+}
+
+struct producer_test {
+	hardhat_maker_t *hhm;
+	unsigned int thread, threads;
+	bool large;
+	bool ok;
+};
+
+/* Add a share of the entries of build_tree(), each of them twice, and
+	optionally a few values that are too large to buffer */
+static void *producer_thread(void *arg) {
+	struct producer_test *pt = arg;
+	hardhat_producer_t *hhp;
+	unsigned int u, n;
+	char key[64], data[32];
+	uint8_t *large = NULL;
+	size_t len;
+	bool ok;
+
+	hhp = hardhat_producer_new(pt->hhm);
+	ok = hhp;
+
+	for(u = pt->thread; ok && u < 2000; u += pt->threads) {
+		n = u % 1000;
+		sprintf(key, "a/very/long/shared/prefix/%u/file%u", n % 7, n);
+		sprintf(data, "value %x", n % 13);
+		ok = hardhat_producer_add(hhp, key, strlen(key), data, strlen(data));
+	}
+
+	if(pt->large) {
+		large = malloc((1 << 20) + 16);
+		ok = ok && large;
+		for(u = 0; ok && u < 2; u++) {
+			len = (size_t)(1 << 20) + pt->thread * 3 + u + 1;
+			fill_value(large, len, pt->thread * 2 + u);
+			sprintf(key, "large/%u/%u", pt->thread, u);
+			ok = hardhat_producer_add(hhp, key, strlen(key), large, (uint32_t)len)
+				&& hardhat_producer_add(hhp, key, strlen(key), "other", 5);
+		}
+		free(large);
+	}
+
+	pt->ok = ok && hardhat_producer_flush(hhp);
+	hardhat_producer_free(hhp);
+
+	return NULL;
+}
+
+/* Like build_tree(), with several threads adding entries at once, after
+	the first few entries were added without a producer */
+static bool build_producers(const char *filename, uint32_t version, unsigned int threads, bool large, bool bulk) {
+	hardhat_maker_t *hhm;
+	hardhat_t *hh;
+	hardhat_cursor_t *c;
+	struct producer_test pt[8];
+	pthread_t thread[8];
+	bool started[8];
+	unsigned int u;
+	uint8_t *data;
+	size_t len;
+	char key[64], value[32];
+	bool ok = true;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	ok = hardhat_maker_version(hhm, version) && hardhat_maker_bulk(hhm, bulk);
+
+	for(u = 0; ok && u < 100; u++) {
+		sprintf(key, "a/very/long/shared/prefix/%u/file%u", u % 7, u);
+		sprintf(value, "value %x", u % 13);
+		ok = hardhat_maker_add(hhm, key, strlen(key), value, strlen(value));
+	}
+
+	for(u = 0; u < threads; u++) {
+		pt[u] = (struct producer_test){hhm, u, threads, large, false};
+		started[u] = ok && !pthread_create(thread + u, NULL, producer_thread, pt + u);
+	}
+
+	for(u = 0; u < threads; u++) {
+		if(started[u])
+			pthread_join(thread[u], NULL);
+		ok = ok && pt[u].ok;
+	}
+
+	ok = ok && hardhat_maker_parents(hhm, "", 0);
+	ok = ok && hardhat_maker_finish(hhm);
+	if(!ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	hardhat_maker_free(hhm);
+
+	if(!ok || !large)
+		return ok;
+
+	data = malloc((1 << 20) + 16);
+	hh = hardhat_open(filename);
+	ok = data && hh;
+
+	for(u = 0; ok && u < threads * 2; u++) {
+		len = (size_t)(1 << 20) + u / 2 * 3 + u % 2 + 1;
+		fill_value(data, len, u);
+		sprintf(key, "large/%u/%u", u / 2, u % 2);
+		c = hardhat_cursor(hh, key, strlen(key));
+		ok = c && c->key && c->datalen == len && !memcmp(c->data, data, len);
+		hardhat_cursor_free(c);
+	}
+
+	hardhat_close(hh);
+	free(data);
+
+	return ok;
+}
+
+/* Like build_tree(), adding the entries in batches, each of them twice:
+	the second time with a key that is not normalized */
+static bool build_batch(const char *filename, uint32_t version) {
+	hardhat_maker_t *hhm;
+	const void *keys[200], *data[200];
+	uint16_t keylens[200];
+	uint32_t datalens[200];
+	char keybuf[200][64], databuf[100][32];
+	unsigned int u, n;
+	bool ok;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	ok = hardhat_maker_version(hhm, version);
+
+	for(u = 0; ok && u < 1000; u += 100) {
+		for(n = 0; n < 100; n++) {
+			sprintf(keybuf[n], "a/very/long/shared/prefix/%u/file%u", (u + n) % 7, u + n);
+			sprintf(keybuf[n + 100], "a/very//long/./shared/prefix/%u/file%u/", (u + n) % 7, u + n);
+			sprintf(databuf[n], "value %x", (u + n) % 13);
+			keys[n] = keybuf[n];
+			keys[n + 100] = keybuf[n + 100];
+			keylens[n] = strlen(keybuf[n]);
+			keylens[n + 100] = strlen(keybuf[n + 100]);
+			data[n] = databuf[n];
+			data[n + 100] = "duplicate";
+			datalens[n] = strlen(databuf[n]);
+			datalens[n + 100] = 9;
+		}
+		ok = hardhat_maker_add_batch(hhm, keys, keylens, data, datalens, 200);
+	}
+
+	keys[0] = NULL;
+	ok = ok && !hardhat_maker_add_batch(hhm, keys, keylens, data, datalens, 1);
+
+	ok = ok && hardhat_maker_parents(hhm, "", 0);
+	ok = ok && hardhat_maker_finish(hhm);
+	if(!ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	hardhat_maker_free(hhm);
+
+	return ok;
+}
+
+/* Copy a database in directory order, adding every entry twice. Optionally
+	leave out the directories for hardhat_maker_parents() to put back. */
+static bool build_copy(hardhat_t *hh, const char *filename, uint32_t version, bool bulk, bool nodirs) {
+	hardhat_maker_t *hhm;
 	hardhat_cursor_t *hhc;
+	bool ok = true;
+
+	hhm = hardhat_maker_new(filename);
+	if(!hhm)
+		return false;
+
+	ok = hardhat_maker_version(hhm, version) && hardhat_maker_bulk(hhm, bulk);
+
+	hhc = hardhat_cursor(hh, "", 0);
+	if(!hhc)
+		ok = false;
+
+	while(ok) {
+		if(hhc->key && !(nodirs && !hhc->datalen))
+			ok = hardhat_maker_add(hhm, hhc->key, hhc->keylen, hhc->data, hhc->datalen)
+				&& hardhat_maker_add(hhm, hhc->key, hhc->keylen, "duplicate", 9);
+		if(!hardhat_fetch(hhc, true))
+			break;
+	}
+
+	hardhat_cursor_free(hhc);
+
+	ok = ok && hardhat_maker_parents(hhm, "", 0);
+	ok = ok && hardhat_maker_finish(hhm);
+	if(!ok)
+		printf("# %s\n", hardhat_maker_error(hhm));
+
+	hardhat_maker_free(hhm);
+
+	return ok;
+}
+
+/* Check that two databases return the same results for a listing */
+static bool same_listing(hardhat_t *a, hardhat_t *b, const char *prefix, bool recursive) {
+	hardhat_cursor_t *ac, *bc;
+	bool same = true;
+	unsigned int n = 0;
+
+	ac = hardhat_cursor(a, prefix, strlen(prefix));
+	bc = hardhat_cursor(b, prefix, strlen(prefix));
+	if(!ac || !bc)
+		same = false;
+
+	while(same) {
+		same = !ac->key == !bc->key
+			&& (!ac->key || (ac->keylen == bc->keylen && !memcmp(ac->key, bc->key, ac->keylen)
+				&& ac->datalen == bc->datalen && !memcmp(ac->data, bc->data, ac->datalen)));
+		if(ac->key)
+			n++;
+		if(!hardhat_fetch(ac, recursive)) {
+			same = same && !hardhat_fetch(bc, recursive);
+			break;
+		}
+		same = same && hardhat_fetch(bc, recursive);
+	}
+
+	hardhat_cursor_free(ac);
+	hardhat_cursor_free(bc);
+
+	return same && n;
+}
+
+/* A variant of build_tree() that must give the same listing as the plain
+	tree it is compared with, and optionally the same results for one more
+	prefix */
+struct tree_test {
+	const char *file;
+	struct tree_options options;
+	const char *create;
+	const char *same;
+	const char *prefix;
+	bool recursive;
+	const char *check;
+};
+
+/* Variants of the tree of 1000 entries */
+static const struct tree_test small_trees[] = {
+	{"test3b.hh", {.version = 3, .count = 2000, .bulk = true, .entry = twice_entry},
+		"create a version 3 hardhat in bulk mode",
+		"duplicates are removed in bulk mode",
+		"a/very/long/shared/prefix/3/file997", true, "lookups work in bulk mode"},
+	{"test5b.hh", {.version = 5, .count = 2000, .bulk = true, .entry = twice_entry},
+		"create a version 5 hardhat in bulk mode",
+		"duplicates are removed in bulk mode for version 5"},
+	{"test3q.hh", {.version = 3, .count = 1001, .autoparents = true, .entry = parent_entry},
+		"create a version 3 hardhat with parents added at the end",
+		"parents added at the end give the same listing",
+		"a/very/long/shared/prefix", false, "shallow listings work with parents added at the end"},
+	{"test5q.hh", {.version = 5, .count = 1001, .bulk = true, .autoparents = true, .entry = parent_entry},
+		"create a version 5 hardhat in bulk mode with parents added at the end",
+		"parents added at the end give the same listing for version 5"},
+};
+
+/* Variants of the tree of 100000 entries */
+static const struct tree_test large_trees[] = {
+	{"test5t.hh", {.version = 5, .count = 100000, .threads = 4},
+		"create a large hardhat using threads",
+		"listings are the same when using threads",
+		"a/very/long/shared/prefix/6/file99994", true, "lookups are the same when using threads"},
+	{"test3a.hh", {.version = 3, .count = 100000, .arena = 1 << 30},
+		"create a large hardhat with keys in memory",
+		"listings are the same with keys in memory"},
+	{"test4a.hh", {.version = 4, .count = 100000, .arena = 2 << 20},
+		"create a large hardhat with some keys in memory",
+		"listings are the same with some keys in memory"},
+	{"test3w.hh", {.version = 3, .count = 100000, .writers = 2},
+		"create a large hardhat using background writers",
+		"listings are the same with background writers"},
+	{"test5w.hh", {.version = 5, .count = 100000, .writers = 1, .dedup = true},
+		"create a large version 5 hardhat using a background writer",
+		"listings are the same with a background writer"},
+	{"test3g.hh", {.version = 3, .count = 200000, .grouphash = true, .entry = interleaved_entry},
+		"create a large hardhat using the group-probed hash table",
+		"listings are the same with the group-probed hash table"},
+	{"test5g.hh", {.version = 5, .count = 200000, .grouphash = true, .entry = interleaved_entry},
+		"create a large version 5 hardhat using the group-probed hash table",
+		"listings are the same for version 5 with the group-probed hash table"},
+	{"test3e.hh", {.version = 3, .count = 200000, .memory = 65536, .autoparents = true, .entry = interleaved_entry},
+		"create a large hardhat with a memory budget",
+		"listings are the same with a memory budget",
+		"a/very/long/shared/prefix/6/file99994", true, "lookups work with a memory budget"},
+	{"test5e.hh", {.version = 5, .count = 200000, .memory = 65536, .autoparents = true, .entry = interleaved_entry},
+		"create a large version 5 hardhat with a memory budget",
+		"listings are the same for version 5 with a memory budget"},
+	{"test6e.hh", {.version = 6, .count = 200000, .memory = 65536, .autoparents = true, .entry = interleaved_entry},
+		"create a large version 6 hardhat with a memory budget",
+		"listings are the same for version 6 with a memory budget",
+		"a/very/long/shared/prefix/6/file99994", true, "lookups work for version 6 with a memory budget"},
+	{"test3p.hh", {.version = 3, .count = 100000, .mapped = true},
+		"create a large hardhat through a mapping",
+		"listings are the same when written through a mapping"},
+	{"test5p.hh", {.version = 5, .count = 100000, .dedup = true, .mapped = true},
+		"create a large version 5 hardhat through a mapping",
+		"listings are the same for version 5 written through a mapping"},
+};
+
+/* Build each variant and compare it with the reference database */
+static void check_trees(hardhat_t *hh, const char *tmpdir, char *filename, const struct tree_test *tests, size_t num) {
+	const struct tree_test *t;
+	hardhat_t *hh4;
+	size_t z;
+
+	for(z = 0; z < num; z++) {
+		t = tests + z;
+		sprintf(filename, "%s/%s", tmpdir, t->file);
+		tap(build_tree(filename, &t->options), NULL, "%s", t->create);
+		hh4 = hardhat_open(filename);
+		tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "%s", t->same);
+		if(t->prefix)
+			tap(hh && hh4 && same_listing(hh, hh4, t->prefix, t->recursive), NULL, "%s", t->check);
+		hardhat_close(hh4);
+	}
+}
+
+int main(void) {
+	char *filename, *source;
+	const char *tmpdir;
+	hardhat_t *hh, *hh4, *hha, *hhb;
+	hardhat_cursor_t *hhc, *hhc2;
 	hardhat_maker_t *hhm;
 	unsigned int u;
 	size_t z;
 	char key[32], data[32];
 
+	for(u = 0; u < sizeof normalize_tests / sizeof *normalize_tests; u++) {
+		const char *in = normalize_tests[u][0], *out = normalize_tests[u][1];
+		char buf[64];
+		z = hardhat_normalize(buf, in, strlen(in));
+		tap(z == strlen(out) && !memcmp(buf, out, z), NULL, "normalize '%s'", in);
+	}
+
+	tap(check_cmp(), NULL, "hardhat_cmp agrees with the reference on random paths");
+
 	tmpdir = getenv("TMPDIR");
 	if(!tmpdir) bail("no $TMPDIR set");
 
@@ -44,7 +1115,6 @@ int main(void) {
 	hardhat_maker_free(hhm);
 
 	hh = hardhat_open(filename);
-	free(filename);
 	tap(hh, NULL, "open the hardhat for reading");
 
 	if(hh) {
@@ -67,9 +1137,300 @@ int main(void) {
 		}
 	}
 
-	printf("1..%u\n", testcounter);
+	hardhat_close(hh);
+
+	sprintf(filename, "%s/test3.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 3, .count = 1000}), NULL, "create a version 3 hardhat");
+	hh = hardhat_open(filename);
+	tap(hh, NULL, "open the version 3 hardhat");
+
+	sprintf(filename, "%s/test4.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 4, .count = 1000}), NULL, "create a version 4 hardhat");
+	hh4 = hardhat_open(filename);
+	tap(hh4, NULL, "open the version 4 hardhat");
+
+	if(hh && hh4) {
+		tap(same_listing(hh, hh4, "", true), NULL, "recursive listings are the same");
+		tap(same_listing(hh, hh4, "a/very/long/shared/prefix", false), NULL, "shallow listings are the same");
+		tap(same_listing(hh, hh4, "a/very/long/shared/prefix/3", true), NULL, "listings of subdirectories are the same");
+		tap(same_listing(hh, hh4, "a/very/long/shared/prefix/3/file997", true), NULL, "lookups are the same");
+	}
+
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test5.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 5, .count = 1000}), NULL, "create a version 5 hardhat");
+	hh4 = hardhat_open(filename);
+	tap(hh4, NULL, "open the version 5 hardhat");
+
+	if(hh && hh4) {
+		tap(same_listing(hh, hh4, "", true), NULL, "version 5 listings are the same");
+		tap(same_listing(hh, hh4, "a/very/long/shared/prefix/3/file997", true), NULL, "version 5 lookups are the same");
+	}
+
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test6.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 6, .count = 1000}), NULL, "create a version 6 hardhat");
+	hh4 = hardhat_open(filename);
+	tap(hh4, NULL, "open the version 6 hardhat");
+
+	if(hh && hh4) {
+		tap(same_listing(hh, hh4, "", true), NULL, "version 6 listings are the same");
+		tap(same_listing(hh, hh4, "a/very/long/shared/prefix", false), NULL, "version 6 shallow listings are the same");
+		tap(same_listing(hh, hh4, "a/very/long/shared/prefix/3/file997", true), NULL, "version 6 lookups are the same");
+	}
+
+	hardhat_close(hh4);
+
+	check_trees(hh, tmpdir, filename, small_trees, sizeof small_trees / sizeof *small_trees);
+
+	sprintf(filename, "%s/test3m.hh", tmpdir);
+	tap(build_producers(filename, 3, 4, false, false), NULL, "create a version 3 hardhat with several producers");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "producers give the same listing");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test3l.hh", tmpdir);
+	tap(build_producers(filename, 3, 3, true, false), NULL, "producers write out large values of version 3 entries directly");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "a", true), NULL, "producers give the same listing next to large values");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test5m.hh", tmpdir);
+	tap(build_producers(filename, 5, 3, true, false), NULL, "create a version 5 hardhat with several producers");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "a", true), NULL, "producers give the same listing for version 5");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test4n.hh", tmpdir);
+	tap(build_producers(filename, 4, 2, false, true), NULL, "create a version 4 hardhat with producers in bulk mode");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "duplicates from producers are removed in bulk mode");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test3x.hh", tmpdir);
+	tap(build_batch(filename, 3), NULL, "create a version 3 hardhat in batches");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "batches give the same listing");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test5x.hh", tmpdir);
+	tap(build_batch(filename, 5), NULL, "create a version 5 hardhat in batches");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "batches give the same listing for version 5");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test3h.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 3, .count = 1000, .entry = half_entry, .parity = 0}), NULL, "create half of a hardhat");
+	hha = hardhat_open(filename);
+	sprintf(filename, "%s/test5h.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 5, .count = 1000, .entry = half_entry, .parity = 1, .other = "conflict"}), NULL, "create the other half with conflicting entries");
+	hhb = hardhat_open(filename);
+
+	sprintf(filename, "%s/test3j.hh", tmpdir);
+	tap(hha && hhb && build_merge(filename, 3, hha, hhb), NULL, "merge two hardhats");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "merging gives the same listing");
+	tap(hh && hh4 && same_listing(hh, hh4, "a/very/long/shared/prefix/3/file997", true), NULL, "lookups work after merging");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test5j.hh", tmpdir);
+	tap(hha && hhb && build_merge(filename, 5, hhb, hha), NULL, "merge two hardhats the other way around");
+	hh4 = hardhat_open(filename);
+	tap(hh4 && has_value(hh4, "a/very/long/shared/prefix/0/file0", "conflict")
+		&& has_value(hh4, "a/very/long/shared/prefix/1/file1", "value 1"), NULL, "the first input takes precedence");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test3j.hh", tmpdir);
+	hh4 = hardhat_open(filename);
+	tap(hh4 && !build_merge(filename, 3, hh4, hha), NULL, "a hardhat can't be merged into itself without atomic mode");
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "the refused merge leaves the hardhat intact");
+	hardhat_close(hh4);
+
+	hardhat_close(hha);
+	hardhat_close(hhb);
+
+	for(u = 3; u <= 6; u = u == 3 ? 5 : u + 1) {
+		char *base;
+		uint64_t dead;
+		sprintf(filename, "%s/test%u.hh", tmpdir, u);
+		base = strdup(filename);
+		sprintf(filename, "%s/test%uu.hh", tmpdir, u);
+		tap(base && build_update(filename, base, u, false, &dead), NULL, "update a version %u hardhat", u);
+		/* The old values of file0 and file1, and their keys for version 3 */
+		tap(dead >= (u == 3 ? 2 * (6 + 33 + 7) : 2 * 7), NULL, "the replaced and deleted entries are counted as dead bytes");
+		hh4 = hardhat_open(filename);
+		tap(hh && hh4 && count_entries(hh4) == count_entries(hh) + 1, NULL, "an update has the right number of entries");
+		tap(hh4 && has_value(hh4, "a/very/long/shared/prefix/0/file0", "changed"), NULL, "an update replaces entries");
+		tap(hh4 && has_value(hh4, "a/new/file", "new") && has_value(hh4, "a/new", "dir"), NULL, "an update adds entries");
+		tap(hh4 && has_value(hh4, "a/very/long/shared/prefix/2/file2", "value 2")
+			&& has_value(hh4, "a/very", ""), NULL, "an update keeps entries");
+		tap(hh4 && !has_value(hh4, "a/very/long/shared/prefix/1/file1", "value 1"), NULL, "an update deletes entries");
+		tap(hh4 && same_listing(hh4, hh4, "a/very/long/shared/prefix/3", true), NULL, "listings work after an update");
+		hardhat_close(hh4);
+		sprintf(filename, "%s/test%uv.hh", tmpdir, u);
+		tap(base && build_update(filename, base, u, true, &dead), NULL, "update a version %u hardhat in bulk mode", u);
+		hhm = hardhat_maker_new(filename);
+		tap(hhm && base && hardhat_maker_base(hhm, base) && !hardhat_maker_version(hhm, u == 6 ? 5 : u + 1)
+			&& hardhat_maker_version(hhm, 0) == u, NULL, "a version %u base database keeps the layout of its data section", u);
+		hardhat_maker_free(hhm);
+		free(base);
+		hh4 = hardhat_open(filename);
+		tap(hh && hh4 && count_entries(hh4) == count_entries(hh) + 1, NULL, "a bulk update has the right number of entries");
+		tap(hh4 && has_value(hh4, "a/new", "dir") && has_value(hh4, "a/very", ""), NULL, "a bulk update adds only missing parents");
+		hardhat_close(hh4);
+	}
+
+	hhm = hardhat_maker_new(tmpdir);
+	tap(!hhm && errno == EISDIR, NULL, "a maker can't be created for a directory");
+	hardhat_maker_free(hhm);
+
+	sprintf(filename, "%s/testn.hh", tmpdir);
+	hhm = hardhat_maker_new(filename);
+	tap(hhm && access(filename, F_OK) == -1 && errno == ENOENT, NULL, "a new maker doesn't create the hardhat yet");
+	hardhat_maker_free(hhm);
+	tap(access(filename, F_OK) == -1, NULL, "an unused maker leaves nothing behind");
+
+	for(u = 3; u <= 6; u = u == 3 ? 5 : u + 1) {
+		int during;
+		sprintf(filename, "%s/test%ua.hh", tmpdir, u);
+		unlink(filename);
+		tap(build_atomic(filename, u, false, &during), NULL, "create a version %u hardhat atomically", u);
+		tap(during == -1, NULL, "nothing is visible until the hardhat is finished");
+		hh4 = hardhat_open(filename);
+		tap(hh4 && count_entries(hh4) == 100, NULL, "the hardhat is published when it's finished");
+		hardhat_close(hh4);
+		tap(build_atomic(filename, u, true, &during), NULL, "update a version %u hardhat in place atomically", u);
+		tap(during == 100, NULL, "the old hardhat stays intact until the update is finished");
+		hh4 = hardhat_open(filename);
+		tap(hh4 && count_entries(hh4) == 200 && has_value(hh4, "a/0/file0", "value")
+			&& has_value(hh4, "a/1/file199", "value"), NULL, "the update replaces the old hardhat");
+		hardhat_close(hh4);
+		hhm = hardhat_maker_new(filename);
+		tap(hhm && hardhat_maker_base(hhm, filename) && !hardhat_maker_add(hhm, "a/0/file0", 9, "changed", 7),
+			NULL, "a version %u hardhat can't be its own base without atomic mode", u);
+		hardhat_maker_free(hhm);
+		hh4 = hardhat_open(filename);
+		tap(hh4 && count_entries(hh4) == 200 && has_value(hh4, "a/0/file0", "value"), NULL, "the refused hardhat is left intact");
+		hardhat_close(hh4);
+	}
+
+	sprintf(filename, "%s/test3s.hh", tmpdir);
+	tap(hh && build_copy(hh, filename, 3, false, false), NULL, "create a version 3 hardhat from sorted input");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "sorted input gives the same listing");
+	tap(hh && hh4 && same_listing(hh, hh4, "a/very/long/shared/prefix/3/file997", true), NULL, "lookups work for sorted input");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test5s.hh", tmpdir);
+	tap(hh && build_copy(hh, filename, 5, true, false), NULL, "create a version 5 hardhat from sorted input in bulk mode");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "sorted input gives the same listing in bulk mode");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test3p.hh", tmpdir);
+	tap(hh && build_copy(hh, filename, 3, false, true), NULL, "create a version 3 hardhat from sorted input without directories");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "parents are added to sorted input");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test5p.hh", tmpdir);
+	tap(hh && build_copy(hh, filename, 5, true, true), NULL, "create a version 5 hardhat from sorted input without directories in bulk mode");
+	hh4 = hardhat_open(filename);
+	tap(hh && hh4 && same_listing(hh, hh4, "", true), NULL, "parents are added to sorted input in bulk mode");
+	hardhat_close(hh4);
+
+	sprintf(filename, "%s/test4d.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 4, .count = 1000, .dedup = true}), NULL, "create a version 4 hardhat with deduplicated values");
+	hh4 = hardhat_open(filename);
+	tap(hh4, NULL, "open the deduplicated hardhat");
+
+	if(hh && hh4) {
+		tap(same_listing(hh, hh4, "", true), NULL, "deduplicated values are the same");
+		hhc = hardhat_cursor(hh4, "a/very/long/shared/prefix/1/file1", 33);
+		hhc2 = hardhat_cursor(hh4, "a/very/long/shared/prefix/0/file14", 34);
+		tap(hhc && hhc2 && hhc->data && hhc->data == hhc2->data, NULL, "identical values are shared");
+		hardhat_cursor_free(hhc);
+		hardhat_cursor_free(hhc2);
+	}
+
+	hardhat_close(hh4);
+
+	hardhat_close(hh);
+
+	sprintf(filename, "%s/test3t.hh", tmpdir);
+	tap(build_tree(filename, &(struct tree_options){.version = 3, .count = 100000}), NULL, "create a large hardhat");
+	hh = hardhat_open(filename);
+	check_trees(hh, tmpdir, filename, large_trees, sizeof large_trees / sizeof *large_trees);
+
+	source = malloc(strlen(tmpdir) + 20);
+	if(!source) bail("no memory");
+	for(u = 3; u <= 5; u += 2) {
+		sprintf(filename, "%s/test%us1.hh", tmpdir, u);
+		sprintf(source, "%s/test%us4.hh", tmpdir, u);
+		tap(build_tree(filename, &(struct tree_options){.version = u, .count = 100000, .threads = 1, .seed = 12345})
+			&& build_tree(source, &(struct tree_options){.version = u, .count = 100000, .threads = 4, .seed = 12345})
+			&& same_file(filename, source),
+			NULL, "version %u output does not depend on the number of threads", u);
+	}
+	free(source);
+
+	sprintf(filename, "%s/test3z.hh", tmpdir);
+	tap(build_sizes(filename, 3, 0, false) && check_sizes(filename), NULL, "values of all sizes survive a version 3 hardhat");
+	sprintf(filename, "%s/test3o.hh", tmpdir);
+	tap(build_buffered(filename, 3, false), NULL, "records are read back from the output buffer");
+	sprintf(filename, "%s/test5o.hh", tmpdir);
+	tap(build_buffered(filename, 5, true), NULL, "values are read back from the output buffer");
+	sprintf(filename, "%s/test3k.hh", tmpdir);
+	tap(build_keylens(filename, 3), NULL, "keys of all lengths survive a version 3 hardhat");
+	sprintf(filename, "%s/test5k.hh", tmpdir);
+	tap(build_keylens(filename, 5), NULL, "keys of all lengths survive a version 5 hardhat");
+	sprintf(filename, "%s/test5z.hh", tmpdir);
+	tap(build_sizes(filename, 5, 0, false) && check_sizes(filename), NULL, "values of all sizes survive a version 5 hardhat");
+	sprintf(filename, "%s/test5wz.hh", tmpdir);
+	tap(build_sizes(filename, 5, 2, false) && check_sizes(filename), NULL, "values of all sizes survive background writers");
+	sprintf(filename, "%s/test3pz.hh", tmpdir);
+	tap(build_sizes(filename, 3, 0, true) && check_sizes(filename), NULL, "values of all sizes survive a mapped version 3 hardhat");
+	sprintf(filename, "%s/test5pz.hh", tmpdir);
+	tap(build_sizes(filename, 5, 0, true) && check_sizes(filename), NULL, "values of all sizes survive a mapped version 5 hardhat");
+
+	sprintf(filename, "%s/source", tmpdir);
+	source = strdup(filename);
+	sprintf(filename, "%s/test3f.hh", tmpdir);
+	tap(source && build_fd(filename, source, 3, false, false), NULL, "add values from a file to a version 3 hardhat");
+	sprintf(filename, "%s/test5f.hh", tmpdir);
+	tap(source && build_fd(filename, source, 5, false, false), NULL, "add values from a file to a version 5 hardhat");
+	tap(source && build_fd(filename, source, 5, true, false), NULL, "add values from a file with deduplication");
+	tap(source && build_fd(filename, source, 5, false, true), NULL, "add values from a file through a mapping");
+	tap(source && add_fd_eof(filename, source), NULL, "adding a value past the end of its file fails");
+	free(source);
+
+	sprintf(filename, "%s/order.hh", tmpdir);
+	tap(check_order(filename), NULL, "directory is in hardhat_cmp order");
+
+	tap(check_grouphash(), NULL, "group-probed hash tables grow incrementally");
+
+	sprintf(filename, "%s/test4e.hh", tmpdir);
+	hhm = hardhat_maker_new(filename);
+	tap(hhm && hardhat_maker_version(hhm, 4)
+		&& hardhat_maker_finish(hhm), NULL, "create an empty version 4 hardhat");
+	hardhat_maker_free(hhm);
+	hh4 = hardhat_open(filename);
+	tap(hh4, NULL, "open the empty version 4 hardhat");
+
+	sprintf(filename, "%s/test3d.hh", tmpdir);
+	hhm = hardhat_maker_new(filename);
+	tap(hhm && hardhat_maker_deduplicate(hhm, true)
+		&& !hardhat_maker_add(hhm, "x", 1, "y", 1)
+		&& hardhat_maker_fatal(hhm), NULL, "deduplication needs version 4");
+	hardhat_maker_free(hhm);
 
 	hardhat_close(hh);
+	hardhat_close(hh4);
+	free(filename);
+
+	printf("1..%u\n", testcounter);
 
 	return 0;
 }